@@ -47,6 +47,8 @@ chown -R root:root $pkgname/
 cd cli && make  -j 4
 cd ..
 cp cli/ugreen_leds_cli $pkgname/usr/bin
+cp cli/ugreen_monitor $pkgname/usr/bin
+cp cli/ugreen_netdevmon $pkgname/usr/bin
 # cp cli/ugreen_daemon $pkgname/usr/bin
 chmod +x $pkgname/usr/bin
 
@@ -0,0 +1,115 @@
+#include <scsi/sg.h>
+#include <sys/ioctl.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cstring>
+
+#include "ata.h"
+
+#define ATA_PASS_THROUGH_16         0x85
+#define ATA_PROTOCOL_NON_DATA       3
+// return the ATA registers in the sense data
+#define ATA_CK_COND                 0x20
+
+#define ATA_CMD_CHECK_POWER_MODE    0xe5
+#define ATA_CMD_SMART               0xb0
+#define ATA_SMART_RETURN_STATUS     0xda
+
+// the ATA status register
+#define ATA_STATUS_ERR              0x01
+
+ata_device_t::~ata_device_t() {
+    if (_fd >= 0) close(_fd);
+}
+
+int ata_device_t::start(const char *filename) {
+    // O_NONBLOCK: opening a removable or sleeping device must not wait for it
+    if (_fd >= 0) close(_fd);
+    _fd = open(filename, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    return _fd < 0 ? -1 : 0;
+}
+
+int ata_device_t::_non_data_command(uint8_t command, uint8_t features, uint8_t lba_mid,
+        uint8_t lba_high, uint8_t result[4]) {
+    if (_fd < 0) return -1;
+
+    uint8_t cdb[16] = { };
+    cdb[0] = ATA_PASS_THROUGH_16;
+    cdb[1] = ATA_PROTOCOL_NON_DATA << 1;
+    cdb[2] = ATA_CK_COND;
+    cdb[4] = features;
+    cdb[10] = lba_mid;
+    cdb[12] = lba_high;
+    cdb[14] = command;
+
+    uint8_t sense[32] = { };
+
+    sg_io_hdr_t io_hdr;
+    std::memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.dxfer_direction = SG_DXFER_NONE;
+    io_hdr.cmd_len = sizeof(cdb);
+    io_hdr.cmdp = cdb;
+    io_hdr.mx_sb_len = sizeof(sense);
+    io_hdr.sbp = sense;
+    io_hdr.timeout = ATA_COMMAND_TIMEOUT_MS;
+
+    if (ioctl(_fd, SG_IO, &io_hdr) < 0)
+        return -1;
+
+    // with CK_COND, the registers come back in the sense data, either in
+    // the ATA status return descriptor, or in the fixed format
+    uint8_t status;
+    if ((sense[0] & 0x7f) == 0x72 && sense[8] == 0x09 && sense[9] >= 0x0c) {
+        const uint8_t *desc = sense + 8;
+        result[0] = desc[5];
+        result[1] = desc[7];
+        result[2] = desc[9];
+        result[3] = desc[11];
+        status = desc[13];
+    } else if ((sense[0] & 0x7f) == 0x70) {
+        result[0] = sense[6];
+        result[1] = sense[9];
+        result[2] = sense[10];
+        result[3] = sense[11];
+        status = sense[4];
+    } else {
+        // not a SATA disk behind a SCSI / ATA translation
+        return -1;
+    }
+
+    return (status & ATA_STATUS_ERR) ? -1 : 0;
+}
+
+ata_power_mode_t ata_device_t::check_power_mode() {
+    uint8_t result[4];
+    if (_non_data_command(ATA_CMD_CHECK_POWER_MODE, 0, 0, 0, result) != 0)
+        return ata_power_mode_t::unknown;
+
+    switch (result[0]) {
+        case 0x00:
+        case 0x01:
+            return ata_power_mode_t::standby;
+        case 0xff:
+            return ata_power_mode_t::active;
+        default:
+            return ata_power_mode_t::idle;
+    }
+}
+
+ata_smart_status_t ata_device_t::smart_return_status() {
+    uint8_t result[4];
+    if (_non_data_command(ATA_CMD_SMART, ATA_SMART_RETURN_STATUS, 0x4f, 0xc2, result) != 0)
+        return ata_smart_status_t::unknown;
+
+    // the signature is kept if the thresholds are not exceeded, and flipped otherwise
+    if (result[2] == 0x4f && result[3] == 0xc2)
+        return ata_smart_status_t::passed;
+    if (result[2] == 0xf4 && result[3] == 0x2c)
+        return ata_smart_status_t::failing;
+
+    return ata_smart_status_t::unknown;
+}
@@ -0,0 +1,43 @@
+#ifndef __UGREEN_ATA_H__
+#define __UGREEN_ATA_H__
+
+#include <stdint.h>
+
+// timeout of a pass-through command, in milliseconds
+#define ATA_COMMAND_TIMEOUT_MS  10000
+
+// the sector count returned by CHECK POWER MODE
+enum class ata_power_mode_t : uint8_t {
+    unknown = 0, standby, idle, active
+};
+
+enum class ata_smart_status_t : uint8_t {
+    unknown = 0, passed, failing
+};
+
+// ATA commands through SCSI ATA PASS-THROUGH (16) over SG_IO, i.e., what
+// `smartctl` does for SATA disks, without forking it. Neither command below
+// spins up a disk by itself, but SMART RETURN STATUS does if it is standby.
+class ata_device_t {
+
+private:
+    int _fd = -1;
+
+    // a non-data command; result holds the returned count, lba low, mid and high
+    int _non_data_command(uint8_t command, uint8_t features, uint8_t lba_mid,
+            uint8_t lba_high, uint8_t result[4]);
+
+public:
+    ata_device_t() = default;
+    ata_device_t(const ata_device_t &) = delete;
+    ata_device_t &operator=(const ata_device_t &) = delete;
+    ~ata_device_t();
+
+    // e.g., /dev/sda; returns negative on failure
+    int start(const char *filename);
+
+    ata_power_mode_t check_power_mode();
+    ata_smart_status_t smart_return_status();
+};
+
+#endif
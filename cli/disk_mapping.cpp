@@ -0,0 +1,303 @@
+#include <unistd.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "disk_mapping.h"
+#include "led_output.h"
+
+#define SYSFS_BLOCK_PATH        "/sys/block/"
+#define UDEV_DATA_PATH          "/run/udev/data/"
+// the kernel module only registers the LEDs that it has found
+#define LED_MODULE_PATH         "/sys/module/led_ugreen"
+
+// the slots of a product, in the order of the LEDs disk1, disk2, ...
+struct product_slots_t {
+    const char *prefix;
+    const char *series;
+    std::vector<std::string> hctl_map, ata_map;
+};
+
+static const std::vector<std::string> default_hctl_map = {
+    "0:0:0:0", "1:0:0:0", "2:0:0:0", "3:0:0:0", "4:0:0:0", "5:0:0:0", "6:0:0:0", "7:0:0:0"
+};
+
+static const std::vector<std::string> default_ata_map = {
+    "ata1", "ata2", "ata3", "ata4", "ata5", "ata6", "ata7", "ata8"
+};
+
+// NOTE: It is reported that the order should be adjusted for each model, see
+//       the disk mapping section in README.md. Empty maps are the default ones.
+static const product_slots_t product_tables[] = {
+    // tested on DXP6800 Pro
+    { "DXP6800", "DXP6800",
+        { "2:0:0:0", "3:0:0:0", "4:0:0:0", "5:0:0:0", "0:0:0:0", "1:0:0:0" },
+        { "ata3", "ata4", "ata5", "ata6", "ata1", "ata2" } },
+    // tested on DX4600 Pro
+    { "DX4600", "DX4600", { }, { } },
+    { "DX4700", "DX4700", { }, { } },
+    // see issue #19
+    { "DXP2800", "DXP2800", { }, { } },
+    { "DXP4800", "DXP4800", { }, { } },
+    // tested on DXP8800 Plus
+    { "DXP8800", "DXP8800", { }, { } },
+};
+
+struct block_disk_t {
+    std::string name;
+    // the first ataN component of its sysfs path, which is only there for libata (SATA) disks
+    std::string ata_port;
+    std::string hctl;
+    std::string serial;
+};
+
+bool parse_mapping_method(const std::string &name, disk_mapping_method_t &method) {
+    if (name == "ata") method = disk_mapping_method_t::ata;
+    else if (name == "hctl") method = disk_mapping_method_t::hctl;
+    else if (name == "serial") method = disk_mapping_method_t::serial;
+    else return false;
+
+    return true;
+}
+
+static const char *method_name(disk_mapping_method_t method) {
+    switch (method) {
+        case disk_mapping_method_t::ata: return "ata";
+        case disk_mapping_method_t::hctl: return "hctl";
+        case disk_mapping_method_t::serial: return "serial";
+    }
+    return "";
+}
+
+static std::string read_first_line(const std::string &path) {
+    std::ifstream ifs(path);
+    std::string line;
+    std::getline(ifs, line);
+
+    auto end = line.find_last_not_of(" \t\r\n");
+    return end == std::string::npos ? "" : line.substr(0, end + 1);
+}
+
+std::string read_product_name() {
+    return read_first_line(DMI_PRODUCT_NAME_PATH);
+}
+
+static bool is_hctl(const std::string &str) {
+    int colons = 0;
+    for (char c : str) {
+        if (c == ':') ++colons;
+        else if (c < '0' || c > '9') return false;
+    }
+    return colons == 3;
+}
+
+// what lsblk reports: ID_SERIAL_SHORT of udev, or the unit serial number VPD page
+static std::string read_serial(const std::string &dev_name) {
+    const auto dev = read_first_line(SYSFS_BLOCK_PATH + dev_name + "/dev");
+    if (!dev.empty()) {
+        std::ifstream ifs(UDEV_DATA_PATH "b" + dev);
+        for (std::string line; std::getline(ifs, line); ) {
+            if (line.compare(0, 18, "E:ID_SERIAL_SHORT=") == 0)
+                return line.substr(18);
+        }
+    }
+
+    std::ifstream ifs(SYSFS_BLOCK_PATH + dev_name + "/device/vpd_pg80", std::ios::binary);
+    std::string page((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (page.size() < 4) return "";
+
+    std::string serial = page.substr(4, (uint8_t)page[3]);
+    auto begin = serial.find_first_not_of(' ');
+    auto end = serial.find_last_not_of(" \0", std::string::npos, 2);
+    return begin == std::string::npos ? "" : serial.substr(begin, end - begin + 1);
+}
+
+// one pass over the links in /sys/block, e.g.,
+// ../devices/pci0000:00/0000:00:17.0/ata3/host2/target2:0:0/2:0:0:0/block/sda
+static std::vector<block_disk_t> list_block_disks(bool with_serials) {
+    std::vector<block_disk_t> disks;
+
+    DIR *dir = opendir(SYSFS_BLOCK_PATH);
+    if (!dir) return disks;
+
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+
+        char buf[4096];
+        const std::string link = std::string(SYSFS_BLOCK_PATH) + entry->d_name;
+        ssize_t len = readlink(link.c_str(), buf, sizeof(buf) - 1);
+        if (len < 0) continue;
+        buf[len] = '\0';
+
+        block_disk_t disk;
+        disk.name = entry->d_name;
+
+        std::istringstream iss(buf);
+        std::string component, last_component;
+        for (std::string prev; std::getline(iss, component, '/'); prev = component) {
+            if (disk.ata_port.empty() && component.size() > 3 && component.compare(0, 3, "ata") == 0
+                    && std::all_of(component.begin() + 3, component.end(), ::isdigit))
+                disk.ata_port = component;
+            if (component == "block") last_component = prev;
+        }
+
+        if (is_hctl(last_component)) disk.hctl = last_component;
+        if (with_serials && !disk.ata_port.empty()) disk.serial = read_serial(disk.name);
+
+        disks.push_back(std::move(disk));
+    }
+
+    closedir(dir);
+
+    std::sort(disks.begin(), disks.end(), [](const block_disk_t &a, const block_disk_t &b) {
+        return a.name < b.name;
+    });
+    return disks;
+}
+
+static std::vector<std::string> list_block_names() {
+    std::vector<std::string> names;
+
+    DIR *dir = opendir(SYSFS_BLOCK_PATH);
+    if (!dir) return names;
+
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static const product_slots_t *find_product(const std::string &product_name) {
+    for (const auto &product : product_tables) {
+        if (product_name.compare(0, std::strlen(product.prefix), product.prefix) == 0)
+            return &product;
+    }
+    return nullptr;
+}
+
+static std::string cache_key(const std::string &product_name, disk_mapping_method_t method,
+        const std::vector<std::string> &serials, bool has_module) {
+    std::string key = product_name + "|" + method_name(method) + (has_module ? "|module|" : "|");
+    for (const auto &serial : serials) key += serial + " ";
+    key += "|";
+    for (const auto &name : list_block_names()) key += name + " ";
+    // the module registers its LEDs asynchronously, i.e., some may appear later
+    if (has_module) {
+        key += "|";
+        for (std::size_t i = 1; i <= default_ata_map.size(); ++i) {
+            const auto led_name = "disk" + std::to_string(i);
+            if (is_sysfs_led(led_name)) key += led_name + " ";
+        }
+    }
+    return key;
+}
+
+// lines "LED DEV SLOT" after the key, where an empty field is "-"
+static bool load_cache(const std::string &key, std::vector<disk_slot_t> &slots) {
+    std::ifstream ifs(DISK_MAPPING_CACHE_PATH);
+    std::string line;
+    if (!std::getline(ifs, line) || line != key) return false;
+
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        disk_slot_t slot;
+        if (!(iss >> slot.led_name >> slot.dev_name >> slot.slot)) return false;
+
+        if (slot.dev_name == "-") slot.dev_name.clear();
+        if (slot.slot == "-") slot.slot.clear();
+        slots.push_back(std::move(slot));
+    }
+
+    return true;
+}
+
+static void save_cache(const std::string &key, const std::vector<disk_slot_t> &slots) {
+    const std::string tmp_path = DISK_MAPPING_CACHE_PATH ".tmp";
+    {
+        std::ofstream ofs(tmp_path);
+        if (!ofs) return;
+
+        ofs << key << "\n";
+        for (const auto &slot : slots) {
+            ofs << slot.led_name << " " << (slot.dev_name.empty() ? "-" : slot.dev_name)
+                << " " << (slot.slot.empty() ? "-" : slot.slot) << "\n";
+        }
+
+        if (!ofs) return;
+    }
+
+    std::rename(tmp_path.c_str(), DISK_MAPPING_CACHE_PATH);
+}
+
+void invalidate_disk_slots_cache() {
+    unlink(DISK_MAPPING_CACHE_PATH);
+}
+
+std::vector<disk_slot_t> resolve_disk_slots(disk_mapping_method_t method,
+        const std::vector<std::string> &serials) {
+    const auto product_name = read_product_name();
+    const auto *product = find_product(product_name);
+
+    if (product) {
+        std::cerr << "Found UGREEN " << product->series << " series" << std::endl;
+    } else if (method != disk_mapping_method_t::serial) {
+        std::cerr << "Using the default HCTL order for " << (product_name.empty() ? "an unknown product" : product_name)
+                  << ". Please check it maps to your disk slots correctly (see the disk mapping section in README.md)." << std::endl;
+    }
+
+    const bool has_module = access(LED_MODULE_PATH, F_OK) == 0;
+
+    std::vector<disk_slot_t> slots;
+    const auto key = cache_key(product_name, method, serials, has_module);
+    if (load_cache(key, slots)) return slots;
+    slots.clear();
+
+    const auto &hctl_map = product && !product->hctl_map.empty() ? product->hctl_map : default_hctl_map;
+    const auto &ata_map = product && !product->ata_map.empty() ? product->ata_map : default_ata_map;
+    const auto disks = list_block_disks(method == disk_mapping_method_t::serial);
+
+    for (std::size_t i = 0; i < ata_map.size(); ++i) {
+        disk_slot_t slot;
+        slot.led_name = "disk" + std::to_string(i + 1);
+        if (has_module && !is_sysfs_led(slot.led_name)) continue;
+
+        // hctl and serial only take SATA disks, as `lsblk -S | grep sata` did
+        for (const auto &disk : disks) {
+            bool is_match = false;
+            switch (method) {
+                case disk_mapping_method_t::ata:
+                    is_match = disk.ata_port == ata_map[i];
+                    break;
+                case disk_mapping_method_t::hctl:
+                    is_match = !disk.ata_port.empty() && i < hctl_map.size() && disk.hctl == hctl_map[i];
+                    break;
+                case disk_mapping_method_t::serial:
+                    is_match = !disk.ata_port.empty() && i < serials.size() && disk.serial == serials[i];
+                    break;
+            }
+
+            if (is_match) {
+                slot.dev_name = disk.name;
+                break;
+            }
+        }
+
+        if (method == disk_mapping_method_t::ata)
+            slot.slot = ata_map[i];
+        else if (method == disk_mapping_method_t::hctl && i < hctl_map.size())
+            slot.slot = hctl_map[i];
+
+        slots.push_back(std::move(slot));
+    }
+
+    save_cache(key, slots);
+    return slots;
+}
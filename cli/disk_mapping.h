@@ -0,0 +1,43 @@
+#ifndef __UGREEN_DISK_MAPPING_H__
+#define __UGREEN_DISK_MAPPING_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// in /run, so that it is dropped at every boot (like the LED discovery cache)
+#define DISK_MAPPING_CACHE_PATH "/run/ugreen_monitor.slots"
+// what `dmidecode --string system-product-name` reads
+#define DMI_PRODUCT_NAME_PATH   "/sys/class/dmi/id/product_name"
+
+// MAPPING_METHOD in ugreen-leds.conf
+enum class disk_mapping_method_t : uint8_t {
+    ata = 0, hctl, serial
+};
+
+struct disk_slot_t {
+    std::string led_name;
+    // the block device in the slot, or empty if the slot is empty
+    std::string dev_name;
+    // the ata port or the hctl of the slot, which is also a component of
+    // the sysfs path of any disk inserted later (empty for serial)
+    std::string slot;
+};
+
+bool parse_mapping_method(const std::string &name, disk_mapping_method_t &method);
+
+// the product name in DMI, or empty if it is unknown
+std::string read_product_name();
+
+// Map the disk LEDs of the product to the disks in the same way as
+// ugreen-diskiomon, by walking /sys/block once. The result is cached in
+// DISK_MAPPING_CACHE_PATH, keyed by the product, the method, the serials,
+// and the names of the block devices, and reused if they are unchanged.
+// LEDs that the kernel module has not found are left out.
+std::vector<disk_slot_t> resolve_disk_slots(disk_mapping_method_t method,
+        const std::vector<std::string> &serials);
+
+// to be called when a disk is added or removed
+void invalidate_disk_slots_cache();
+
+#endif
@@ -6,95 +6,190 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
 #include "i2c.h"
 
 
-i2c_device_t::~i2c_device_t() {
-    if (_fd) close(_fd);
+void i2c_stats_t::record(uint64_t latency_us, bool failed) {
+    int bucket = 0;
+    while (bucket < I2C_LATENCY_BUCKETS - 1 && (latency_us >> bucket) != 0)
+        ++bucket;
+
+    ++transactions;
+    if (failed) ++errors;
+    ++latency[bucket];
 }
 
-int i2c_device_t::start(const char *filename, uint16_t addr) {
-    _fd = open(filename, O_RDWR);
+uint32_t i2c_stats_t::latency_percentile_us(unsigned percentile) const {
+    if (transactions == 0) return 0;
 
-    if (_fd < 0) {
-        int rc = _fd;
-        _fd = 0;
-        return rc;
+    uint64_t count = 0;
+    for (int i = 0; i < I2C_LATENCY_BUCKETS; ++i) {
+        count += latency[i];
+        if (count * 100 >= transactions * percentile)
+            return 1u << i;
     }
 
-    int rc = ioctl(_fd, I2C_SLAVE, addr);
-    if (rc < 0) {
-        close(_fd);
-        _fd = 0;
-        return rc;
+    return 1u << (I2C_LATENCY_BUCKETS - 1);
+}
+
+void i2c_rate_limit_t::configure(uint32_t rate, uint32_t burst) {
+    _rate = rate;
+    _burst = std::max<uint32_t>(burst, 1);
+    _tokens = _burst;
+    _last = clock::now();
+}
+
+void i2c_rate_limit_t::_refill() {
+    auto now = clock::now();
+    double elapsed = std::chrono::duration<double>(now - _last).count();
+    _tokens = std::min(_burst, _tokens + elapsed * _rate);
+    _last = now;
+}
+
+uint32_t i2c_rate_limit_t::delay_us() {
+    if (!is_enabled()) return 0;
+
+    _refill();
+    return _tokens >= 1 ? 0 : (uint32_t)std::ceil((1 - _tokens) / _rate * 1e6);
+}
+
+void i2c_rate_limit_t::acquire() {
+    if (!is_enabled()) return;
+
+    uint32_t delay = delay_us();
+    if (delay > 0) {
+        usleep(delay);
+        _refill();
     }
 
-    return 0;
+    // a token may be missing by rounding, which is taken from the next refill
+    _tokens -= 1;
+}
+
+// the I2C device in /dev, through the SMBus ioctls of i2c-dev
+class i2c_dev_transport_t : public i2c_transport_t {
+
+private:
+    int _fd;
+
+    int _smbus(uint8_t read_write, uint8_t command, uint32_t size, i2c_smbus_data &smbus_data) {
+        i2c_smbus_ioctl_data ioctl_data;
+        ioctl_data.size = size;
+        ioctl_data.read_write = read_write;
+        ioctl_data.command = command;
+        ioctl_data.data = &smbus_data;
+
+        return ioctl(_fd, I2C_SMBUS, &ioctl_data);
+    }
+
+public:
+    explicit i2c_dev_transport_t(int fd) : _fd(fd) { }
+    ~i2c_dev_transport_t() override { close(_fd); }
+
+    int read_i2c_block(uint8_t command, uint8_t *data, uint32_t size) override {
+        i2c_smbus_data smbus_data;
+        smbus_data.block[0] = size;
+
+        int rc = _smbus(I2C_SMBUS_READ, command, I2C_SMBUS_I2C_BLOCK_DATA, smbus_data);
+        if (rc < 0) return rc;
+
+        std::copy_n(smbus_data.block + 1, size, data);
+        return 0;
+    }
+
+    int write_i2c_block(uint8_t command, const uint8_t *data, uint32_t size) override {
+        i2c_smbus_data smbus_data;
+        smbus_data.block[0] = size;
+        std::copy_n(data, size, smbus_data.block + 1);
+
+        return _smbus(I2C_SMBUS_WRITE, command, I2C_SMBUS_I2C_BLOCK_DATA, smbus_data);
+    }
+
+    int read_byte(uint8_t command) override {
+        i2c_smbus_data smbus_data;
+
+        int rc = _smbus(I2C_SMBUS_READ, command, I2C_SMBUS_BYTE_DATA, smbus_data);
+        if (rc < 0) return rc;
+
+        return smbus_data.byte & 0xff;
+    }
 };
 
-std::vector<uint8_t> i2c_device_t::read_block_data(uint8_t command, uint32_t size) {
-    if (!_fd) return { };
+template <typename F>
+int i2c_device_t::_transfer(F &&transfer) {
+    // the latencies do not include the waits for the budget
+    _rate_limit.acquire();
 
-    if (size > I2C_SMBUS_BLOCK_MAX)
-        return { };
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
 
-    i2c_smbus_data smbus_data;
-    smbus_data.block[0] = size;
+    int rc = transfer();
 
-    i2c_smbus_ioctl_data ioctl_data;
-    ioctl_data.size = I2C_SMBUS_I2C_BLOCK_DATA;
-    ioctl_data.read_write = I2C_SMBUS_READ;
-    ioctl_data.command = command;
-    ioctl_data.data = &smbus_data;
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    _stats.record(elapsed, rc < 0);
 
-    int rc = ioctl(_fd, I2C_SMBUS, &ioctl_data);
+    return rc;
+}
 
-    if (rc < 0) return { };
+int i2c_device_t::start(const char *filename, uint16_t addr) {
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return fd;
 
-    std::vector<uint8_t> data;
-    for (uint32_t i = 0; i < size; ++i)
-        data.push_back(smbus_data.block[i + 1]);
+    int rc = ioctl(fd, I2C_SLAVE, addr);
+    if (rc < 0) {
+        close(fd);
+        return rc;
+    }
 
-    return data;
+    _transport = std::make_unique<i2c_dev_transport_t>(fd);
+    return 0;
+};
+
+void i2c_device_t::start(std::unique_ptr<i2c_transport_t> transport) {
+    _transport = std::move(transport);
 }
 
-int i2c_device_t::write_block_data(uint8_t command, std::vector<uint8_t> data) {
-    if (!_fd) return -1;
+int i2c_device_t::read_block_data(uint8_t command, uint8_t *data, uint32_t size) {
+    if (!_transport) return -1;
 
-    uint32_t size = data.size();
     if (size > I2C_SMBUS_BLOCK_MAX)
-        size = I2C_SMBUS_BLOCK_MAX;
+        return -1;
 
-    i2c_smbus_data smbus_data;
-    smbus_data.block[0] = size;
-    for (uint32_t i = 0; i < size; ++i)
-        smbus_data.block[i + 1] = data[i];
+    return _transfer([&] { return _transport->read_i2c_block(command, data, size); });
+}
 
-    i2c_smbus_ioctl_data ioctl_data;
-    ioctl_data.size = I2C_SMBUS_I2C_BLOCK_DATA;
-    ioctl_data.read_write = I2C_SMBUS_WRITE;
-    ioctl_data.command = command;
-    ioctl_data.data = &smbus_data;
+int i2c_device_t::write_block_data(uint8_t command, const uint8_t *data, uint32_t size) {
+    if (!_transport) return -1;
 
-    int rc = ioctl(_fd, I2C_SMBUS, &ioctl_data);
+    if (size > I2C_SMBUS_BLOCK_MAX)
+        size = I2C_SMBUS_BLOCK_MAX;
 
-    return rc;
+    return _transfer([&] { return _transport->write_i2c_block(command, data, size); });
 }
 
-uint8_t i2c_device_t::read_byte_data(uint8_t command) {
-    if (!_fd) return { };
+std::vector<uint8_t> i2c_device_t::read_block_data(uint8_t command, uint32_t size) {
+    std::vector<uint8_t> data(size);
 
-    i2c_smbus_data smbus_data;
+    if (read_block_data(command, data.data(), size) != 0) 
+        return { };
+
+    return data;
+}
 
-    i2c_smbus_ioctl_data ioctl_data;
-    ioctl_data.size = I2C_SMBUS_BYTE_DATA;
-    ioctl_data.read_write = I2C_SMBUS_READ;
-    ioctl_data.command = command;
-    ioctl_data.data = &smbus_data;
+int i2c_device_t::write_block_data(uint8_t command, const std::vector<uint8_t> &data) {
+    return write_block_data(command, data.data(), data.size());
+}
+
+uint8_t i2c_device_t::read_byte_data(uint8_t command) {
+    if (!_transport) return { };
 
-    int rc = ioctl(_fd, I2C_SMBUS, &ioctl_data);
+    int rc = _transfer([&] { return _transport->read_byte(command); });
 
     if (rc < 0) return { };
 
-    return smbus_data.byte & 0xff;
+    return rc & 0xff;
 }
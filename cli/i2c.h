@@ -2,19 +2,104 @@
 #define __UGREEN_I2C_H__
 
 #include <stdint.h>
+#include <cstddef>
+#include <array>
+#include <chrono>
+#include <memory>
 #include <vector>
 
+// transfer latencies are counted in power-of-two microsecond buckets
+#define I2C_LATENCY_BUCKETS 16
+
+struct i2c_stats_t {
+    uint64_t transactions = 0;
+    uint64_t errors = 0;
+    // the bucket i holds transfers shorter than 2^i us (the last one holds the rest)
+    std::array<uint64_t, I2C_LATENCY_BUCKETS> latency { };
+
+    void record(uint64_t latency_us, bool failed);
+    // an upper bound of the given percentile of latencies, in microseconds
+    uint32_t latency_percentile_us(unsigned percentile) const;
+};
+
+// A token bucket of transfers, so that the LEDs take a bounded share of a
+// bus shared with other devices (e.g., SPD EEPROMs and sensors on the SMBus
+// I801 adapter): up to burst transfers at once, refilled at rate transfers
+// per second. A rate of 0 disables it.
+class i2c_rate_limit_t {
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    double _rate = 0, _burst = 0, _tokens = 0;
+    clock::time_point _last;
+
+    void _refill();
+
+public:
+    void configure(uint32_t rate, uint32_t burst);
+    bool is_enabled() const { return _rate > 0; }
+
+    // the time until a transfer may be sent, in microseconds (0 if now)
+    uint32_t delay_us();
+    // wait until a transfer may be sent, and account it
+    void acquire();
+};
+
+// The SMBus transfers under i2c_device_t, which go to the I2C device in /dev,
+// or to a simulation (see ugreen_mcu_sim.h). Each returns negative on failure,
+// e.g., -EREMOTEIO for a NACK.
+class i2c_transport_t {
+
+public:
+    virtual ~i2c_transport_t() = default;
+
+    // the size is at most I2C_SMBUS_BLOCK_MAX (32), and 0 is returned on success
+    virtual int read_i2c_block(uint8_t command, uint8_t *data, uint32_t size) = 0;
+    virtual int write_i2c_block(uint8_t command, const uint8_t *data, uint32_t size) = 0;
+    // the byte read on success
+    virtual int read_byte(uint8_t command) = 0;
+};
+
 class i2c_device_t {
 
 private:
-    int _fd;
+    std::unique_ptr<i2c_transport_t> _transport;
+    i2c_stats_t _stats;
+    i2c_rate_limit_t _rate_limit;
+
+    template <typename F>
+    int _transfer(F &&transfer);
 
 public:
-    ~i2c_device_t();
+    const i2c_stats_t &stats() const { return _stats; }
+
+    // pace all transfers of the device (see i2c_rate_limit_t)
+    void set_rate_limit(uint32_t rate, uint32_t burst) { _rate_limit.configure(rate, burst); }
+    uint32_t rate_limit_delay_us() { return _rate_limit.delay_us(); }
 
     int start(const char *filename, uint16_t addr);
+    // use another transport, e.g., a simulated MCU
+    void start(std::unique_ptr<i2c_transport_t> transport);
+
+    // Read / write block data without allocations. The size must not exceed 
+    // I2C_SMBUS_BLOCK_MAX (32). Return 0 on success, and negative on failure.
+    int read_block_data(uint8_t command, uint8_t *data, uint32_t size);
+    int write_block_data(uint8_t command, const uint8_t *data, uint32_t size);
+
+    template <std::size_t N>
+    int read_block_data(uint8_t command, std::array<uint8_t, N> &data) {
+        return read_block_data(command, data.data(), N);
+    }
+
+    template <std::size_t N>
+    int write_block_data(uint8_t command, const std::array<uint8_t, N> &data) {
+        return write_block_data(command, data.data(), N);
+    }
+
+    // returns an empty vector on failure
     std::vector<uint8_t> read_block_data(uint8_t command, uint32_t size);
-    int write_block_data(uint8_t command, std::vector<uint8_t> data);
+    int write_block_data(uint8_t command, const std::vector<uint8_t> &data);
     uint8_t read_byte_data(uint8_t command);
 
 };
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "led_config.h"
+
+static std::string trim(const std::string &str) {
+    auto begin = str.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return "";
+    auto end = str.find_last_not_of(" \t\r");
+    return str.substr(begin, end - begin + 1);
+}
+
+// the value of an assignment, e.g., "255 0 0" or 0.1 # comment
+static bool parse_value(const std::string &text, std::string &value) {
+    value.clear();
+
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+
+        if (c == '"' || c == '\'') {
+            auto end = text.find(c, i + 1);
+            if (end == std::string::npos) return false;
+            value += text.substr(i + 1, end - i - 1);
+            i = end;
+        } else if (c == ' ' || c == '\t' || c == '\r') {
+            // anything after the value is a comment or another command
+            break;
+        } else if (c == '$' || c == '`') {
+            // expansions are left to the shell
+            return false;
+        } else {
+            value += c;
+        }
+    }
+
+    return true;
+}
+
+bool led_config_t::load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!ifs) return false;
+
+    for (std::string line; std::getline(ifs, line); ) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        if (line.compare(0, 7, "export ") == 0)
+            line = trim(line.substr(7));
+
+        auto eq = line.find('=');
+        if (eq == std::string::npos || eq == 0) continue;
+
+        const auto key = line.substr(0, eq);
+        if (key.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_") != std::string::npos)
+            continue;
+
+        std::string value;
+        if (parse_value(line.substr(eq + 1), value))
+            _values[key] = value;
+        else
+            std::cerr << "Err: " << path << ": the value of " << key << " is not understood, ignoring it" << std::endl;
+    }
+
+    return true;
+}
+
+bool led_config_t::_find(const std::string &key, std::string &value) const {
+    auto it = _values.find(key);
+    if (it == _values.end()) return false;
+
+    value = it->second;
+    return true;
+}
+
+void led_config_t::_report_invalid(const std::string &key, const std::string &value) const {
+    std::cerr << "Err: " << key << "=\"" << value << "\" is invalid, using the default" << std::endl;
+}
+
+std::string led_config_t::get(const std::string &key, const std::string &default_value) const {
+    std::string value;
+    return _find(key, value) ? value : default_value;
+}
+
+bool led_config_t::get_bool(const std::string &key, bool default_value) const {
+    std::string value;
+    if (!_find(key, value)) return default_value;
+
+    if (value == "true") return true;
+    if (value == "false") return false;
+
+    _report_invalid(key, value);
+    return default_value;
+}
+
+long led_config_t::get_integer(const std::string &key, long low, long high, long default_value) const {
+    std::string value;
+    if (!_find(key, value)) return default_value;
+
+    char *end;
+    errno = 0;
+    long x = std::strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || errno == ERANGE || x < low || x > high) {
+        _report_invalid(key, value);
+        return default_value;
+    }
+
+    return x;
+}
+
+long led_config_t::get_seconds_ms(const std::string &key, long default_ms) const {
+    std::string value;
+    if (!_find(key, value)) return default_ms;
+
+    // `sleep` also takes a trailing s, e.g., 5s
+    if (!value.empty() && value.back() == 's')
+        value.pop_back();
+
+    char *end;
+    double seconds = std::strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0' || !(seconds > 0)) {
+        _report_invalid(key, value);
+        return default_ms;
+    }
+
+    return std::max(1L, std::lround(seconds * 1000));
+}
+
+rgb_color_t led_config_t::get_color(const std::string &key, const rgb_color_t &default_color) const {
+    std::string value;
+    if (!_find(key, value)) return default_color;
+
+    std::istringstream iss(value);
+    int r, g, b;
+    std::string rest;
+    if (!(iss >> r >> g >> b) || (iss >> rest) || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+        _report_invalid(key, value);
+        return default_color;
+    }
+
+    return { (uint8_t)r, (uint8_t)g, (uint8_t)b };
+}
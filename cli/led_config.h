@@ -0,0 +1,40 @@
+#ifndef __UGREEN_LED_CONFIG_H__
+#define __UGREEN_LED_CONFIG_H__
+
+#include <map>
+#include <string>
+
+#include "led_output.h"
+
+#define UGREEN_LEDS_CONF_PATH   "/etc/ugreen-leds.conf"
+
+// The assignments in ugreen-leds.conf, which is sourced by the scripts.
+// Only the subset of the shell syntax used there is understood, i.e.,
+// KEY=VALUE lines with quoted or bare values and comments, without any
+// expansion. The getters fall back to the defaults of the scripts for
+// keys that are missing, and also (with a message) for invalid values.
+class led_config_t {
+
+private:
+    std::map<std::string, std::string> _values;
+
+    bool _find(const std::string &key, std::string &value) const;
+    void _report_invalid(const std::string &key, const std::string &value) const;
+
+public:
+    // returns false if the file cannot be read
+    bool load(const std::string &path);
+
+    bool has(const std::string &key) const { return _values.count(key) != 0; }
+
+    std::string get(const std::string &key, const std::string &default_value) const;
+    // true or false
+    bool get_bool(const std::string &key, bool default_value) const;
+    long get_integer(const std::string &key, long low, long high, long default_value) const;
+    // a positive number of seconds, e.g., 0.1, in milliseconds
+    long get_seconds_ms(const std::string &key, long default_ms) const;
+    // "R G B"
+    rgb_color_t get_color(const std::string &key, const rgb_color_t &default_color) const;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "led-ugreen-ioctl.h"
+#include "led_output.h"
+#include "ugreen_daemon.h"
+#include "ugreen_leds.h"
+
+static bool parse_led_type(const std::string &name, ugreen_leds_t::led_type_t &type) {
+    static const std::array<const char *, UGREEN_MAX_LED_NUMBER> led_names = {
+        "power", "netdev", "disk1", "disk2", "disk3", "disk4", "disk5", "disk6", "disk7", "disk8"
+    };
+
+    for (std::size_t i = 0; i < led_names.size(); ++i) {
+        if (name == led_names[i]) {
+            type = (ugreen_leds_t::led_type_t)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool is_sysfs_led(const std::string &led_name) {
+    return access((SYSFS_LEDS_PATH + led_name).c_str(), F_OK) == 0;
+}
+
+bool write_led_attr(const std::string &led_name, const char *attr, const std::string &value) {
+    const auto path = SYSFS_LEDS_PATH + led_name + "/" + attr;
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    bool ok = write(fd, value.data(), value.size()) == (ssize_t)value.size();
+    close(fd);
+    return ok;
+}
+
+// opened at the first use only, as the LEDs are usually driven by the module
+static ugreen_leds_t *leds_controller() {
+    static std::unique_ptr<ugreen_leds_t> controller;
+    if (!controller) {
+        controller = std::make_unique<ugreen_leds_t>();
+        if (controller->start() != 0) {
+            std::cerr << "Err: fail to open the I2C device." << std::endl;
+            controller.reset();
+        }
+    }
+
+    return controller.get();
+}
+
+// apply the changes through the daemon if it is running, or directly otherwise
+static int apply_changes(const std::string &led_name, const std::vector<std::string> &args,
+        const std::vector<ugreen_leds_t::led_change_t> &changes) {
+    daemon_response_t response;
+    if (send_daemon_request(UGREEN_DAEMON_SOCKET_PATH, args, response)) {
+        std::cerr << response.err;
+        return response.rc;
+    }
+
+    auto *controller = leds_controller();
+    if (!controller) return -1;
+
+    int rc = controller->apply(changes);
+    if (rc != 0)
+        std::cerr << "Err: fail to change the LED " << led_name << std::endl;
+
+    return rc;
+}
+
+int set_led_color(const std::string &led_name, const rgb_color_t &color, uint8_t brightness) {
+    const auto r = std::to_string(color.r), g = std::to_string(color.g), b = std::to_string(color.b);
+
+    if (is_sysfs_led(led_name)) {
+        bool ok = write_led_attr(led_name, "color", r + " " + g + " " + b);
+        ok = write_led_attr(led_name, "brightness", std::to_string(brightness)) && ok;
+        return ok ? 0 : -1;
+    }
+
+    ugreen_leds_t::led_type_t id;
+    if (!parse_led_type(led_name, id)) {
+        std::cerr << "Err: unknown LED name " << led_name << std::endl;
+        return -1;
+    }
+
+    return apply_changes(led_name, {
+        led_name, "-color", r, g, b, "-brightness", std::to_string(brightness), "-on"
+    }, {
+        ugreen_leds_t::rgb_change(id, color.r, color.g, color.b),
+        ugreen_leds_t::brightness_change(id, brightness),
+        ugreen_leds_t::onoff_change(id, 1),
+    });
+}
+
+// Send the changes of LEDs in sysfs in one UGREEN_LED_IOC_SET_STATES, returning 
+// the number of LEDs failed, or -1 if the device is unavailable (e.g., an older 
+// kernel module), in which case nothing has been changed.
+static int set_sysfs_led_colors(const std::vector<led_color_change_t> &changes) {
+    std::vector<ugreen_led_ioctl_state> states;
+    for (const auto &change : changes) {
+        ugreen_leds_t::led_type_t id;
+        if (!parse_led_type(change.led_name, id) || states.size() == UGREEN_LED_IOCTL_MAX_STATES)
+            return -1;
+
+        ugreen_led_ioctl_state state { };
+        state.led_id = (uint8_t)id;
+        state.fields = UGREEN_LED_IOCTL_COLOR | UGREEN_LED_IOCTL_BRIGHTNESS;
+        state.brightness = change.brightness;
+        state.r = change.color.r;
+        state.g = change.color.g;
+        state.b = change.color.b;
+        states.push_back(state);
+    }
+
+    int fd = open(UGREEN_LED_DEVICE_PATH, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ugreen_led_ioctl_batch batch { };
+    batch.count = states.size();
+    batch.states = (uint64_t)(uintptr_t)states.data();
+
+    int rc = ioctl(fd, UGREEN_LED_IOC_SET_STATES, &batch);
+    close(fd);
+    if (rc != 0) return -1;
+
+    int failed = 0;
+    for (std::size_t i = 0; i < states.size(); ++i) {
+        if (states[i].result != 0) {
+            std::cerr << "Err: fail to change the LED " << changes[i].led_name
+                      << ": " << std::strerror(-states[i].result) << std::endl;
+            ++failed;
+        }
+    }
+
+    return failed;
+}
+
+int set_led_colors(const std::vector<led_color_change_t> &changes) {
+    std::vector<led_color_change_t> sysfs_changes, other_changes;
+    for (const auto &change : changes)
+        (is_sysfs_led(change.led_name) ? sysfs_changes : other_changes).push_back(change);
+
+    int failed = 0;
+    if (!sysfs_changes.empty()) {
+        int rc = set_sysfs_led_colors(sysfs_changes);
+        if (rc >= 0) failed += rc;
+        else other_changes.insert(other_changes.end(), sysfs_changes.begin(), sysfs_changes.end());
+    }
+
+    for (const auto &change : other_changes) {
+        if (set_led_color(change.led_name, change.color, change.brightness) != 0)
+            ++failed;
+    }
+
+    return failed;
+}
+
+int set_led_blink(const std::string &led_name, uint16_t t_on, uint16_t t_off) {
+    if (is_sysfs_led(led_name)) {
+        const auto blink_type = t_on == 0 ? std::string("none\n")
+            : "blink " + std::to_string(t_on) + " " + std::to_string(t_off) + "\n";
+        return write_led_attr(led_name, "blink_type", blink_type) ? 0 : -1;
+    }
+
+    ugreen_leds_t::led_type_t id;
+    if (!parse_led_type(led_name, id)) {
+        std::cerr << "Err: unknown LED name " << led_name << std::endl;
+        return -1;
+    }
+
+    if (t_on == 0)
+        return apply_changes(led_name, { led_name, "-on" }, { ugreen_leds_t::onoff_change(id, 1) });
+
+    return apply_changes(led_name, {
+        led_name, "-blink", std::to_string(t_on), std::to_string(t_off)
+    }, {
+        ugreen_leds_t::blink_change(id, t_on, t_off)
+    });
+}
@@ -0,0 +1,48 @@
+#ifndef __UGREEN_LED_OUTPUT_H__
+#define __UGREEN_LED_OUTPUT_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define SYSFS_LEDS_PATH         "/sys/class/leds/"
+
+struct rgb_color_t {
+    uint8_t r, g, b;
+
+    bool operator==(const rgb_color_t &other) const {
+        return r == other.r && g == other.g && b == other.b;
+    }
+    bool operator!=(const rgb_color_t &other) const { return !(*this == other); }
+};
+
+// whether the kernel module drives the LED, i.e., /sys/class/leds/LED exists
+bool is_sysfs_led(const std::string &led_name);
+
+// write an attribute in /sys/class/leds/LED, returning false on failure
+bool write_led_attr(const std::string &led_name, const char *attr, const std::string &value);
+
+// Light up a LED in a color, for the monitors. If the kernel module is 
+// loaded, it owns the controller, and the LED is changed through sysfs
+// (the trigger is kept). Otherwise, the change is sent to the daemon of 
+// ugreen_leds_cli if it is running (so that it does not interleave with 
+// other commands on the bus), or applied through ugreen_leds_t directly.
+// Returns 0 on success.
+int set_led_color(const std::string &led_name, const rgb_color_t &color, uint8_t brightness);
+
+struct led_color_change_t {
+    std::string led_name;
+    rgb_color_t color;
+    uint8_t brightness;
+};
+
+// set_led_color() of several LEDs. If the kernel module provides 
+// UGREEN_LED_DEVICE_PATH, the LEDs in sysfs are changed in one ioctl, 
+// instead of two attribute writes per LED. Returns the number of failures.
+int set_led_colors(const std::vector<led_color_change_t> &changes);
+
+// Blink a LED (in milliseconds), or keep it on if t_on is 0, in the same
+// way. With the kernel module, the trigger of the LED must be none.
+int set_led_blink(const std::string &led_name, uint16_t t_on, uint16_t t_off);
+
+#endif
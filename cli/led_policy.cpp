@@ -0,0 +1,65 @@
+#include "led_policy.h"
+
+void led_policy_t::set_brightness(const std::string &led_name, uint8_t brightness) {
+    _leds[led_name].brightness = brightness;
+}
+
+void led_policy_t::set(const std::string &led_name, led_priority_t priority, const rgb_color_t &color) {
+    _leds[led_name].colors[(uint8_t)priority] = color;
+}
+
+void led_policy_t::clear(const std::string &led_name, led_priority_t priority) {
+    auto it = _leds.find(led_name);
+    if (it != _leds.end())
+        it->second.colors[(uint8_t)priority].reset();
+}
+
+bool led_policy_t::is_set(const std::string &led_name, led_priority_t priority) const {
+    auto it = _leds.find(led_name);
+    return it != _leds.end() && it->second.colors[(uint8_t)priority].has_value();
+}
+
+std::optional<rgb_color_t> led_policy_t::color(const std::string &led_name) const {
+    auto it = _leds.find(led_name);
+    if (it == _leds.end()) return std::nullopt;
+
+    const auto &colors = it->second.colors;
+    for (auto c = colors.rbegin(); c != colors.rend(); ++c) {
+        if (*c) return *c;
+    }
+
+    return std::nullopt;
+}
+
+void led_policy_t::invalidate(const std::string &led_name) {
+    auto it = _leds.find(led_name);
+    if (it != _leds.end())
+        it->second.is_written = false;
+}
+
+int led_policy_t::flush() {
+    std::vector<led_color_change_t> changes;
+
+    for (auto &led : _leds) {
+        auto &state = led.second;
+
+        // a LED without conditions is left as it is, e.g., an empty slot
+        auto shown = color(led.first);
+        if (!shown) continue;
+
+        if (state.is_written && state.written_color == *shown && state.written_brightness == state.brightness)
+            continue;
+
+        changes.push_back({ led.first, *shown, state.brightness });
+        state.is_written = true;
+        state.written_color = *shown;
+        state.written_brightness = state.brightness;
+    }
+
+    // e.g., the colors of all disks at startup in one ioctl with the kernel module
+    if (!changes.empty())
+        set_led_colors(changes);
+
+    _write_count += changes.size();
+    return changes.size();
+}
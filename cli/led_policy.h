@@ -0,0 +1,65 @@
+#ifndef __UGREEN_LED_POLICY_H__
+#define __UGREEN_LED_POLICY_H__
+
+#include <stdint.h>
+#include <array>
+#include <map>
+#include <optional>
+#include <string>
+
+#include "led_output.h"
+
+// The conditions that ask a LED for a color, in the ascending order of
+// precedence, i.e., a LED shows the color of its highest condition set.
+enum class led_priority_t : uint8_t {
+    // the normal color, shown while the LED blinks for activities
+    activity = 0,
+    link_speed,
+    // e.g., a disk removed, or the gateway not replying
+    unavailable,
+    smart_failure,
+    // the pool tells which disk has failed even if its SMART does not
+    zpool_failure,
+};
+
+#define LED_PRIORITY_COUNT  5
+
+// The per-LED state machine of the monitors, replacing the checks of the
+// current color (e.g., `cat /sys/class/leds/$led/color`) in the scripts.
+// Event handlers set and clear conditions, and flush() writes the LEDs
+// whose shown color or brightness has changed since it was last written.
+class led_policy_t {
+
+private:
+    struct led_state_t {
+        uint8_t brightness = 255;
+        std::array<std::optional<rgb_color_t>, LED_PRIORITY_COUNT> colors;
+
+        bool is_written = false;
+        rgb_color_t written_color { };
+        uint8_t written_brightness = 0;
+    };
+
+    std::map<std::string, led_state_t> _leds;
+    uint64_t _write_count = 0;
+
+public:
+    void set_brightness(const std::string &led_name, uint8_t brightness);
+    void set(const std::string &led_name, led_priority_t priority, const rgb_color_t &color);
+    void clear(const std::string &led_name, led_priority_t priority);
+    bool is_set(const std::string &led_name, led_priority_t priority) const;
+
+    // the color of the highest condition, or none if no condition is set
+    std::optional<rgb_color_t> color(const std::string &led_name) const;
+
+    // the LED is to be written again, e.g., after its trigger is set up again
+    void invalidate(const std::string &led_name);
+
+    // Write the LEDs that changed in one batch, and return how many were
+    // written. A failed write is not retried (set_led_colors() reports it).
+    int flush();
+
+    uint64_t write_count() const { return _write_count; }
+};
+
+#endif
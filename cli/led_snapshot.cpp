@@ -0,0 +1,117 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "led_snapshot.h"
+
+// readers that keep colliding with updates give up, and read the hardware instead
+#define LED_SNAPSHOT_READ_ATTEMPTS  100
+
+static int64_t now_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+led_snapshot_writer_t::~led_snapshot_writer_t() {
+    if (_shared) munmap(_shared, sizeof(led_snapshot_t));
+    if (_fd >= 0) {
+        close(_fd);
+        unlink(_path.c_str());
+    }
+}
+
+int led_snapshot_writer_t::open(const char *path) {
+    // initialized under another name, so that readers never see a partial header
+    const std::string tmp_path = std::string(path) + ".tmp";
+
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    // the states are not secret, so that exporters need not run as root
+    fchmod(fd, 0644);
+
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, sizeof(led_snapshot_t)) == 0)
+        addr = mmap(nullptr, sizeof(led_snapshot_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED || std::rename(tmp_path.c_str(), path) != 0) {
+        if (addr != MAP_FAILED) munmap(addr, sizeof(led_snapshot_t));
+        close(fd);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    _path = path;
+    _fd = fd;
+    _shared = static_cast<led_snapshot_t *>(addr);
+
+    // the file is zero-filled, i.e., seq is even and no LED is present
+    _shared->pid = getpid();
+    _shared->version = LED_SNAPSHOT_VERSION;
+    _shared->updated_ms = now_ms();
+    __atomic_store_n(&_shared->magic, LED_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void led_snapshot_writer_t::publish(const led_snapshot_t &snapshot) {
+    if (!_shared) return;
+
+    uint32_t seq = _shared->seq;
+    __atomic_store_n(&_shared->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    _shared->updated_ms = now_ms();
+    _shared->bus_transactions = snapshot.bus_transactions;
+    _shared->bus_errors = snapshot.bus_errors;
+    _shared->bus_latency_p50_us = snapshot.bus_latency_p50_us;
+    _shared->bus_latency_p99_us = snapshot.bus_latency_p99_us;
+    _shared->ack_latency_us = snapshot.ack_latency_us;
+    _shared->ack_floor_us = snapshot.ack_floor_us;
+    std::memcpy(_shared->leds, snapshot.leds, sizeof(snapshot.leds));
+
+    __atomic_store_n(&_shared->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+bool read_led_snapshot(const char *path, led_snapshot_t &snapshot) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(led_snapshot_t))
+        addr = mmap(nullptr, sizeof(led_snapshot_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) return false;
+    const auto *shared = static_cast<const led_snapshot_t *>(addr);
+
+    bool is_consistent = false;
+    for (int attempt = 0; attempt < LED_SNAPSHOT_READ_ATTEMPTS && !is_consistent; ++attempt) {
+        uint32_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        std::memcpy(&snapshot, shared, sizeof(snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        is_consistent = __atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq;
+    }
+
+    munmap(addr, sizeof(led_snapshot_t));
+
+    if (!is_consistent || snapshot.magic != LED_SNAPSHOT_MAGIC || snapshot.version != LED_SNAPSHOT_VERSION)
+        return false;
+
+    // a daemon that did not exit cleanly leaves its last snapshot behind
+    return kill(snapshot.pid, 0) == 0 || errno == EPERM;
+}
@@ -0,0 +1,78 @@
+#ifndef __UGREEN_LED_SNAPSHOT_H__
+#define __UGREEN_LED_SNAPSHOT_H__
+
+#include <stdint.h>
+#include <string>
+#include <type_traits>
+
+#include "ugreen_leds.h"
+
+#define LED_SNAPSHOT_PATH       "/run/ugreen_leds_cli.state"
+#define LED_SNAPSHOT_MAGIC      0x534c4755  // "UGLS"
+#define LED_SNAPSHOT_VERSION    2
+
+// the LED was found when the daemon started
+#define LED_SNAPSHOT_PRESENT    ( 1 << 0 )
+// the state is what was last read from, or acknowledged by, the MCU
+#define LED_SNAPSHOT_KNOWN      ( 1 << 1 )
+
+struct led_snapshot_led_t {
+    uint8_t flags;              // LED_SNAPSHOT_*
+    uint8_t reserved[3];
+    ugreen_leds_t::led_data_t data;
+    // the counters of ugreen_leds_t::led_stats_t
+    uint64_t writes;
+    uint64_t retries;
+    uint64_t ack_failures;
+    uint64_t checksum_failures;
+    // when the known state last changed, in milliseconds since the epoch
+    int64_t last_change_ms;
+};
+
+// The states and counters of the daemon, in a file mapped into memory,
+// so that status queries (e.g., of an exporter) neither touch the bus
+// nor wait for the commands queued in the daemon. The daemon is the only
+// writer and updates it in place under a seqlock: seq is odd while an
+// update is in progress, and readers retry if it has changed meanwhile.
+struct led_snapshot_t {
+    uint32_t magic;             // LED_SNAPSHOT_MAGIC
+    uint32_t version;           // LED_SNAPSHOT_VERSION
+    uint32_t seq;
+    uint32_t pid;               // of the daemon
+    int64_t updated_ms;
+
+    // the counters of i2c_stats_t
+    uint64_t bus_transactions;
+    uint64_t bus_errors;
+    uint32_t bus_latency_p50_us;
+    uint32_t bus_latency_p99_us;
+    // see ugreen_leds_t::ack_latency_us() and ack_floor_us()
+    uint32_t ack_latency_us;
+    uint32_t ack_floor_us;
+
+    led_snapshot_led_t leds[UGREEN_MAX_LED_NUMBER];
+};
+
+static_assert(std::is_trivially_copyable<led_snapshot_t>::value, "the snapshot is copied as bytes");
+
+class led_snapshot_writer_t {
+
+public:
+    ~led_snapshot_writer_t();
+
+    // Create the file with an empty snapshot, readable by everyone.
+    // Returns non-zero if it cannot be created.
+    int open(const char *path);
+    // the header fields of the snapshot are ignored
+    void publish(const led_snapshot_t &snapshot);
+
+private:
+    std::string _path;
+    int _fd = -1;
+    led_snapshot_t *_shared = nullptr;
+};
+
+// Returns false if no running daemon publishes its snapshot on the path.
+bool read_led_snapshot(const char *path, led_snapshot_t &snapshot);
+
+#endif
@@ -0,0 +1,260 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "ugreen_animation.h"
+
+using led_type_t = ugreen_leds_t::led_type_t;
+using led_data_t = ugreen_leds_t::led_data_t;
+using op_mode_t = ugreen_leds_t::op_mode_t;
+
+ugreen_animation_t::effect_t ugreen_animation_t::sweep(const std::vector<led_type_t> &leds,
+        uint32_t period_ms, bool bounce) {
+    effect_t effect;
+    effect.mode = effect_mode_t::sweep;
+    effect.leds = leds;
+    effect.period_ms = period_ms;
+    effect.bounce = bounce;
+    return effect;
+}
+
+ugreen_animation_t::effect_t ugreen_animation_t::blink(const std::vector<led_type_t> &leds,
+        uint16_t t_on, uint16_t t_off, uint32_t phase_ms) {
+    effect_t effect;
+    effect.mode = effect_mode_t::blink;
+    effect.leds = leds;
+    effect.t_on = t_on;
+    effect.t_off = t_off;
+    effect.phase_ms = phase_ms;
+    return effect;
+}
+
+ugreen_animation_t::effect_t ugreen_animation_t::breath(const std::vector<led_type_t> &leds,
+        uint16_t t_on, uint16_t t_off, uint32_t phase_ms) {
+    auto effect = blink(leds, t_on, t_off, phase_ms);
+    effect.mode = effect_mode_t::breath;
+    return effect;
+}
+
+void ugreen_animation_t::add_effect(const effect_t &effect) {
+    _effects.push_back(effect);
+
+    auto &keyframes = _effects.back().keyframes;
+    std::stable_sort(keyframes.begin(), keyframes.end(), [](const keyframe_t &a, const keyframe_t &b) {
+        return a.offset_ms < b.offset_ms;
+    });
+}
+
+uint8_t ugreen_animation_t::_quantize(uint32_t value) const {
+    if (_levels == 0 || _levels >= 255) return std::min<uint32_t>(value, 255);
+
+    uint32_t level = (std::min<uint32_t>(value, 255) * _levels + 127) / 255;
+    return level * 255 / _levels;
+}
+
+static led_data_t effect_state(op_mode_t op_mode, uint8_t r, uint8_t g, uint8_t b, uint8_t brightness) {
+    led_data_t data { };
+    data.is_available = true;
+    data.op_mode = brightness ? op_mode : op_mode_t::off;
+    data.color_r = r;
+    data.color_g = g;
+    data.color_b = b;
+    data.brightness = brightness;
+    return data;
+}
+
+void ugreen_animation_t::_render_effect(const effect_t &effect, uint32_t time_ms,
+        std::array<led_data_t, UGREEN_MAX_LED_NUMBER> &frame) const {
+    const std::size_t n = effect.leds.size();
+
+    switch (effect.mode) {
+        case effect_mode_t::solid:
+        case effect_mode_t::blink:
+        case effect_mode_t::breath:
+            for (std::size_t i = 0; i < n; ++i) {
+                auto &data = frame[(uint8_t)effect.leds[i]];
+                data = effect_state(op_mode_t::on, effect.color_r, effect.color_g,
+                        effect.color_b, effect.brightness);
+
+                // the MCU keeps the phase from the time that it receives the command
+                if (time_ms < i * effect.phase_ms) {
+                    data.op_mode = op_mode_t::off;
+                } else if (effect.mode != effect_mode_t::solid && data.op_mode != op_mode_t::off) {
+                    data.op_mode = effect.mode == effect_mode_t::blink ? op_mode_t::blink : op_mode_t::breath;
+                    data.t_on = effect.t_on;
+                    data.t_off = effect.t_off;
+                }
+            }
+            break;
+
+        case effect_mode_t::sweep: {
+            if (n == 0) break;
+
+            // the LEDs that the head passes in a period, e.g., 0 1 2 3 2 1 for a bounce
+            const uint32_t path_len = effect.bounce && n > 1 ? 2 * (n - 1) : n;
+            const double step_ms = std::max(1.0, (double)effect.period_ms / path_len);
+            const double position = std::fmod(time_ms, (double)path_len * step_ms) / step_ms;
+            const uint32_t head = (uint32_t)position;
+            const double fraction = position - head;
+
+            for (std::size_t i = 0; i < n; ++i) {
+                // the steps since the head was at this LED, faded out along the tail
+                double intensity = 0;
+                for (uint32_t s = 0; s <= effect.tail && s < path_len; ++s) {
+                    uint32_t k = (head + path_len - s) % path_len;
+                    if ((k < n ? k : path_len - k) != i) continue;
+
+                    intensity = s == 0 ? 1 : std::max(0.0, 1 - (s + fraction) / (effect.tail + 1));
+                    break;
+                }
+
+                frame[(uint8_t)effect.leds[i]] = effect_state(op_mode_t::on,
+                        effect.color_r, effect.color_g, effect.color_b,
+                        _quantize(std::lround(effect.brightness * intensity)));
+            }
+            break;
+        }
+
+        case effect_mode_t::keyframes: {
+            const auto &keyframes = effect.keyframes;
+            if (keyframes.empty() || effect.period_ms == 0) break;
+
+            for (std::size_t i = 0; i < n; ++i) {
+                int64_t offset = ((int64_t)time_ms - (int64_t)(i * effect.phase_ms)) % effect.period_ms;
+                if (offset < 0) offset += effect.period_ms;
+
+                // interpolate from the last keyframe reached, wrapping around at the period
+                auto next = std::upper_bound(keyframes.begin(), keyframes.end(), (uint32_t)offset,
+                        [](uint32_t t, const keyframe_t &k) { return t < k.offset_ms; });
+                const auto &b = next == keyframes.end() ? keyframes.front() : *next;
+                const auto &a = next == keyframes.begin() ? keyframes.back() : *(next - 1);
+
+                int64_t begin = a.offset_ms, end = b.offset_ms;
+                if (begin > offset) begin -= effect.period_ms;
+                if (end <= offset) end += effect.period_ms;
+                double ratio = end > begin ? (double)(offset - begin) / (end - begin) : 0;
+
+                auto mix = [&](uint8_t x, uint8_t y) {
+                    return _quantize(std::lround(x + (y - x) * ratio));
+                };
+
+                frame[(uint8_t)effect.leds[i]] = effect_state(op_mode_t::on,
+                        mix(a.color_r, b.color_r), mix(a.color_g, b.color_g),
+                        mix(a.color_b, b.color_b), mix(a.brightness, b.brightness));
+            }
+            break;
+        }
+    }
+}
+
+std::array<led_data_t, UGREEN_MAX_LED_NUMBER> ugreen_animation_t::render(uint32_t time_ms) const {
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> frame { };
+
+    for (const auto &effect : _effects)
+        _render_effect(effect, time_ms, frame);
+
+    return frame;
+}
+
+bool ugreen_animation_t::_is_static_at(uint32_t time_ms) const {
+    for (const auto &effect : _effects) {
+        if (effect.mode == effect_mode_t::sweep || effect.mode == effect_mode_t::keyframes)
+            return false;
+
+        if (!effect.leds.empty() && time_ms < (effect.leds.size() - 1) * effect.phase_ms)
+            return false;
+    }
+
+    return true;
+}
+
+int ugreen_animation_t::commit_frame(uint32_t time_ms) {
+    auto frame = render(time_ms);
+    std::vector<ugreen_leds_t::led_change_t> changes;
+
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+        auto &target = frame[id];
+        if (!target.is_available) continue;
+
+        // the color and brightness of a LED that is off do not matter
+        const auto &committed = _committed[id];
+        if (target.op_mode == op_mode_t::off && committed.is_available) {
+            target.color_r = committed.color_r;
+            target.color_g = committed.color_g;
+            target.color_b = committed.color_b;
+            target.brightness = committed.brightness;
+        }
+
+        auto led_changes = ugreen_leds_t::state_changes((led_type_t)id, committed, target);
+        changes.insert(changes.end(), led_changes.begin(), led_changes.end());
+    }
+
+    ++_frame_count;
+    if (changes.empty()) return 0;
+
+    _command_count += changes.size();
+    int rc = _leds.apply(changes);
+
+    // a LED that failed is sent in full with the next frame
+    for (const auto &change : changes) {
+        auto &committed = _committed[(uint8_t)change.id];
+        committed = frame[(uint8_t)change.id];
+        committed.is_available = rc == 0;
+    }
+
+    return rc;
+}
+
+int ugreen_animation_t::run(uint32_t duration_ms, volatile std::sig_atomic_t *stopped) {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<led_type_t> ids;
+    for (const auto &effect : _effects) {
+        for (auto id : effect.leds) {
+            if (std::find(ids.begin(), ids.end(), id) == ids.end())
+                ids.push_back(id);
+        }
+    }
+
+    if (ids.empty()) return 0;
+
+    // the first frame is diffed against the actual states
+    const auto initial = _leds.get_status_all(ids);
+    _committed = initial;
+
+    int rc = 0;
+    bool has_static_frame = false;
+    const auto start = clock::now();
+    const uint32_t tick_ms = std::max<uint32_t>(_tick_ms, 1);
+
+    for (;;) {
+        uint32_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count();
+        if ((duration_ms && elapsed >= duration_ms) || (stopped && *stopped))
+            break;
+
+        // once only offloaded effects are left, the MCU runs them by itself
+        if (!has_static_frame) {
+            has_static_frame = _is_static_at(elapsed);
+            if (commit_frame(elapsed) != 0) rc = -1;
+        }
+
+        // drop the frames that are already late
+        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count();
+        uint32_t next_tick = (elapsed / tick_ms + 1) * tick_ms;
+        if (duration_ms) next_tick = std::min(next_tick, duration_ms);
+        if (next_tick > elapsed) usleep((next_tick - elapsed) * 1000);
+    }
+
+    std::vector<ugreen_leds_t::led_change_t> changes;
+    for (auto id : ids) {
+        if (!initial[(uint8_t)id].is_available) continue;
+
+        auto led_changes = ugreen_leds_t::state_changes(id, _committed[(uint8_t)id], initial[(uint8_t)id]);
+        changes.insert(changes.end(), led_changes.begin(), led_changes.end());
+    }
+
+    if (_leds.apply(changes) != 0) rc = -1;
+    return rc;
+}
@@ -0,0 +1,114 @@
+#ifndef __UGREEN_ANIMATION_H__
+#define __UGREEN_ANIMATION_H__
+
+#include <stdint.h>
+#include <csignal>
+#include <vector>
+
+#include "ugreen_leds.h"
+
+#define ANIMATION_DEFAULT_TICK_MS   50
+// software effects only change the brightness in steps of 256 / levels
+#define ANIMATION_DEFAULT_LEVELS    16
+
+// Effects rendered at a fixed tick into per-LED target states. Each frame
+// is diffed against the states committed by the previous frames, so that
+// only the changed fields are sent, as one batch through apply(). Blink
+// and breath effects are offloaded to the MCU: each LED takes a single
+// command, sent after its phase offset, so that e.g. a rolling breath
+// across the disks costs no bus time once it has started.
+class ugreen_animation_t {
+
+public:
+
+    enum class effect_mode_t : uint8_t {
+        // offloaded to the MCU
+        solid = 0, blink, breath,
+        // rendered at each tick
+        sweep, keyframes
+    };
+
+    // the color and brightness reached at offset_ms in the period (keyframes)
+    struct keyframe_t {
+        uint32_t offset_ms;
+        uint8_t color_r, color_g, color_b;
+        uint8_t brightness;
+    };
+
+    struct effect_t {
+        effect_mode_t mode = effect_mode_t::solid;
+        // in the order of the sweep and of the phase offsets
+        std::vector<ugreen_leds_t::led_type_t> leds;
+
+        uint8_t color_r = 255, color_g = 255, color_b = 255;
+        uint8_t brightness = 255;
+        // blink / breath
+        uint16_t t_on = 500, t_off = 500;
+
+        // sweep / keyframes: the time to pass all LEDs once, or to loop the keyframes
+        uint32_t period_ms = 1000;
+        // sweep: the number of LEDs fading out behind the lit one, and whether
+        // it goes back and forth (e.g., scrub) instead of restarting (e.g., rebuild)
+        uint8_t tail = 2;
+        bool bounce = false;
+        // keyframes, sorted by offset_ms and interpolated linearly
+        std::vector<keyframe_t> keyframes;
+
+        // the delay of each LED after the previous one (all but sweep)
+        uint32_t phase_ms = 0;
+    };
+
+    static effect_t sweep(const std::vector<ugreen_leds_t::led_type_t> &leds,
+            uint32_t period_ms, bool bounce = false);
+    static effect_t blink(const std::vector<ugreen_leds_t::led_type_t> &leds,
+            uint16_t t_on, uint16_t t_off, uint32_t phase_ms = 0);
+    static effect_t breath(const std::vector<ugreen_leds_t::led_type_t> &leds,
+            uint16_t t_on, uint16_t t_off, uint32_t phase_ms = 0);
+
+public:
+    explicit ugreen_animation_t(ugreen_leds_t &leds_controller) : _leds(leds_controller) { }
+
+    void set_tick(uint32_t tick_ms) { _tick_ms = tick_ms; }
+    void set_levels(uint8_t levels) { _levels = levels; }
+
+    // a LED is driven by the last effect that contains it
+    void add_effect(const effect_t &effect);
+
+    // the target states of all LEDs at time_ms since the start, where
+    // the entries of LEDs without effects are unavailable
+    std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> render(uint32_t time_ms) const;
+
+    // Commit the frame at time_ms, i.e., send the changes from the last
+    // committed states. Returns 0 if all changes are applied.
+    int commit_frame(uint32_t time_ms);
+
+    // Read the states of the LEDs, run the effects for duration_ms (or until
+    // *stopped is set, if duration_ms is 0), and restore the states read.
+    // Frames that are late are dropped, and no frame is rendered once only
+    // offloaded effects are left. Returns 0 if all frames are applied.
+    int run(uint32_t duration_ms, volatile std::sig_atomic_t *stopped = nullptr);
+
+    // frames committed, and commands sent by them
+    uint64_t frame_count() const { return _frame_count; }
+    uint64_t command_count() const { return _command_count; }
+
+private:
+    ugreen_leds_t &_leds;
+    std::vector<effect_t> _effects;
+
+    uint32_t _tick_ms = ANIMATION_DEFAULT_TICK_MS;
+    uint8_t _levels = ANIMATION_DEFAULT_LEVELS;
+
+    std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> _committed { };
+
+    uint64_t _frame_count = 0;
+    uint64_t _command_count = 0;
+
+    // whether the frames from time_ms on are all the same
+    bool _is_static_at(uint32_t time_ms) const;
+    uint8_t _quantize(uint32_t value) const;
+    void _render_effect(const effect_t &effect, uint32_t time_ms,
+            std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> &frame) const;
+};
+
+#endif
@@ -0,0 +1,308 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+
+#include "ugreen_daemon.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+static bool make_socket_address(const char *socket_path, sockaddr_un &addr) {
+    if (std::strlen(socket_path) >= sizeof(addr.sun_path))
+        return false;
+
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socket_path);
+    return true;
+}
+
+static int connect_daemon(const char *socket_path) {
+    sockaddr_un addr;
+    if (!make_socket_address(socket_path, addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool send_all(int fd, const std::string &data) {
+    for (std::size_t sent = 0; sent < data.size(); ) {
+        ssize_t rc = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += rc;
+    }
+
+    return true;
+}
+
+// a connection whose request line has not fully arrived yet
+struct reading_connection_t {
+    int fd;
+    std::string line;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+struct pending_request_t {
+    int fd;
+    daemon_request_t request;
+};
+
+static void send_response(int fd, const daemon_response_t &response) {
+    char header[64];
+    std::snprintf(header, sizeof(header), "%d %zu %zu\n",
+            response.rc, response.out.size(), response.err.size());
+
+    send_all(fd, header + response.out + response.err);
+    close(fd);
+}
+
+// accept all connections waiting, without reading from them
+static void accept_connections(int listen_fd, std::vector<reading_connection_t> &connections) {
+    for (;;) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) std::perror("accept");
+            return;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(UGREEN_DAEMON_TIMEOUT_MS);
+        connections.push_back({ fd, { }, deadline });
+    }
+}
+
+// Read what has arrived so far, until the first newline. Returns false 
+// if the connection is given up, i.e., closed early, failed, or oversized.
+static bool receive_request_data(reading_connection_t &connection) {
+    char buf[256];
+
+    while (connection.line.find('\n') == std::string::npos) {
+        if (connection.line.size() > UGREEN_DAEMON_MAX_REQUEST_SIZE)
+            return false;
+
+        ssize_t len = recv(connection.fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        if (len == 0) return false;
+
+        connection.line.append(buf, len);
+    }
+
+    return true;
+}
+
+static void queue_request(int fd, const std::string &line, std::deque<pending_request_t> &queue, 
+        const daemon_handler_t &handler) {
+    // the response is small, and sent at once after the request is executed
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    pending_request_t pending { fd, { } };
+    std::istringstream iss(line);
+    for (std::string arg; iss >> arg; )
+        pending.request.args.push_back(arg);
+
+    handler.classify(pending.request);
+
+    const auto &request = pending.request;
+    if (request.priority == daemon_priority_t::activity && !request.merge_key.empty()) {
+        auto stale = std::find_if(queue.begin(), queue.end(), [&](const pending_request_t &p) {
+            return p.request.priority == daemon_priority_t::activity 
+                && p.request.merge_key == request.merge_key;
+        });
+
+        // the stale request is superseded, before it has any visible effect
+        if (stale != queue.end()) {
+            send_response(stale->fd, { });
+            queue.erase(stale);
+        }
+    }
+
+    queue.push_back(std::move(pending));
+}
+
+// queue the requests whose lines are complete, and give up on the 
+// connections that failed or have not sent theirs in time
+static void receive_requests(std::vector<reading_connection_t> &connections, 
+        std::deque<pending_request_t> &queue, const daemon_handler_t &handler) {
+    const auto now = std::chrono::steady_clock::now();
+
+    for (auto it = connections.begin(); it != connections.end(); ) {
+        bool is_alive = receive_request_data(*it);
+        std::size_t newline = it->line.find('\n');
+
+        if (is_alive && newline != std::string::npos) {
+            queue_request(it->fd, it->line.substr(0, newline), queue, handler);
+        } else if (is_alive && now < it->deadline) {
+            ++it;
+            continue;
+        } else {
+            close(it->fd);
+        }
+
+        it = connections.erase(it);
+    }
+}
+
+int run_daemon(const char *socket_path, const daemon_handler_t &handler) {
+    sockaddr_un addr;
+    if (!make_socket_address(socket_path, addr)) {
+        std::cerr << "Err: the socket path " << socket_path << " is too long." << std::endl;
+        return -1;
+    }
+
+    // a socket file without a listener is left by a daemon that did not exit cleanly
+    int probe_fd = connect_daemon(socket_path);
+    if (probe_fd >= 0) {
+        close(probe_fd);
+        std::cerr << "Err: another daemon is listening on " << socket_path << std::endl;
+        return -1;
+    }
+    unlink(socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        std::perror("socket");
+        return -1;
+    }
+
+    // the daemon drives the hardware, so only root may talk to it
+    mode_t old_umask = umask(0177);
+    int rc = bind(listen_fd, (sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+
+    if (rc < 0 || listen(listen_fd, 16) < 0 || fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0) {
+        std::perror(socket_path);
+        close(listen_fd);
+        return -1;
+    }
+
+    // no SA_RESTART, so that poll() is interrupted by the signals
+    struct sigaction sa { };
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::deque<pending_request_t> queue;
+    std::vector<reading_connection_t> connections;
+    std::vector<pollfd> pfds;
+
+    while (!stop_requested) {
+        // only wait for connections when there is nothing to do, or until 
+        // the handler is ready for the queued requests
+        uint32_t delay_us = !queue.empty() && handler.delay_us ? handler.delay_us() : 0;
+        int timeout_ms = queue.empty() ? -1 : (int)((delay_us + 999) / 1000);
+
+        // and wake up to give up on the connections that are too slow
+        pfds.assign(1, { listen_fd, POLLIN, 0 });
+        for (const auto &connection : connections) {
+            using namespace std::chrono;
+            auto left_ms = std::max<int64_t>(duration_cast<milliseconds>(connection.deadline - steady_clock::now()).count() + 1, 0);
+            if (timeout_ms < 0 || left_ms < timeout_ms) timeout_ms = (int)left_ms;
+            pfds.push_back({ connection.fd, POLLIN, 0 });
+        }
+
+        int rc = poll(pfds.data(), pfds.size(), timeout_ms);
+        if (rc < 0 && errno != EINTR) {
+            std::perror("poll");
+            break;
+        }
+
+        if (rc > 0 && pfds[0].revents) accept_connections(listen_fd, connections);
+        if (!connections.empty()) receive_requests(connections, queue, handler);
+        if (queue.empty()) continue;
+        if (handler.delay_us && handler.delay_us() > 0) continue;
+
+        auto next = std::find_if(queue.begin(), queue.end(), [](const pending_request_t &p) {
+            return p.request.priority == daemon_priority_t::alert;
+        });
+        if (next == queue.end()) next = queue.begin();
+
+        pending_request_t pending = std::move(*next);
+        queue.erase(next);
+
+        send_response(pending.fd, handler.execute(pending.request));
+    }
+
+    for (auto &pending : queue)
+        close(pending.fd);
+    for (auto &connection : connections)
+        close(connection.fd);
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    return 0;
+}
+
+bool send_daemon_request(const char *socket_path, const std::vector<std::string> &args,
+        daemon_response_t &response) {
+    int fd = connect_daemon(socket_path);
+    if (fd < 0) return false;
+
+    std::string line;
+    for (const auto &arg : args) {
+        if (!line.empty()) line += ' ';
+        line += arg;
+    }
+    line += '\n';
+
+    if (!send_all(fd, line)) {
+        close(fd);
+        return false;
+    }
+
+    std::string data;
+    char buf[4096];
+    for (;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        data.append(buf, len);
+    }
+    close(fd);
+
+    int rc;
+    std::size_t out_size, err_size;
+    int header_size;
+    if (std::sscanf(data.c_str(), "%d %zu %zu\n%n", &rc, &out_size, &err_size, &header_size) != 3
+            || data.size() != header_size + out_size + err_size) {
+        response.rc = -1;
+        response.out.clear();
+        response.err = "Err: invalid response from the daemon\n";
+        return true;
+    }
+
+    response.rc = rc;
+    response.out = data.substr(header_size, out_size);
+    response.err = data.substr(header_size + out_size, err_size);
+
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef __UGREEN_DAEMON_H__
+#define __UGREEN_DAEMON_H__
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define UGREEN_DAEMON_SOCKET_PATH "/run/ugreen_leds_cli.sock"
+#define UGREEN_DAEMON_MAX_REQUEST_SIZE 4096
+#define UGREEN_DAEMON_TIMEOUT_MS 1000
+
+// The protocol over the Unix socket: a request is one line of arguments
+// separated by white spaces, and the response is a header line
+// "RC OUT_SIZE ERR_SIZE" followed by the text for stdout and stderr.
+// Each connection carries a single request.
+struct daemon_response_t {
+    int rc = 0;
+    std::string out, err;
+};
+
+// Queued requests are served alerts first. An activity request replaces 
+// the queued activity request with the same non-empty merge key, which 
+// is answered as succeeded without being executed.
+enum class daemon_priority_t : uint8_t {
+    activity = 0, alert
+};
+
+struct daemon_request_t {
+    std::vector<std::string> args;
+    daemon_priority_t priority = daemon_priority_t::alert;
+    std::string merge_key;
+};
+
+struct daemon_handler_t {
+    // set the priority and the merge key of a received request
+    std::function<void(daemon_request_t &request)> classify;
+    std::function<daemon_response_t(const daemon_request_t &request)> execute;
+    // (optional) the time until the next request may be executed, in
+    // microseconds, e.g., for the budget of bus transfers. Meanwhile,
+    // connections are still accepted, and activity requests are merged.
+    std::function<uint32_t()> delay_us;
+};
+
+// Serve requests one at a time until SIGINT or SIGTERM, so that commands
+// never interleave on the bus. New connections are accepted between 
+// requests, and their lines are read as they arrive, so that an alert 
+// waits for at most the running request, not for slow clients. Clients 
+// that have not sent a full line within UGREEN_DAEMON_TIMEOUT_MS are 
+// disconnected.
+// Returns non-zero if the socket is unusable.
+int run_daemon(const char *socket_path, const daemon_handler_t &handler);
+
+// Returns false if no daemon is listening on the socket.
+bool send_daemon_request(const char *socket_path, const std::vector<std::string> &args,
+        daemon_response_t &response);
+
+#endif
@@ -1,5 +1,9 @@
+#include <unistd.h>
+
 #include "ugreen_leds.h"
 #include <string>
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -28,40 +32,35 @@ int ugreen_leds_t::start() {
     return -1;
 }
 
-static int compute_checksum(const std::vector<uint8_t>& data, int size) {
-    if (size < 2 || size > (int)data.size()) 
-        return 0;
-
-    int sum = 0;
-    for (int i = 0; i < size; ++i)
-        sum += (int)data[i];
-
-    return sum;
+void ugreen_leds_t::start(std::unique_ptr<i2c_transport_t> transport) {
+    _i2c.start(std::move(transport));
 }
 
-static bool verify_checksum(const std::vector<uint8_t>& data) {
-    int size = data.size();
-    if (size < 2) return false;
-    int sum = compute_checksum(data, size - 2);
-    return sum != 0 && sum == (data[size - 1] | (((int)data[size - 2]) << 8));
-}
-
-static void append_checksum(std::vector<uint8_t>& data) {
-    int size = data.size();
-    int sum = compute_checksum(data, size);
-    data.push_back((sum >> 8) & 0xff);
-    data.push_back(sum & 0xff);
+ugreen_leds_t::led_data_t ugreen_leds_t::get_status(led_type_t id) {
+    std::optional<status_frame_t> raw_data;
+    return _read_status(id, raw_data);
 }
 
-ugreen_leds_t::led_data_t ugreen_leds_t::get_status(led_type_t id) {
+ugreen_leds_t::led_data_t ugreen_leds_t::_read_status(led_type_t id, std::optional<status_frame_t> &raw_data) {
     led_data_t data { };
     data.is_available = false;
 
-    auto raw_data = _i2c.read_block_data(0x81 + (uint8_t)id, 0xb);
-    if (raw_data.size() != 0xb || !verify_checksum(raw_data)) 
+    raw_data.emplace();
+    if (_i2c.read_block_data(UGREEN_LED_REG_STATUS((uint8_t)id), *raw_data) != 0) {
+        raw_data.reset();
         return data;
+    }
 
-    switch (raw_data[0]) {
+    ugreen_led_status_frame frame { };
+    std::copy(raw_data->begin(), raw_data->end(), frame.bytes);
+    auto status = ugreen_led_decode_status(frame);
+
+    if (!status.valid) {
+        ++_stats[(uint8_t)id].checksum_failures;
+        return data;
+    }
+
+    switch (status.status) {
         case 0: data.op_mode = op_mode_t::off; break;
         case 1: data.op_mode = op_mode_t::on; break;
         case 2: data.op_mode = op_mode_t::blink; break;
@@ -70,69 +69,681 @@ ugreen_leds_t::led_data_t ugreen_leds_t::get_status(led_type_t id) {
     };
 
 
-    data.brightness = raw_data[1];
-    data.color_r = raw_data[2];
-    data.color_g = raw_data[3];
-    data.color_b = raw_data[4];
-    int t_hight = (((int)raw_data[5]) << 8) | raw_data[6];
-    int t_low = (((int)raw_data[7]) << 8) | raw_data[8];
-    data.t_on = t_low;
-    data.t_off = t_hight - t_low;
+    data.brightness = status.brightness;
+    data.color_r = status.r;
+    data.color_g = status.g;
+    data.color_b = status.b;
+    data.t_on = status.t_on;
+    data.t_off = status.t_cycle - status.t_on;
     data.is_available = true;
 
+    if (_cache_enabled) 
+        _cache[(uint8_t)id] = data;
+
     return data;
 }
 
-int ugreen_leds_t::_change_status(led_type_t id, uint8_t command, std::array<std::optional<uint8_t>, 4> params) {
-    std::vector<uint8_t> data {
-    //   3c    3b    3a
-        0x00, 0xa0, 0x01,
-    //     39        38         37
-        0x00, 0x00, command, 
-    //     36 - 33
-        params[0].value_or(0x00), 
-        params[1].value_or(0x00), 
-        params[2].value_or(0x00), 
-        params[3].value_or(0x00), 
-    };
+ugreen_leds_t::led_data_t ugreen_leds_t::get_status_robust(led_type_t id) {
+    std::optional<status_frame_t> raw_data, last_raw_data;
+
+    // the checksum tells whether a read succeeded, so the adaptive mode
+    // does not need to wait for the worst case before reading
+    usleep(_timing_mode == timing_mode_t::adaptive ? 
+            USLEEP_VERIFY_STATUS_INTERVAL : USLEEP_READ_STATUS_INTERVAL);
+    auto data = _read_status(id, raw_data);
 
-    append_checksum(data);
-    data[0] = (uint8_t)id;
-    return _i2c.write_block_data((uint8_t)id, data);
+    for (int retry_cnt = 1; !data.is_available && retry_cnt < MAX_RETRY_COUNT; ++retry_cnt) {
+        // A corrupted transfer gives a different frame each time, while a
+        // non-existent LED keeps answering with the same invalid frame.
+        if (retry_cnt > 1 && raw_data && raw_data == last_raw_data)
+            break;
+
+        last_raw_data.swap(raw_data);
+        ++_stats[(uint8_t)id].retries;
+        usleep(USLEEP_READ_STATUS_RETRY_INTERVAL);
+        data = _read_status(id, raw_data);
+    }
+
+    return data;
 }
 
-int ugreen_leds_t::set_onoff(led_type_t id, uint8_t status) {
-    if (status >= 2) return -1;
-    return _change_status(id, 0x03, { status } );
+std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> ugreen_leds_t::get_status_all() {
+    std::array<bool, UGREEN_MAX_LED_NUMBER> pending;
+    pending.fill(true);
+    return _get_status_many(pending);
+}
+
+std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> ugreen_leds_t::get_status_all(const std::vector<led_type_t> &ids) {
+    std::array<bool, UGREEN_MAX_LED_NUMBER> pending { };
+    for (auto id : ids) pending[(uint8_t)id] = true;
+    return _get_status_many(pending);
+}
+
+std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> ugreen_leds_t::_get_status_many(std::array<bool, UGREEN_MAX_LED_NUMBER> pending) {
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> data { };
+    std::array<std::optional<status_frame_t>, UGREEN_MAX_LED_NUMBER> raw_data, last_raw_data;
+
+    // as in get_status_robust(), the settle time is only needed once
+    usleep(_timing_mode == timing_mode_t::adaptive ? 
+            USLEEP_VERIFY_STATUS_INTERVAL : USLEEP_READ_STATUS_INTERVAL);
+
+    for (int retry_cnt = 0; retry_cnt < MAX_RETRY_COUNT; ++retry_cnt) {
+        if (std::none_of(pending.begin(), pending.end(), [](bool p) { return p; }))
+            break;
+
+        if (retry_cnt > 0) usleep(USLEEP_READ_STATUS_RETRY_INTERVAL);
+
+        bool is_first_read = true;
+        for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+            if (!pending[id]) continue;
+
+            if (!is_first_read) usleep(USLEEP_VERIFY_STATUS_INTERVAL);
+            is_first_read = false;
+
+            if (retry_cnt > 0) ++_stats[id].retries;
+
+            last_raw_data[id].swap(raw_data[id]);
+            data[id] = _read_status((led_type_t)id, raw_data[id]);
+
+            // a non-existent LED keeps answering with the same invalid frame
+            if (data[id].is_available || (retry_cnt > 0 && raw_data[id] && raw_data[id] == last_raw_data[id]))
+                pending[id] = false;
+        }
+    }
+
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id)
+        _status_read_failed[id] = pending[id];
+
+    return data;
+}
+
+static void update_with_change(ugreen_leds_t::led_data_t &data, const ugreen_leds_t::led_change_t &change) {
+    const auto &p = change.params;
+    switch (change.command) {
+        case UGREEN_LED_CMD_BRIGHTNESS: 
+            data.brightness = p[0];
+            break;
+        case UGREEN_LED_CMD_COLOR:
+            data.color_r = p[0];
+            data.color_g = p[1];
+            data.color_b = p[2];
+            break;
+        case UGREEN_LED_CMD_ON_OFF:
+            data.op_mode = p[0] ? ugreen_leds_t::op_mode_t::on : ugreen_leds_t::op_mode_t::off;
+            break;
+        case UGREEN_LED_CMD_BLINK:
+        case UGREEN_LED_CMD_BREATH:
+            data.op_mode = change.command == UGREEN_LED_CMD_BLINK ? 
+                ugreen_leds_t::op_mode_t::blink : ugreen_leds_t::op_mode_t::breath;
+            data.t_on = (p[2] << 8) | p[3];
+            data.t_off = ((p[0] << 8) | p[1]) - data.t_on;
+            break;
+    }
 }
 
-int ugreen_leds_t::_set_blink_or_breath(uint8_t command, led_type_t id, uint16_t t_on, uint16_t t_off) {
+// the state that a LED is expected to have after a sequence of changes
+struct expected_state_t {
+    enum : uint8_t { brightness = 1, color = 2, op_mode = 4 };
+
+    uint8_t fields = 0;
+    ugreen_leds_t::led_data_t data { };
+
+    void update(const ugreen_leds_t::led_change_t &change) {
+        switch (change.command) {
+            case UGREEN_LED_CMD_BRIGHTNESS: fields |= brightness; break;
+            case UGREEN_LED_CMD_COLOR: fields |= color; break;
+            case UGREEN_LED_CMD_ON_OFF: 
+            case UGREEN_LED_CMD_BLINK: 
+            case UGREEN_LED_CMD_BREATH: fields |= op_mode; break;
+        }
+
+        update_with_change(data, change);
+    }
+
+    bool is_reached_by(const ugreen_leds_t::led_data_t &actual) const {
+        if (!actual.is_available) return false;
+
+        if ((fields & brightness) && actual.brightness != data.brightness)
+            return false;
+
+        if ((fields & color) && (actual.color_r != data.color_r 
+                    || actual.color_g != data.color_g || actual.color_b != data.color_b))
+            return false;
+
+        if (fields & op_mode) {
+            if (actual.op_mode != data.op_mode) return false;
+
+            if ((data.op_mode == ugreen_leds_t::op_mode_t::blink || data.op_mode == ugreen_leds_t::op_mode_t::breath)
+                    && (actual.t_on != data.t_on || actual.t_off != data.t_off))
+                return false;
+        }
+
+        return true;
+    }
+};
+
+bool ugreen_leds_t::_is_redundant(const led_change_t &change) const {
+    if (!_cache_enabled) return false;
+
+    expected_state_t state;
+    state.update(change);
+    return state.is_reached_by(_cache[(uint8_t)change.id]);
+}
+
+int ugreen_leds_t::_change_status(const led_change_t &change, bool force) {
+    if (!force && _is_redundant(change)) {
+        _last_change_skipped = true;
+        return 0;
+    }
+
+    ++_stats[(uint8_t)change.id].writes;
+    int rc = _i2c.write_block_data(UGREEN_LED_REG_COMMAND((uint8_t)change.id), command_frame(change));
+
+    _last_change_skipped = false;
+    _last_change_id = change.id;
+
+    // A written frame may still be dropped by the MCU, so the state is only
+    // known again once the frame is acknowledged, or from a read back.
+    if (_cache_enabled) {
+        auto &cached = _cache[(uint8_t)change.id];
+        _unconfirmed_state = cached;
+        if (rc == 0) update_with_change(_unconfirmed_state, change);
+        else _unconfirmed_state.is_available = false;
+        cached.is_available = false;
+    }
+
+    return rc;
+}
+
+void ugreen_leds_t::_confirm_last_change() {
+    // only if the acknowledged frame is the only one since the state was known
+    if (_cache_enabled && _unconfirmed_state.is_available)
+        _cache[(uint8_t)_last_change_id] = _unconfirmed_state;
+}
+
+int ugreen_leds_t::_change_status_robust(const led_change_t &change) {
+    int last_status = -1;
+
+    for (int retry_cnt = 0; retry_cnt < MAX_RETRY_COUNT && last_status != 0; ++retry_cnt) {
+
+        if (retry_cnt == 0) {
+            usleep(USLEEP_MODIFICATION_INTERVAL);  // usleep_range(200, 0x5dc)
+        } else {
+            ++_stats[(uint8_t)change.id].retries;
+            usleep(USLEEP_MODIFICATION_RETRY_INTERVAL);  
+        }
+
+        last_status = _change_status(change, true);
+
+        if (last_status == 0) {
+            last_status = !_wait_for_modification_result();
+        }
+    }
+
+    return last_status;
+}
+
+ugreen_leds_t::led_change_t ugreen_leds_t::onoff_change(led_type_t id, uint8_t status) {
+    return { id, UGREEN_LED_CMD_ON_OFF, { status } };
+}
+
+ugreen_leds_t::led_change_t ugreen_leds_t::_blink_or_breath_change(uint8_t command, led_type_t id, uint16_t t_on, uint16_t t_off) {
     uint16_t t_hight = t_on + t_off;
     uint16_t t_low = t_on;
-    return _change_status(id, command, { 
+    return { id, command, { 
         (uint8_t)(t_hight >> 8), 
         (uint8_t)(t_hight & 0xff), 
         (uint8_t)(t_low >> 8),
         (uint8_t)(t_low & 0xff),
-    } );
+    } };
+}
+
+ugreen_leds_t::led_change_t ugreen_leds_t::rgb_change(led_type_t id, uint8_t r, uint8_t g, uint8_t b) {
+    return { id, UGREEN_LED_CMD_COLOR, { r, g, b } };
+}
+
+ugreen_leds_t::led_change_t ugreen_leds_t::brightness_change(led_type_t id, uint8_t brightness) {
+    return { id, UGREEN_LED_CMD_BRIGHTNESS, { brightness } };
+}
+
+ugreen_leds_t::led_change_t ugreen_leds_t::blink_change(led_type_t id, uint16_t t_on, uint16_t t_off) {
+    return _blink_or_breath_change(UGREEN_LED_CMD_BLINK, id, t_on, t_off);
+}
+
+ugreen_leds_t::led_change_t ugreen_leds_t::breath_change(led_type_t id, uint16_t t_on, uint16_t t_off) {
+    return _blink_or_breath_change(UGREEN_LED_CMD_BREATH, id, t_on, t_off);
+}
+
+int ugreen_leds_t::set_onoff(led_type_t id, uint8_t status) {
+    if (status >= 2) return -1;
+    return _change_status(onoff_change(id, status));
 }
 
 int ugreen_leds_t::set_rgb(led_type_t id, uint8_t r, uint8_t g, uint8_t b) {
-    return _change_status(id, 0x02, { r, g, b } );
+    return _change_status(rgb_change(id, r, g, b));
 }
 
 int ugreen_leds_t::set_brightness(led_type_t id, uint8_t brightness) {
-    return _change_status(id, 0x01, { brightness } );
+    return _change_status(brightness_change(id, brightness));
 }
 
 bool ugreen_leds_t::is_last_modification_successful() {
-    return _i2c.read_byte_data(0x80) == 1;
+    if (_last_change_skipped) return true;
+
+    bool successful = ugreen_led_decode_last_command_status(
+            _i2c.read_byte_data(UGREEN_LED_REG_LAST_COMMAND_STATUS));
+    if (successful) {
+        _confirm_last_change();
+    } else {
+        ++_stats[(uint8_t)_last_change_id].ack_failures;
+        invalidate_cache(_last_change_id);
+    }
+
+    return successful;
+}
+
+void ugreen_leds_t::set_timing_mode(timing_mode_t mode) {
+    _timing_mode = mode;
+}
+
+bool ugreen_leds_t::_wait_for_modification_result() {
+    if (_last_change_skipped) return true;
+
+    if (_timing_mode == timing_mode_t::fixed) {
+        usleep(USLEEP_MODIFICATION_QUERY_RESULT_INTERVAL);
+        return is_last_modification_successful();
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    uint32_t delay = std::max(_ack_latency_us, _ack_floor_us());
+
+    for (int poll_cnt = 0; ; ++poll_cnt) {
+        usleep(delay);
+
+        uint32_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+
+        if (ugreen_led_decode_last_command_status(_i2c.read_byte_data(UGREEN_LED_REG_LAST_COMMAND_STATUS))) {
+            if (poll_cnt == 0) {
+                // the ack may have arrived earlier, so probe a bit earlier next time
+                _ack_latency_us -= _ack_latency_us / 8;
+            } else {
+                // the MCU was seen busy, so this is an actual measurement
+                _ack_measured_us = (_ack_measured_us * 3 + elapsed) / 4;
+                _ack_latency_us = (_ack_latency_us * 3 + elapsed) / 4;
+            }
+
+            _ack_latency_us = std::clamp<uint32_t>(_ack_latency_us,
+                    _ack_floor_us(), USLEEP_ADAPTIVE_ACK_TIMEOUT);
+            _confirm_last_change();
+            return true;
+        }
+
+        if (elapsed >= USLEEP_ADAPTIVE_ACK_TIMEOUT) break;
+
+        delay = std::min<uint32_t>(USLEEP_ADAPTIVE_ACK_MIN_POLL << std::min(poll_cnt, 6), 
+                USLEEP_ADAPTIVE_ACK_TIMEOUT - elapsed);
+    }
+
+    ++_stats[(uint8_t)_last_change_id].ack_failures;
+    invalidate_cache(_last_change_id);
+    return false;
+}
+
+void ugreen_leds_t::enable_cache(bool enabled) {
+    _cache_enabled = enabled;
+    invalidate_cache();
+}
+
+void ugreen_leds_t::invalidate_cache() {
+    for (auto &cached : _cache)
+        cached.is_available = false;
+}
+
+void ugreen_leds_t::invalidate_cache(led_type_t id) {
+    _cache[(uint8_t)id].is_available = false;
 }
 
 int ugreen_leds_t::set_blink(led_type_t id, uint16_t t_on, uint16_t t_off) {
-    return _set_blink_or_breath(0x04, id, t_on, t_off);
+    return _change_status(blink_change(id, t_on, t_off));
 }
 
 int ugreen_leds_t::set_breath(led_type_t id, uint16_t t_on, uint16_t t_off) {
-    return _set_blink_or_breath(0x05, id, t_on, t_off);
+    return _change_status(breath_change(id, t_on, t_off));
+}
+
+int ugreen_leds_t::apply(const std::vector<led_change_t> &changes) {
+    if (changes.empty()) return 0;
+
+    // indexed by LED id, so that no allocation happens here
+    std::array<std::optional<expected_state_t>, UGREEN_MAX_LED_NUMBER> expected;
+    std::array<bool, UGREEN_MAX_LED_NUMBER> failed { };
+    const led_change_t *last_sent = nullptr;
+
+    // phase 1: pipeline all writes, only keeping the minimal interval between frames
+    for (const auto &change : changes) {
+        if (_is_redundant(change)) continue;
+
+        auto &state = expected[(uint8_t)change.id];
+        if (!state) state.emplace();
+        state->update(change);
+        last_sent = &change;
+
+        usleep(USLEEP_MODIFICATION_INTERVAL);
+        if (_change_status(change) != 0)
+            failed[(uint8_t)change.id] = true;
+    }
+
+    if (!last_sent) return 0;
+
+    // phase 2: one shared settle time, then verify the final state of each LED.
+    // The ack register only reports the last frame, so earlier frames are
+    // checked by reading the LED status back.
+    bool last_acked = _wait_for_modification_result();
+    if (!last_acked) failed[(uint8_t)last_sent->id] = true;
+
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+        if (!expected[id] || failed[id]) continue;
+
+        usleep(USLEEP_VERIFY_STATUS_INTERVAL);
+        if (!expected[id]->is_reached_by(get_status((led_type_t)id)))
+            failed[id] = true;
+    }
+
+    // phase 3: replay the changes of LEDs that diverged, waiting for each ack.
+    // Their cached states are not trusted, so that no change is skipped.
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+        if (failed[id]) invalidate_cache((led_type_t)id);
+    }
+
+    int rc = 0;
+    for (const auto &change : changes) {
+        if (!failed[(uint8_t)change.id]) continue;
+
+        ++_stats[(uint8_t)change.id].retries;
+        if (_change_status_robust(change) != 0) 
+            rc = -1;
+    }
+
+    return rc;
+}
+
+void ugreen_leds_t::begin() {
+    _transaction.clear();
+}
+
+void ugreen_leds_t::queue(const led_change_t &change) {
+    _transaction.push_back(change);
+}
+
+uint32_t ugreen_leds_t::_read_back_fixed_us() const {
+    if (_timing_mode == timing_mode_t::adaptive)
+        return _ack_latency_us + USLEEP_VERIFY_STATUS_INTERVAL;
+    return USLEEP_MODIFICATION_QUERY_RESULT_INTERVAL + USLEEP_READ_STATUS_INTERVAL;
+}
+
+uint64_t ugreen_leds_t::_transaction_cost_us(const transaction_budget_t &budget, std::size_t sends, std::size_t reads,
+        const std::array<bool, UGREEN_MAX_LED_NUMBER> &to_send) const {
+    uint64_t cost = sends * _change_cost_us + _read_back_fixed_us() + reads * _read_cost_us;
+    if (!budget.reserve_rollback) return cost;
+
+    // the last pass restores each LED sent to, with as many changes
+    cost += _read_back_fixed_us();
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+        if (budget.sent_count[id] > 0 || to_send[id])
+            cost += budget.change_count[id] * _change_cost_us + _read_cost_us;
+    }
+
+    return cost;
+}
+
+void ugreen_leds_t::_decay_transaction_costs() {
+    _change_cost_us = (_change_cost_us * 3 + USLEEP_TRANSACTION_CHANGE_INITIAL) / 4;
+    _read_cost_us = (_read_cost_us * 3 + USLEEP_TRANSACTION_READ_INITIAL) / 4;
+}
+
+std::vector<ugreen_leds_t::led_change_t> ugreen_leds_t::_changes_to_send(const std::vector<led_change_t> &changes,
+        const std::array<bool, UGREEN_MAX_LED_NUMBER> &selected, bool skip_redundant) const {
+    std::vector<led_change_t> to_send;
+    for (const auto &change : changes) {
+        if (!selected[(uint8_t)change.id]) continue;
+        // a failed write shows up in the read back
+        if (skip_redundant && _is_redundant(change)) continue;
+        to_send.push_back(change);
+    }
+
+    return to_send;
+}
+
+std::array<bool, UGREEN_MAX_LED_NUMBER> ugreen_leds_t::_transaction_pass(const std::vector<led_change_t> &changes,
+        const std::array<bool, UGREEN_MAX_LED_NUMBER> &selected, bool skip_redundant,
+        transaction_budget_t &budget, std::array<led_data_t, UGREEN_MAX_LED_NUMBER> &status) {
+    using clock = std::chrono::steady_clock;
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+
+    std::array<std::optional<expected_state_t>, UGREEN_MAX_LED_NUMBER> expected;
+    std::vector<led_type_t> ids;
+    for (const auto &change : changes) {
+        uint8_t id = (uint8_t)change.id;
+        if (!selected[id]) continue;
+
+        if (!expected[id]) {
+            expected[id].emplace();
+            ids.push_back(change.id);
+        }
+        expected[id]->update(change);
+    }
+
+    auto to_send = _changes_to_send(changes, selected, skip_redundant);
+    std::array<bool, UGREEN_MAX_LED_NUMBER> is_sent { }, has_changes { };
+    for (const auto &change : to_send)
+        has_changes[(uint8_t)change.id] = true;
+
+    // the LEDs whose changes are all redundant are read back in any case
+    std::size_t reads = std::count_if(ids.begin(), ids.end(), [&](led_type_t id) { return !has_changes[(uint8_t)id]; });
+    bool is_any_sent = false;
+
+    if (budget.reserve_rollback && !to_send.empty() && clock::now() 
+            + microseconds(_transaction_cost_us(budget, to_send.size(), ids.size(), has_changes)) > budget.deadline) {
+        _decay_transaction_costs();
+        to_send.clear();
+    }
+
+    // the changes are sent in order, so none is sent after the first that does not fit
+    for (const auto &change : to_send) {
+        uint8_t id = (uint8_t)change.id;
+        auto start = clock::now();
+        if (!budget.reserve_rollback && start 
+                + microseconds(_transaction_cost_us(budget, 1, reads + !is_sent[id], { })) > budget.deadline) {
+            if (!is_any_sent) _decay_transaction_costs();
+            break;
+        }
+
+        usleep(USLEEP_MODIFICATION_INTERVAL);
+        _change_status(change, true);
+        reads += !is_sent[id];
+        is_sent[id] = is_any_sent = true;
+        ++budget.sent_count[id];
+
+        uint32_t elapsed = duration_cast<microseconds>(clock::now() - start).count();
+        _change_cost_us = (_change_cost_us * 7 + elapsed) / 8;
+    }
+
+    // a LED left out is where it was, and not read back
+    std::array<bool, UGREEN_MAX_LED_NUMBER> diverged { };
+    std::vector<led_type_t> read_ids;
+    for (auto id : ids) {
+        diverged[(uint8_t)id] = true;
+        if (is_sent[(uint8_t)id] || !has_changes[(uint8_t)id]) read_ids.push_back(id);
+    }
+
+    if (read_ids.empty()) return diverged;
+
+    auto start = clock::now();
+    if (is_any_sent) _wait_for_modification_result();
+
+    auto read_back = get_status_all(read_ids);
+    for (auto id : read_ids) {
+        status[(uint8_t)id] = read_back[(uint8_t)id];
+        diverged[(uint8_t)id] = !expected[(uint8_t)id]->is_reached_by(read_back[(uint8_t)id]);
+    }
+
+    // the retries of failed reads are included, which leaves room for them
+    uint64_t elapsed = duration_cast<microseconds>(clock::now() - start).count();
+    uint64_t per_read = elapsed > _read_back_fixed_us() ? (elapsed - _read_back_fixed_us()) / read_ids.size() : 0;
+    _read_cost_us = (_read_cost_us * 7 + (uint32_t)per_read) / 8;
+
+    return diverged;
+}
+
+ugreen_leds_t::transaction_result_t ugreen_leds_t::commit(uint32_t deadline_ms, bool rollback) {
+    transaction_budget_t budget;
+    budget.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms);
+    budget.reserve_rollback = rollback;
+
+    transaction_result_t result;
+    std::vector<led_change_t> changes;
+    changes.swap(_transaction);
+    if (changes.empty()) return result;
+
+    std::array<bool, UGREEN_MAX_LED_NUMBER> changed { };
+    for (const auto &change : changes) {
+        changed[(uint8_t)change.id] = true;
+        ++budget.change_count[(uint8_t)change.id];
+    }
+
+    // the states to restore, from the cache where it is known
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> original { };
+    if (rollback) {
+        std::vector<led_type_t> unknown;
+        for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+            if (!changed[id]) continue;
+            if (_cache_enabled && _cache[id].is_available) original[id] = _cache[id];
+            else unknown.push_back((led_type_t)id);
+        }
+
+        // fail before changing anything if the first pass would not fit
+        auto to_send = _changes_to_send(changes, changed, true);
+        std::array<bool, UGREEN_MAX_LED_NUMBER> is_sent { };
+        for (const auto &change : to_send)
+            is_sent[(uint8_t)change.id] = true;
+
+        uint64_t cost = _transaction_cost_us(budget, to_send.size(), 
+                std::count(changed.begin(), changed.end(), true), is_sent);
+        if (!unknown.empty()) cost += _read_back_fixed_us() + unknown.size() * _read_cost_us;
+
+        if (std::chrono::steady_clock::now() + std::chrono::microseconds(cost) > budget.deadline) {
+            _decay_transaction_costs();
+            result.rc = -1;
+            result.is_rolled_back = true;
+            return result;
+        }
+
+        if (!unknown.empty()) {
+            auto status = get_status_all(unknown);
+            for (auto id : unknown) original[(uint8_t)id] = status[(uint8_t)id];
+        }
+    }
+
+    // the states read back by the last pass of each LED
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> status { };
+
+    // only the first pass skips the changes that the (verified) cache has in
+    // place, while a LED that diverged is sent all its changes again
+    auto diverged = _transaction_pass(changes, changed, true, budget, status);
+
+    while (std::any_of(diverged.begin(), diverged.end(), [](bool d) { return d; })) {
+        const auto sent_count = budget.sent_count;
+        diverged = _transaction_pass(changes, diverged, false, budget, status);
+
+        // until the budget is too short for any of them
+        bool is_retried = false;
+        for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+            if (budget.sent_count[id] == sent_count[id]) continue;
+            ++_stats[id].retries;
+            is_retried = true;
+        }
+        if (!is_retried) break;
+    }
+
+    if (std::none_of(diverged.begin(), diverged.end(), [](bool d) { return d; }))
+        return result;
+
+    result.rc = -1;
+
+    if (rollback) {
+        // with the time reserved, unless the estimates were too low
+        budget.reserve_rollback = false;
+
+        std::vector<led_change_t> restore;
+        std::array<bool, UGREEN_MAX_LED_NUMBER> restored { };
+        std::array<bool, UGREEN_MAX_LED_NUMBER> is_touched { };
+        for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+            is_touched[id] = budget.sent_count[id] > 0;
+            if (!is_touched[id] || !original[id].is_available) continue;
+
+            // the fields that differ from the read back, or all of them if it failed
+            for (const auto &change : state_changes((led_type_t)id, status[id], original[id]))
+                restore.push_back(change);
+            restored[id] = true;
+        }
+
+        auto not_restored = _transaction_pass(restore, restored, false, budget, status);
+        for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+            // a LED whose original state is unknown stays where the changes left it
+            if (restored[id] ? not_restored[id] : is_touched[id] && diverged[id])
+                result.diverged.push_back((led_type_t)id);
+        }
+
+        result.is_rolled_back = true;
+        return result;
+    }
+
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+        if (diverged[id]) result.diverged.push_back((led_type_t)id);
+    }
+
+    return result;
+}
+
+std::vector<ugreen_leds_t::led_change_t> ugreen_leds_t::state_changes(led_type_t id, 
+        const led_data_t &current, const led_data_t &target) {
+    std::vector<led_change_t> changes;
+    bool known = current.is_available;
+
+    if (!known || current.color_r != target.color_r 
+            || current.color_g != target.color_g || current.color_b != target.color_b)
+        changes.push_back(rgb_change(id, target.color_r, target.color_g, target.color_b));
+
+    if (!known || current.brightness != target.brightness)
+        changes.push_back(brightness_change(id, target.brightness));
+
+    switch (target.op_mode) {
+        case op_mode_t::off:
+        case op_mode_t::on:
+            if (!known || current.op_mode != target.op_mode)
+                changes.push_back(onoff_change(id, target.op_mode == op_mode_t::on));
+            break;
+        case op_mode_t::blink:
+        case op_mode_t::breath:
+            if (!known || current.op_mode != target.op_mode 
+                    || current.t_on != target.t_on || current.t_off != target.t_off) {
+                if (target.op_mode == op_mode_t::blink)
+                    changes.push_back(blink_change(id, target.t_on, target.t_off));
+                else 
+                    changes.push_back(breath_change(id, target.t_on, target.t_off));
+            }
+            break;
+    }
+
+    return changes;
+}
+
+int ugreen_leds_t::set_state(led_type_t id, const led_data_t &target) {
+    if (_cache_enabled && _cache[(uint8_t)id].is_available)
+        return apply(state_changes(id, _cache[(uint8_t)id], target));
+
+    usleep(USLEEP_VERIFY_STATUS_INTERVAL);
+    return apply(state_changes(id, get_status(id), target));
 }
@@ -1,10 +1,14 @@
 #ifndef __UGREEN_LEDS_H__
 #define __UGREEN_LEDS_H__
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <optional>
+#include <vector>
 
 #include "i2c.h"
+#include "led-ugreen-protocol.h"
 
 #define UGREEN_LED_POWER    ugreen_leds_t::led_type_t::power
 #define UGREEN_LED_NETDEV   ugreen_leds_t::led_type_t::netdev
@@ -17,12 +21,30 @@
 #define UGREEN_LED_DISK7    ugreen_leds_t::led_type_t::disk7
 #define UGREEN_LED_DISK8    ugreen_leds_t::led_type_t::disk8
 
+#define UGREEN_MAX_LED_NUMBER   10
+
 // #define UGREEN_LED_I2C_DEV   "/dev/i2c-1"
 #define UGREEN_LED_I2C_ADDR  0x3a
 
-class ugreen_leds_t {
+#define MAX_RETRY_COUNT 5
+#define USLEEP_READ_STATUS_INTERVAL 8000
+#define USLEEP_READ_STATUS_RETRY_INTERVAL 3000
+#define USLEEP_MODIFICATION_INTERVAL 500
+#define USLEEP_MODIFICATION_RETRY_INTERVAL 3000
+#define USLEEP_MODIFICATION_QUERY_RESULT_INTERVAL 2000
+// the kmod reads the status right after usleep_range(500, 1500)
+#define USLEEP_VERIFY_STATUS_INTERVAL 1000
 
-    i2c_device_t _i2c;
+// adaptive timing: poll UGREEN_LED_REG_LAST_COMMAND_STATUS from the learned latency on, with exponential backoff
+#define USLEEP_ADAPTIVE_ACK_INITIAL 500
+#define USLEEP_ADAPTIVE_ACK_MIN_POLL 100
+#define USLEEP_ADAPTIVE_ACK_TIMEOUT 8000
+
+// transactions: the initial costs of sending a change, and of reading back a LED, until they are measured
+#define USLEEP_TRANSACTION_CHANGE_INITIAL 2000
+#define USLEEP_TRANSACTION_READ_INITIAL 2500
+
+class ugreen_leds_t {
 
 public:
 
@@ -30,6 +52,10 @@ public:
         off = 0, on, blink, breath
     };
 
+    enum class timing_mode_t : uint8_t {
+        fixed = 0, adaptive
+    };
+
     enum class led_type_t : uint8_t {
         power = 0, netdev, disk1, disk2, disk3, disk4, disk5, disk6, disk7, disk8
     };
@@ -43,10 +69,52 @@ public:
 
     };
 
+    // a single modification, i.e., one command frame sent to the MCU
+    struct led_change_t {
+        led_type_t id;
+        uint8_t command;
+        std::array<uint8_t, 4> params;
+    };
+
+    using command_frame_t = std::array<uint8_t, UGREEN_LED_COMMAND_FRAME_SIZE>;
+    using status_frame_t = std::array<uint8_t, UGREEN_LED_STATUS_FRAME_SIZE>;
+
+    // the frame written to the register of a LED (see led-ugreen-protocol.h)
+    static constexpr command_frame_t command_frame(const led_change_t &change) {
+        const auto &p = change.params;
+        auto frame = ugreen_led_encode_command((uint8_t)change.id, change.command, p[0], p[1], p[2], p[3]);
+
+        command_frame_t bytes { };
+        for (std::size_t i = 0; i < bytes.size(); ++i)
+            bytes[i] = frame.bytes[i];
+        return bytes;
+    }
+
+    // protocol-level failures of a LED, on top of the bus counters in i2c_stats_t
+    struct led_stats_t {
+        // the command frames written to the LED, including the retries
+        uint64_t writes = 0;
+        uint64_t retries = 0;
+        uint64_t ack_failures = 0;
+        uint64_t checksum_failures = 0;
+    };
+
 public:
     int start();
+    // drive the LEDs through another transport, e.g., a simulated MCU
+    void start(std::unique_ptr<i2c_transport_t> transport);
 
     led_data_t get_status(led_type_t id);
+    // get_status() with retries, giving up early on LEDs that do not exist
+    led_data_t get_status_robust(led_type_t id);
+    // Read the status of all (or the given) LEDs in one pass: a single settle 
+    // time, reads at the minimal interval, and retries of the failed ones only.
+    // Entries of LEDs that are not read or not found are unavailable.
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> get_status_all();
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> get_status_all(const std::vector<led_type_t> &ids);
+    // whether the last get_status_all() gave up on the LED without a valid
+    // answer, i.e., it is unavailable there but may exist
+    bool is_status_read_failed(led_type_t id) const { return _status_read_failed[(uint8_t)id]; }
     int set_onoff(led_type_t id, uint8_t status);
     int set_rgb(led_type_t id, uint8_t r, uint8_t g, uint8_t b);
     int set_brightness(led_type_t id, uint8_t brightness);
@@ -55,9 +123,146 @@ public:
 
     bool is_last_modification_successful();
 
+    // In the fixed mode, the worst-case sleeps (USLEEP_*) are used. In the 
+    // adaptive mode, the ack register is polled until the MCU responds, 
+    // starting from the ack latency learned from previous modifications.
+    // Acks at the first poll only bound the latency from above, so it is
+    // probed lower, but not below a floor tied to the latencies measured
+    // after busy polls: the register still holds the 1 of the previous
+    // command until the MCU has picked up the frame.
+    void set_timing_mode(timing_mode_t mode);
+    uint32_t ack_latency_us() const { return _ack_latency_us; }
+    uint32_t ack_floor_us() const { return _ack_floor_us(); }
+
+    // bound the share of the bus taken by the LEDs, in transfers per second
+    // (0 for no bound) and the most transfers sent at once
+    void set_bus_rate_limit(uint32_t rate, uint32_t burst) { _i2c.set_rate_limit(rate, burst); }
+    // the time until the budget allows a transfer, in microseconds
+    uint32_t bus_delay_us() { return _i2c.rate_limit_delay_us(); }
+
+    const led_stats_t &stats(led_type_t id) const { return _stats[(uint8_t)id]; }
+    const i2c_stats_t &bus_stats() const { return _i2c.stats(); }
+
+    // Send all changes back to back, and check them with one shared
+    // acknowledgement phase instead of waiting for each of them. 
+    // LEDs whose changes did not take effect are retried one by one.
+    // Returns 0 if all changes are applied.
+    int apply(const std::vector<led_change_t> &changes);
+
+    struct transaction_result_t {
+        // 0 if all LEDs have reached their target states
+        int rc = 0;
+        bool is_rolled_back = false;
+        // the LEDs in neither their target state nor, if rolled back, their original one
+        std::vector<led_type_t> diverged;
+    };
+
+    // Queue changes between begin() and commit(), which sends them as in
+    // apply(), and then checks all changed LEDs with one bulk read. LEDs
+    // that diverged are sent again in further passes, instead of retrying
+    // each change inline. If some LEDs still diverge, either they are 
+    // reported, or the LEDs sent to are restored in a last pass. The 
+    // deadline bounds the whole commit: a change is only sent if it and
+    // the read back fit before it, by the costs measured in previous 
+    // passes, so it is only exceeded by estimation errors and read retries.
+    // LEDs left out are reported as diverged. With rollback, the time to 
+    // read the original states and to restore them is reserved as well, 
+    // and nothing is sent at all if the changes do not fit with it.
+    void begin();
+    void queue(const led_change_t &change);
+    transaction_result_t commit(uint32_t deadline_ms, bool rollback = false);
+
+    // Change the LED to the target state (is_available is ignored), only
+    // sending the commands whose fields differ from the current state.
+    int set_state(led_type_t id, const led_data_t &target);
+
+    // the minimal changes that bring a LED from the current to the target state
+    static std::vector<led_change_t> state_changes(led_type_t id, 
+            const led_data_t &current, const led_data_t &target);
+
+    // The optional cache of LED states. It is populated by get_status(),
+    // and updated by modifications once the MCU has acknowledged them, so
+    // that modifications which would not change anything are skipped.
+    void enable_cache(bool enabled = true);
+    // call it if something else may also modify the LEDs
+    void invalidate_cache();
+    void invalidate_cache(led_type_t id);
+    // the cached state, which is unavailable if it is not known
+    const led_data_t &cached_status(led_type_t id) const { return _cache[(uint8_t)id]; }
+
+    static led_change_t onoff_change(led_type_t id, uint8_t status);
+    static led_change_t rgb_change(led_type_t id, uint8_t r, uint8_t g, uint8_t b);
+    static led_change_t brightness_change(led_type_t id, uint8_t brightness);
+    static led_change_t blink_change(led_type_t id, uint16_t t_on, uint16_t t_off);
+    static led_change_t breath_change(led_type_t id, uint16_t t_on, uint16_t t_off);
+
 private:
-    int _set_blink_or_breath(uint8_t command, led_type_t id, uint16_t t_on, uint16_t t_off);
-    int _change_status(led_type_t id, uint8_t command, std::array<std::optional<uint8_t>, 4> params);
+    i2c_device_t _i2c;
+
+    bool _cache_enabled = false;
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> _cache { };
+
+    timing_mode_t _timing_mode = timing_mode_t::fixed;
+    uint32_t _ack_latency_us = USLEEP_ADAPTIVE_ACK_INITIAL;
+    uint32_t _ack_measured_us = USLEEP_ADAPTIVE_ACK_INITIAL;
+    uint32_t _ack_floor_us() const {
+        return std::max<uint32_t>(_ack_measured_us * 3 / 4, USLEEP_ADAPTIVE_ACK_MIN_POLL);
+    }
+
+    std::array<led_stats_t, UGREEN_MAX_LED_NUMBER> _stats { };
+    std::array<bool, UGREEN_MAX_LED_NUMBER> _status_read_failed { };
+
+    std::vector<led_change_t> _transaction;
+    // the measured costs of sending a change, and of reading back a LED
+    // after the ack wait and the settle time
+    uint32_t _change_cost_us = USLEEP_TRANSACTION_CHANGE_INITIAL;
+    uint32_t _read_cost_us = USLEEP_TRANSACTION_READ_INITIAL;
+
+    // the deadline of a commit(), and the changes it has sent so far
+    struct transaction_budget_t {
+        std::chrono::steady_clock::time_point deadline;
+        // keep the time to restore each LED sent to with all its changes
+        bool reserve_rollback = false;
+        std::array<uint32_t, UGREEN_MAX_LED_NUMBER> change_count { };
+        std::array<uint32_t, UGREEN_MAX_LED_NUMBER> sent_count { };
+    };
+
+    bool _last_change_skipped = false;
+    led_type_t _last_change_id = led_type_t::power;
+    // the state of the last changed LED if its last frame is acknowledged
+    led_data_t _unconfirmed_state { };
+
+    bool _is_redundant(const led_change_t &change) const;
+    // raw_data is left empty if the transfer failed
+    led_data_t _read_status(led_type_t id, std::optional<status_frame_t> &raw_data);
+    std::array<led_data_t, UGREEN_MAX_LED_NUMBER> _get_status_many(std::array<bool, UGREEN_MAX_LED_NUMBER> pending);
+    static led_change_t _blink_or_breath_change(uint8_t command, led_type_t id, uint16_t t_on, uint16_t t_off);
+    // force sends the change even if the cache tells it is redundant
+    int _change_status(const led_change_t &change, bool force = false);
+    void _confirm_last_change();
+    int _change_status_robust(const led_change_t &change);
+    bool _wait_for_modification_result();
+    // the fixed part of a read back, i.e., the ack wait and the settle time
+    uint32_t _read_back_fixed_us() const;
+    // the time needed to send the changes and read back the LEDs, plus the
+    // reserve for restoring the LEDs sent to so far and the ones in to_send
+    uint64_t _transaction_cost_us(const transaction_budget_t &budget, std::size_t sends, std::size_t reads,
+            const std::array<bool, UGREEN_MAX_LED_NUMBER> &to_send) const;
+    // Costs that leave everything out are not measured any more, so they 
+    // decay to the initial ones, e.g., after a spike of scheduling latency.
+    void _decay_transaction_costs();
+    // the changes of the selected LEDs that a pass sends, before the budget
+    std::vector<led_change_t> _changes_to_send(const std::vector<led_change_t> &changes,
+            const std::array<bool, UGREEN_MAX_LED_NUMBER> &selected, bool skip_redundant) const;
+    // Send the changes of the selected LEDs that fit in the budget, and read
+    // them back into status, returning those that diverged (including the 
+    // ones left out). With the rollback reserved, a LED left out fails the 
+    // commit anyway, so either all changes are sent or none. Redundant 
+    // changes are only skipped if asked, e.g., not for LEDs that have 
+    // already diverged once.
+    std::array<bool, UGREEN_MAX_LED_NUMBER> _transaction_pass(const std::vector<led_change_t> &changes,
+            const std::array<bool, UGREEN_MAX_LED_NUMBER> &selected, bool skip_redundant,
+            transaction_budget_t &budget, std::array<led_data_t, UGREEN_MAX_LED_NUMBER> &status);
 };
 
 
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ugreen_leds.h"
+#include "ugreen_mcu_sim.h"
+
+#define DEFAULT_OPS     200
+#define DEFAULT_DEADLINE_MS 100
+
+using led_type_t = ugreen_leds_t::led_type_t;
+
+struct bench_options_t {
+    ugreen_mcu_sim_t::config_t sim;
+    ugreen_leds_t::timing_mode_t timing_mode = ugreen_leds_t::timing_mode_t::fixed;
+    long ops = DEFAULT_OPS;
+    // see ugreen_leds_t::set_bus_rate_limit()
+    long bus_rate = 0, bus_burst = 16;
+    // see ugreen_leds_t::commit()
+    long deadline_ms = DEFAULT_DEADLINE_MS;
+    bool rollback = false;
+    std::vector<std::string> scenarios;
+};
+
+struct bench_result_t {
+    std::vector<double> latencies_ms;
+    double elapsed_s = 0;
+    long failed = 0;
+};
+
+void show_help() {
+    std::cerr
+        << "Usage: ugreen_leds_bench [-scenario (single|batch|sweep|transaction)]... [-ops N]\n"
+           "                         [-adaptive] [-leds N] [-transfer-us US] [-ack-us US]\n"
+           "                         [-jitter-us US] [-nack-rate P] [-corruption-rate P]\n"
+           "                         [-seed N] [-bus-rate N [-bus-burst N]]\n"
+           "                         [-deadline MS] [-rollback]\n\n"
+           "       Measure ugreen_leds_t against a simulated MCU (ugreen_mcu_sim.h),\n"
+           "       and print the operations per second and latencies of each scenario.\n\n"
+           "       -scenario:   single: one color change at a time, waiting for its ack;\n"
+           "                    batch: a color change of every LED in one apply();\n"
+           "                    sweep: get_status_all() of all LEDs;\n"
+           "                    transaction: the batch in one commit() within\n"
+           "                    -deadline (default: " << DEFAULT_DEADLINE_MS << " ms), with -rollback\n"
+           "                    if given.\n"
+           "                    (default: all of them)\n"
+           "       -ops:        the operations of each scenario (default: " << DEFAULT_OPS << ").\n"
+           "       -adaptive:   use the adaptive timing mode instead of the fixed one.\n"
+           "       -leds:       the LEDs that exist, i.e., ids 0 to N - 1 (default: 10).\n"
+           "       -transfer-us: the bus time of a transfer (default: 1300).\n"
+           "       -ack-us:     the time to process a command (default: 1000),\n"
+           "       -jitter-us:  plus a uniform jitter up to it (default: 500).\n"
+           "       -nack-rate:  the probability of a NACK per transfer (default: 0).\n"
+           "       -corruption-rate: the probability of a flipped bit per transfer\n"
+           "                    (default: 0).\n"
+           "       -seed:       the seed of the faults and the jitter (default: 1).\n"
+           "       -bus-rate:   bound the transfers to N per second, in bursts of up to\n"
+           "                    -bus-burst (default: 16), as the daemon does.\n"
+        << std::endl;
+}
+
+void show_help_and_exit() {
+    show_help();
+    std::exit(-1);
+}
+
+static long parse_integer(int argc, char *argv[], int &i, long low, long high) {
+    if (i + 1 >= argc) {
+        std::cerr << "Err: " << argv[i] << " requires 1 parameter" << std::endl;
+        show_help_and_exit();
+    }
+
+    const char *str = argv[++i];
+    char *end;
+    errno = 0;
+    long value = std::strtol(str, &end, 10);
+
+    if (*str == '\0' || *end != '\0' || errno == ERANGE || value < low || value > high) {
+        std::cerr << "Err: " << str << " is not in [" << low << ", " << high << "]" << std::endl;
+        show_help_and_exit();
+    }
+
+    return value;
+}
+
+static double parse_probability(int argc, char *argv[], int &i) {
+    if (i + 1 >= argc) {
+        std::cerr << "Err: " << argv[i] << " requires 1 parameter" << std::endl;
+        show_help_and_exit();
+    }
+
+    const char *str = argv[++i];
+    char *end;
+    double value = std::strtod(str, &end);
+
+    if (*str == '\0' || *end != '\0' || !(value >= 0 && value <= 1)) {
+        std::cerr << "Err: " << str << " is not in [0, 1]" << std::endl;
+        show_help_and_exit();
+    }
+
+    return value;
+}
+
+// the color of the n-th change, so that consecutive changes of a LED differ
+static ugreen_leds_t::led_change_t color_change(led_type_t id, long n) {
+    return n % 2 ? ugreen_leds_t::rgb_change(id, 255, 0, 0) : ugreen_leds_t::rgb_change(id, 0, 0, 255);
+}
+
+static bench_result_t run_ops(long ops, const std::function<bool(long)> &op) {
+    using clock = std::chrono::steady_clock;
+    bench_result_t result;
+    result.latencies_ms.reserve(ops);
+
+    auto begin = clock::now();
+    for (long n = 0; n < ops; ++n) {
+        auto start = clock::now();
+        if (!op(n)) ++result.failed;
+        result.latencies_ms.push_back(std::chrono::duration<double, std::milli>(clock::now() - start).count());
+    }
+    result.elapsed_s = std::chrono::duration<double>(clock::now() - begin).count();
+
+    return result;
+}
+
+static double percentile(std::vector<double> samples, unsigned p) {
+    if (samples.empty()) return 0;
+
+    std::sort(samples.begin(), samples.end());
+    std::size_t rank = (samples.size() * p + 99) / 100;
+    return samples[std::max<std::size_t>(rank, 1) - 1];
+}
+
+static void run_scenario(const std::string &scenario, const bench_options_t &options) {
+    // each scenario starts with a fresh MCU and fresh counters
+    auto sim = std::make_unique<ugreen_mcu_sim_t>(options.sim);
+    const auto *mcu = sim.get();
+
+    ugreen_leds_t leds;
+    leds.start(std::move(sim));
+    leds.set_timing_mode(options.timing_mode);
+    leds.set_bus_rate_limit(options.bus_rate, options.bus_burst);
+
+    const uint8_t led_count = options.sim.led_count;
+    bench_result_t result;
+
+    if (scenario == "single") {
+        result = run_ops(options.ops, [&](long n) {
+            if (led_count == 0) return false;
+            return leds.apply({ color_change((led_type_t)(n % led_count), n / led_count) }) == 0;
+        });
+    } else if (scenario == "batch") {
+        result = run_ops(options.ops, [&](long n) {
+            std::vector<ugreen_leds_t::led_change_t> changes;
+            for (uint8_t id = 0; id < led_count; ++id)
+                changes.push_back(color_change((led_type_t)id, n));
+            return leds.apply(changes) == 0;
+        });
+    } else if (scenario == "transaction") {
+        result = run_ops(options.ops, [&](long n) {
+            leds.begin();
+            for (uint8_t id = 0; id < led_count; ++id)
+                leds.queue(color_change((led_type_t)id, n));
+            return leds.commit(options.deadline_ms, options.rollback).rc == 0;
+        });
+    } else {
+        result = run_ops(options.ops, [&](long) {
+            auto status = leds.get_status_all();
+            for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+                if (status[id].is_available != (id < led_count)) return false;
+            }
+            return true;
+        });
+    }
+
+    uint64_t retries = 0;
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id)
+        retries += leds.stats((led_type_t)id).retries;
+
+    const auto &counters = mcu->counters();
+    std::printf("%-11s %6ld %9.1f %8.2f %8.2f %7ld %12.1f %8llu %6llu %9llu\n",
+            scenario.c_str(), options.ops,
+            result.elapsed_s > 0 ? options.ops / result.elapsed_s : 0.0,
+            percentile(result.latencies_ms, 50), percentile(result.latencies_ms, 99),
+            result.failed, options.ops ? (double)counters.transfers / options.ops : 0.0,
+            (unsigned long long)retries, (unsigned long long)counters.nacks,
+            (unsigned long long)counters.corruptions);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-scenario") {
+            if (++i >= argc || (std::string(argv[i]) != "single" && std::string(argv[i]) != "batch"
+                        && std::string(argv[i]) != "sweep" && std::string(argv[i]) != "transaction")) {
+                std::cerr << "Err: -scenario requires single, batch, sweep or transaction" << std::endl;
+                show_help_and_exit();
+            }
+            options.scenarios.push_back(argv[i]);
+        } else if (arg == "-ops") {
+            options.ops = parse_integer(argc, argv, i, 1, 1000000);
+        } else if (arg == "-adaptive") {
+            options.timing_mode = ugreen_leds_t::timing_mode_t::adaptive;
+        } else if (arg == "-leds") {
+            options.sim.led_count = parse_integer(argc, argv, i, 0, UGREEN_MAX_LED_NUMBER);
+        } else if (arg == "-transfer-us") {
+            options.sim.transfer_us = parse_integer(argc, argv, i, 0, 1000000);
+        } else if (arg == "-ack-us") {
+            options.sim.ack_latency_us = parse_integer(argc, argv, i, 0, 1000000);
+        } else if (arg == "-jitter-us") {
+            options.sim.ack_jitter_us = parse_integer(argc, argv, i, 0, 1000000);
+        } else if (arg == "-nack-rate") {
+            options.sim.nack_rate = parse_probability(argc, argv, i);
+        } else if (arg == "-corruption-rate") {
+            options.sim.corruption_rate = parse_probability(argc, argv, i);
+        } else if (arg == "-seed") {
+            options.sim.seed = parse_integer(argc, argv, i, 0, UINT32_MAX);
+        } else if (arg == "-bus-rate") {
+            options.bus_rate = parse_integer(argc, argv, i, 0, 1000000);
+        } else if (arg == "-bus-burst") {
+            options.bus_burst = parse_integer(argc, argv, i, 1, 1000000);
+        } else if (arg == "-deadline") {
+            options.deadline_ms = parse_integer(argc, argv, i, 1, 60000);
+        } else if (arg == "-rollback") {
+            options.rollback = true;
+        } else if (arg == "-h" || arg == "--help") {
+            show_help();
+            return 0;
+        } else {
+            std::cerr << "Err: unknown parameter " << arg << std::endl;
+            show_help_and_exit();
+        }
+    }
+
+    if (options.scenarios.empty())
+        options.scenarios = { "single", "batch", "sweep", "transaction" };
+
+    std::printf("timing %s, %d LEDs, transfer %u us, ack %u + [0, %u] us, nack rate %g, corruption rate %g\n\n",
+            options.timing_mode == ugreen_leds_t::timing_mode_t::adaptive ? "adaptive" : "fixed",
+            options.sim.led_count, options.sim.transfer_us, options.sim.ack_latency_us,
+            options.sim.ack_jitter_us, options.sim.nack_rate, options.sim.corruption_rate);
+    std::printf("%-11s %6s %9s %8s %8s %7s %12s %8s %6s %9s\n", "scenario", "ops", "ops/s",
+            "p50_ms", "p99_ms", "failed", "transfers/op", "retries", "nacks", "corrupted");
+
+    for (const auto &scenario : options.scenarios)
+        run_scenario(scenario, options);
+
+    return 0;
+}
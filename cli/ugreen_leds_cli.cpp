@@ -3,18 +3,29 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <array>
 #include <deque>
 #include <map>
 #include <functional>
+#include <optional>
+#include <fstream>
+#include <set>
+#include <cstdio>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cctype>
+#include <csignal>
+#include <chrono>
 
 #include "ugreen_leds.h"
+#include "ugreen_animation.h"
+#include "ugreen_daemon.h"
+#include "led_snapshot.h"
 
-#define MAX_RETRY_COUNT 5
-#define USLEEP_READ_STATUS_INTERVAL 8000
-#define USLEEP_READ_STATUS_RETRY_INTERVAL 3000
-#define USLEEP_MODIFICATION_INTERVAL 500
-#define USLEEP_MODIFICATION_RETRY_INTERVAL 3000
-#define USLEEP_MODIFICATION_QUERY_RESULT_INTERVAL 2000
+#define LED_DISCOVERY_CACHE_PATH "/run/ugreen_leds_cli.leds"
+// the most I2C transfers sent at once under -bus-rate
+#define DEFAULT_BUS_BURST 16
 
 static std::map<std::string, ugreen_leds_t::led_type_t> led_name_map = {
     { "power",  UGREEN_LED_POWER },
@@ -31,61 +42,164 @@ static std::map<std::string, ugreen_leds_t::led_type_t> led_name_map = {
 
 using led_type_pair = std::pair<std::string, ugreen_leds_t::led_type_t>;
 
-ugreen_leds_t::led_data_t get_status_robust(ugreen_leds_t &leds_controller, ugreen_leds_t::led_type_t led) {
-    usleep(USLEEP_READ_STATUS_INTERVAL);
-    auto data = leds_controller.get_status(led);
+void show_led_info(FILE *out, const std::string &name, const ugreen_leds_t::led_data_t &data) {
 
-    for (int retry_cnt = 1; !data.is_available && retry_cnt < MAX_RETRY_COUNT; ++retry_cnt) {
-        usleep(USLEEP_READ_STATUS_RETRY_INTERVAL);
-        data = leds_controller.get_status(led);
+    if (!data.is_available) {
+        std::fprintf(out, "%s: unavailable or non-existent\n", name.c_str());
+        return;
     }
 
-    return data;
+    std::string op_mode_txt = "unknown";
+
+    switch(data.op_mode) {
+        case ugreen_leds_t::op_mode_t::off:
+            op_mode_txt = "off"; break;
+        case ugreen_leds_t::op_mode_t::on:
+            op_mode_txt = "on"; break;
+        case ugreen_leds_t::op_mode_t::blink:
+            op_mode_txt = "blink"; break;
+        case ugreen_leds_t::op_mode_t::breath:
+            op_mode_txt = "breath"; break;
+    };
+
+    std::fprintf(out, "%s: status = %s, brightness = %d, color = RGB(%d, %d, %d)",
+            name.c_str(), op_mode_txt.c_str(), (int)data.brightness, 
+            (int)data.color_r, (int)data.color_g, (int)data.color_b);
+
+    if (data.op_mode == ugreen_leds_t::op_mode_t::blink) {
+        std::fprintf(out, ", blink_on = %d ms, blink_off = %d ms",
+                (int)data.t_on, (int)data.t_off);
+    }
+
+    std::fputs("\n", out);
+}
+
+std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> show_leds_info(FILE *out,
+        ugreen_leds_t &leds_controller, const std::vector<led_type_pair>& leds) {
+
+    std::vector<ugreen_leds_t::led_type_t> ids;
+    for (auto led : leds)
+        ids.push_back(led.second);
+
+    auto status = leds_controller.get_status_all(ids);
+    for (auto led : leds)
+        show_led_info(out, led.first, status[(uint8_t)led.second]);
+
+    return status;
 }
 
-void show_leds_info(ugreen_leds_t &leds_controller, const std::vector<led_type_pair>& leds) {
+void show_stats(FILE *out, const ugreen_leds_t &leds_controller, const std::vector<led_type_pair>& leds) {
+
+    const auto &bus = leds_controller.bus_stats();
+    std::fprintf(out, "i2c: transactions = %llu, errors = %llu, latency p50 = %u us, p99 = %u us\n",
+            (unsigned long long)bus.transactions, (unsigned long long)bus.errors,
+            bus.latency_percentile_us(50), bus.latency_percentile_us(99));
+    std::fprintf(out, "ack: latency = %u us, floor = %u us\n",
+            leds_controller.ack_latency_us(), leds_controller.ack_floor_us());
 
     for (auto led : leds) {
+        const auto &stats = leds_controller.stats(led.second);
+        std::fprintf(out, "%s: retries = %llu, ack_failures = %llu, checksum_failures = %llu\n",
+                led.first.c_str(), (unsigned long long)stats.retries, 
+                (unsigned long long)stats.ack_failures, (unsigned long long)stats.checksum_failures);
+    }
+}
 
-        auto data = get_status_robust(leds_controller, led.second);
+void show_snapshot_stats(FILE *out, const led_snapshot_t &snapshot, const std::vector<led_type_pair>& leds) {
 
-        if (!data.is_available) {
-            std::printf("%s: unavailable or non-existent\n", led.first.c_str());
-            continue;
-        }
+    std::fprintf(out, "i2c: transactions = %llu, errors = %llu, latency p50 = %u us, p99 = %u us\n",
+            (unsigned long long)snapshot.bus_transactions, (unsigned long long)snapshot.bus_errors,
+            snapshot.bus_latency_p50_us, snapshot.bus_latency_p99_us);
+    std::fprintf(out, "ack: latency = %u us, floor = %u us\n",
+            snapshot.ack_latency_us, snapshot.ack_floor_us);
 
-        std::string op_mode_txt = "unknown";
-
-        switch(data.op_mode) {
-            case ugreen_leds_t::op_mode_t::off:
-                op_mode_txt = "off"; break;
-            case ugreen_leds_t::op_mode_t::on:
-                op_mode_txt = "on"; break;
-            case ugreen_leds_t::op_mode_t::blink:
-                op_mode_txt = "blink"; break;
-            case ugreen_leds_t::op_mode_t::breath:
-                op_mode_txt = "breath"; break;
-        };
-
-        std::printf("%s: status = %s, brightness = %d, color = RGB(%d, %d, %d)",
-                led.first.c_str(), op_mode_txt.c_str(), (int)data.brightness, 
-                (int)data.color_r, (int)data.color_g, (int)data.color_b);
-
-        if (data.op_mode == ugreen_leds_t::op_mode_t::blink) {
-            std::printf(", blink_on = %d ms, blink_off = %d ms",
-                    (int)data.t_on, (int)data.t_off);
-        }
+    for (auto led : leds) {
+        const auto &entry = snapshot.leds[(uint8_t)led.second];
+        std::fprintf(out, "%s: retries = %llu, ack_failures = %llu, checksum_failures = %llu, "
+                "writes = %llu, last_change = %lld ms\n",
+                led.first.c_str(), (unsigned long long)entry.retries,
+                (unsigned long long)entry.ack_failures, (unsigned long long)entry.checksum_failures,
+                (unsigned long long)entry.writes, (long long)entry.last_change_ms);
+    }
+}
+
+// The LEDs found by a previous probe. The cache lives in /run, so it is 
+// dropped at every boot, and can be removed manually to probe again.
+bool load_discovery_cache(std::vector<led_type_pair> &leds) {
+    std::ifstream ifs(LED_DISCOVERY_CACHE_PATH);
+    if (!ifs) return false;
+
+    std::set<std::string> names;
+    for (std::string line; std::getline(ifs, line); ) {
+        if (led_name_map.find(line) == led_name_map.end()) 
+            return false;
+        names.insert(line);
+    }
+
+    if (names.empty()) return false;
+
+    for (const auto &v : led_name_map) {
+        if (names.count(v.first))
+            leds.push_back(v);
+    }
+
+    return true;
+}
+
+void save_discovery_cache(const std::vector<led_type_pair> &leds) {
+    if (leds.empty()) return;
+
+    const std::string tmp_path = LED_DISCOVERY_CACHE_PATH ".tmp";
+    {
+        std::ofstream ofs(tmp_path);
+        if (!ofs) return;
+
+        for (const auto &led : leds)
+            ofs << led.first << "\n";
 
-        std::puts("");
+        if (!ofs) return;
     }
+
+    std::rename(tmp_path.c_str(), LED_DISCOVERY_CACHE_PATH);
+}
+
+void invalidate_discovery_cache() {
+    unlink(LED_DISCOVERY_CACHE_PATH);
+}
+
+// Probe the LEDs for `all`. The result is only cached if each LED has
+// either answered or been found missing, since reads that fail on a busy
+// bus would hide existing LEDs until the next boot.
+std::array<ugreen_leds_t::led_data_t, UGREEN_MAX_LED_NUMBER> probe_all_leds(ugreen_leds_t &leds_controller,
+        std::vector<led_type_pair> &all_leds) {
+    auto status = leds_controller.get_status_all();
+    bool is_conclusive = true;
+
+    for (const auto &v : led_name_map) {
+        if (status[(uint8_t)v.second].is_available)
+            all_leds.push_back(v);
+        else if (leds_controller.is_status_read_failed(v.second))
+            is_conclusive = false;
+    }
+
+    if (is_conclusive) save_discovery_cache(all_leds);
+    return status;
 }
 
 void show_help() {
     std::cerr 
         << "Usage: ugreen_leds_cli  [LED-NAME...] [-on] [-off] [-(blink|breath) T_ON T_OFF]\n"
-           "                    [-color R G B] [-brightness BRIGHTNESS] [-status]\n\n"
+           "                    [-color R G B] [-brightness BRIGHTNESS] [-status]\n"
+           "                    [-adaptive] [-stats] [-hardware] [-deadline MS [-rollback]]\n"
+           "       ugreen_leds_cli  --daemon [-adaptive] [-bus-rate N [-bus-burst N]]\n"
+           "       ugreen_leds_cli  --animate (sweep|scrub|blink|breath) [LED-NAME...]\n"
+           "                    [-color R G B] [-brightness BRIGHTNESS] [-period MS]\n"
+           "                    [-phase MS] [-tick MS] [-duration SECONDS] [-adaptive]\n\n"
            "       LED_NAME:    separated by white space, possible values are\n"
            "                    { power, netdev, disk[1-8], all }.\n"
+           "                    LEDs found for `all` are cached in\n"
+           "                    " LED_DISCOVERY_CACHE_PATH ", and probed\n"
+           "                    again once they disagree with the MCU.\n"
            "       -on / -off:  turn on / off corresponding LEDs.\n"
            "       -blink / -breath:  set LED to the blink / breath mode. This \n"
            "                    mode keeps the LED on for T_ON millseconds and then\n"
@@ -96,6 +210,40 @@ void show_help() {
            "       -brightness: set the brightness of corresponding LEDs.\n"
            "                    BRIGHTNESS should belong to [0, 255].\n"
            "       -status:     display the status of corresponding LEDs.\n"
+           "                    While a daemon is running, it is taken from the\n"
+           "                    states published in " LED_SNAPSHOT_PATH "\n"
+           "                    without any I2C transfer, unless -hardware is given.\n"
+           "       -adaptive:   poll the MCU until it acknowledges each modification,\n"
+           "                    instead of sleeping for the worst-case time.\n"
+           "       -stats:      display the I2C transfer counters and latencies, the\n"
+           "                    learned ack latency, and the retries of corresponding\n"
+           "                    LEDs at exit.\n"
+           "                    From the snapshot, they also include the writes and\n"
+           "                    the last change (in ms since the epoch) of each LED.\n"
+           "       -hardware:   read the status from the MCU, even with a daemon.\n"
+           "       -deadline:   apply the modifications as a transaction within MS\n"
+           "                    milliseconds: LEDs that did not take them are sent\n"
+           "                    again while it fits, and those still diverging or\n"
+           "                    left out for the deadline are listed. With -rollback,\n"
+           "                    the LEDs are then restored instead, and nothing is\n"
+           "                    changed if the restore would not fit as well.\n"
+           "       --daemon:    keep the I2C device and the LED states open, and\n"
+           "                    serve commands on " UGREEN_DAEMON_SOCKET_PATH ".\n"
+           "                    While a daemon is running, commands are sent to it,\n"
+           "                    and -adaptive only applies when starting the daemon.\n"
+           "                    -bus-rate bounds its I2C transfers to N per second, in\n"
+           "                    bursts of up to -bus-burst (default: 16) transfers, so\n"
+           "                    that other devices on the SMBus are not delayed. Over\n"
+           "                    the budget, queued activity commands are merged.\n"
+           "       --animate:   run an effect on the LEDs (in this order) for the\n"
+           "                    duration (default: until SIGINT / SIGTERM), and\n"
+           "                    restore their states. sweep / scrub move a lit LED\n"
+           "                    with a fading tail across them (and back for scrub)\n"
+           "                    every period (default: 1000 ms), rendered every tick\n"
+           "                    (default: 50 ms). blink / breath are run by the MCU with\n"
+           "                    T_ON = T_OFF = period / 2, each LED starting one phase\n"
+           "                    (default: period / number of LEDs) after the previous.\n"
+           "                    Only the changes between frames are sent.\n"
         << std::endl;
 }
 
@@ -104,108 +252,140 @@ void show_help_and_exit() {
     std::exit(-1);
 }
 
-ugreen_leds_t::led_type_t get_led_type(const std::string& name) {
-    if (led_name_map.find(name) == led_name_map.end()) {
-        std::cerr << "Err: unknown LED name " << name << std::endl;
-        show_help_and_exit();
+// (is_modification, change builder), where -status is not a modification
+using change_fn = std::function<ugreen_leds_t::led_change_t(ugreen_leds_t::led_type_t)>;
+using ops_pair = std::pair<bool, change_fn>;
+
+struct cli_command_t {
+    std::vector<led_type_pair> leds;
+    // where the LEDs found for `all` are inserted
+    std::optional<std::size_t> all_leds_pos;
+    std::vector<ops_pair> ops_seq;
+
+    bool is_adaptive = false;
+    bool show_stats = false;
+    // read the status from the MCU even if the daemon publishes it
+    bool read_hardware = false;
+
+    // commit each batch of modifications as a transaction of ugreen_leds_t
+    std::optional<uint32_t> deadline_ms;
+    bool rollback = false;
+};
+
+bool parse_led_type(const std::string& name, ugreen_leds_t::led_type_t &type, std::string &error) {
+    auto it = led_name_map.find(name);
+    if (it == led_name_map.end()) {
+        error = "unknown LED name " + name;
+        return false;
     }
 
-    return led_name_map[name];
+    type = it->second;
+    return true;
 }
 
-int parse_integer(const std::string& str, int low = 0, int high = 0xffff) {
-    std::size_t size;
-    int x = std::stoi(str, &size);
+bool parse_integer(const std::string& str, int &x, std::string &error, int low = 0, int high = 0xffff) {
+    char *end;
+    errno = 0;
+    long value = std::strtol(str.c_str(), &end, 10);
 
-    if (size != str.size()) {
-        std::cerr << "Err: " << str << " is not an integer." << std::endl;
-        show_help_and_exit();
+    if (str.empty() || *end != '\0' || errno == ERANGE) {
+        error = str + " is not an integer.";
+        return false;
     }
 
-    if (x < low || x > high) {
-        std::cerr << "Err: " << str << " is not in [" << low << ", " << high << "]" << std::endl;
-        show_help_and_exit();
+    if (value < low || value > high) {
+        error = str + " is not in [" + std::to_string(low) + ", " + std::to_string(high) + "]";
+        return false;
     }
 
-    return x;
+    x = value;
+    return true;
 }
 
-int main(int argc, char *argv[])
-{
-
-    if (argc < 2) {
-        show_help();
-        return 0;
+// Parse the arguments of a command. The parser never exits, so that 
+// the daemon can report errors of the received commands.
+bool parse_command(std::deque<std::string> args, cli_command_t &cmd, std::string &error) {
+
+    // global options, which also apply to probing LEDs
+    for (auto it = args.begin(); it != args.end(); ) {
+        if (*it == "-adaptive") {
+            cmd.is_adaptive = true;
+            it = args.erase(it);
+        } else if (*it == "-stats") {
+            cmd.show_stats = true;
+            it = args.erase(it);
+        } else if (*it == "-hardware") {
+            cmd.read_hardware = true;
+            it = args.erase(it);
+        } else if (*it == "-rollback") {
+            cmd.rollback = true;
+            it = args.erase(it);
+        } else if (*it == "-deadline") {
+            it = args.erase(it);
+            int deadline_ms;
+            if (it == args.end()) {
+                error = "-deadline requires 1 parameter";
+                return false;
+            }
+            if (!parse_integer(*it, deadline_ms, error, 1, 60000)) return false;
+            cmd.deadline_ms = deadline_ms;
+            it = args.erase(it);
+        } else ++it;
     }
 
-    ugreen_leds_t leds_controller;
-    if (leds_controller.start() != 0) {
-        std::cerr << "Err: fail to open the I2C device." << std::endl;
-        std::cerr << "Please check that (1) you have the root permission; " << std::endl;
-        std::cerr << "              and (2) the i2c-dev module is loaded. " << std::endl;
-        return -1;
+    if (cmd.rollback && !cmd.deadline_ms) {
+        error = "-rollback requires -deadline";
+        return false;
     }
 
-    std::deque<std::string> args;
-    for (int i = 1; i < argc; ++i)
-        args.emplace_back(argv[i]);
-
     // parse LED names
-    std::vector<led_type_pair> leds;
-
     while (!args.empty() && args.front().front() != '-') {
         if (args.front() == "all") {
-            for (const auto &v : led_name_map) {
-                if (get_status_robust(leds_controller, v.second).is_available)
-                    leds.push_back(v);
-            }
+            cmd.all_leds_pos = cmd.leds.size();
         } else {
-            auto led_type = get_led_type(args.front());
-            leds.emplace_back(args.front(), led_type);
+            ugreen_leds_t::led_type_t led_type;
+            if (!parse_led_type(args.front(), led_type, error))
+                return false;
+            cmd.leds.emplace_back(args.front(), led_type);
         }
 
         args.pop_front();
     }
 
-    // if no additional parameters, display current info
-    if (args.empty()) {
-        show_leds_info(leds_controller, leds);
-        return 0;
-    }
-
-    // (is_modification, callback)
-    using ops_pair = std::pair<bool, std::function<int(led_type_pair)>>;
-    std::vector<ops_pair> ops_seq;
+    auto &ops_seq = cmd.ops_seq;
+    int value;
 
     while (!args.empty()) {
         if (args.front() == "-on" || args.front() == "-off") {
             // turn on / off LEDs
             uint8_t status = args.front() == "-on";
-            ops_seq.emplace_back(true, [=, &leds_controller](led_type_pair led) {
-                return leds_controller.set_onoff(led.second, status);
+            ops_seq.emplace_back(true, [=](ugreen_leds_t::led_type_t id) {
+                return ugreen_leds_t::onoff_change(id, status);
             } );
 
             args.pop_front();
         } else if(args.front() == "-blink" || args.front() == "-breath") {
             // set blink
+            bool is_blink = (args.front() == "-blink");
             args.pop_front();
 
             if (args.size() < 2) {
-                std::cerr << "Err: -blink / -breath requires 2 parameters" << std::endl;
-                show_help_and_exit();
+                error = "-blink / -breath requires 2 parameters";
+                return false;
             }
 
-            uint16_t t_on = parse_integer(args.front(), 0x0000, 0xffff);
+            if (!parse_integer(args.front(), value, error, 0x0000, 0xffff)) return false;
+            uint16_t t_on = value;
             args.pop_front();
-            uint16_t t_off = parse_integer(args.front(), 0x0000, 0xffff);
+            if (!parse_integer(args.front(), value, error, 0x0000, 0xffff)) return false;
+            uint16_t t_off = value;
             args.pop_front();
 
-            bool is_blink = (args.front() == "-blink");
-            ops_seq.emplace_back(true, [=, &leds_controller](led_type_pair led) {
+            ops_seq.emplace_back(true, [=](ugreen_leds_t::led_type_t id) {
                 if (is_blink) {
-                    return leds_controller.set_blink(led.second, t_on, t_off);
+                    return ugreen_leds_t::blink_change(id, t_on, t_off);
                 } else {
-                    return leds_controller.set_breath(led.second, t_on, t_off);
+                    return ugreen_leds_t::breath_change(id, t_on, t_off);
                 }
             } );
         } else if(args.front() == "-color") {
@@ -213,78 +393,560 @@ int main(int argc, char *argv[])
             args.pop_front();
 
             if (args.size() < 3) {
-                std::cerr << "Err: -color requires 3 parameters" << std::endl;
-                show_help_and_exit();
+                error = "-color requires 3 parameters";
+                return false;
             }
 
-            uint8_t R = parse_integer(args.front(), 0x00, 0xff);
+            if (!parse_integer(args.front(), value, error, 0x00, 0xff)) return false;
+            uint8_t R = value;
             args.pop_front();
-            uint8_t G = parse_integer(args.front(), 0x00, 0xff);
+            if (!parse_integer(args.front(), value, error, 0x00, 0xff)) return false;
+            uint8_t G = value;
             args.pop_front();
-            uint8_t B = parse_integer(args.front(), 0x00, 0xff);
+            if (!parse_integer(args.front(), value, error, 0x00, 0xff)) return false;
+            uint8_t B = value;
             args.pop_front();
-            ops_seq.emplace_back(true, [=, &leds_controller](led_type_pair led) {
-                return leds_controller.set_rgb(led.second, R, G, B);
+            ops_seq.emplace_back(true, [=](ugreen_leds_t::led_type_t id) {
+                return ugreen_leds_t::rgb_change(id, R, G, B);
             } );
         } else if(args.front() == "-brightness") {
             // set brightness
             args.pop_front();
 
             if (args.size() < 1) {
-                std::cerr << "Err: -brightness requires 1 parameter" << std::endl;
-                show_help_and_exit();
+                error = "-brightness requires 1 parameter";
+                return false;
             }
 
-            uint8_t brightness = parse_integer(args.front(), 0x00, 0xff);
+            if (!parse_integer(args.front(), value, error, 0x00, 0xff)) return false;
+            uint8_t brightness = value;
             args.pop_front();
-            ops_seq.emplace_back(true, [=, &leds_controller](led_type_pair led) {
-                return leds_controller.set_brightness(led.second, brightness);
+            ops_seq.emplace_back(true, [=](ugreen_leds_t::led_type_t id) {
+                return ugreen_leds_t::brightness_change(id, brightness);
             } );
         } else if(args.front() == "-status") {
             // display the status
             args.pop_front();
 
-            ops_seq.emplace_back(false, [=, &leds_controller](led_type_pair led) {
-                show_leds_info(leds_controller, { led } );
-                return 0;
-            } );
+            ops_seq.emplace_back(false, nullptr);
         } else {
-            std::cerr << "Err: unknown parameter " << args.front() << std::endl;
-            show_help_and_exit();
+            error = "unknown parameter " + args.front();
+            return false;
         }
     }
 
-    for (const auto& led : leds) {
-        for (const auto& fn_pair : ops_seq) {
-            bool is_modification = fn_pair.first;
-            const auto &fn = fn_pair.second;
-            int last_status = -1;
+    return true;
+}
+
+int run_command(ugreen_leds_t &leds_controller, cli_command_t &cmd, FILE *out, FILE *err) {
+
+    auto &leds = cmd.leds;
+    auto &ops_seq = cmd.ops_seq;
+
+    auto finish = [&](int rc) {
+        if (cmd.show_stats) show_stats(out, leds_controller, leds);
+        return rc;
+    };
+
+    // The cached probe is dropped once it disagrees with what the LEDs do,
+    // i.e., a cached LED fails, or one that is not cached answers.
+    std::vector<led_type_pair> cached_leds;
+    bool has_cache = (cmd.all_leds_pos || !leds.empty()) && load_discovery_cache(cached_leds);
+
+    auto is_cached = [&](ugreen_leds_t::led_type_t id) {
+        return std::any_of(cached_leds.begin(), cached_leds.end(),
+                [=](const led_type_pair &led) { return led.second == id; });
+    };
+
+    auto check_cache = [&](const std::function<bool(ugreen_leds_t::led_type_t)> &is_available) {
+        if (!has_cache) return;
+        for (const auto &led : leds) {
+            if (is_available(led.second) != is_cached(led.second)) {
+                invalidate_discovery_cache();
+                has_cache = false;
+                return;
+            }
+        }
+    };
+
+    auto show_and_check = [&] {
+        auto status = show_leds_info(out, leds_controller, leds);
+        check_cache([&](ugreen_leds_t::led_type_t id) { return status[(uint8_t)id].is_available; });
+    };
+
+    if (cmd.all_leds_pos) {
+        std::vector<led_type_pair> all_leds = cached_leds;
+
+        if (!has_cache) {
+            // if only the status is queried, probing and displaying share the reads
+            bool is_status_only = leds.empty() && std::all_of(ops_seq.begin(), ops_seq.end(), 
+                    [](const ops_pair &op) { return !op.first; });
+
+            auto status = probe_all_leds(leds_controller, all_leds);
+            if (is_status_only) {
+                for (const auto &led : all_leds)
+                    show_led_info(out, led.first, status[(uint8_t)led.second]);
+
+                leds.insert(leds.begin() + *cmd.all_leds_pos, all_leds.begin(), all_leds.end());
+                if (ops_seq.size() <= 1) return finish(0);
+                ops_seq.erase(ops_seq.begin());
+                cmd.all_leds_pos.reset();
+            }
+        }
+
+        if (cmd.all_leds_pos) 
+            leds.insert(leds.begin() + *cmd.all_leds_pos, all_leds.begin(), all_leds.end());
+    }
 
-            for (int retry_cnt = 0; retry_cnt < MAX_RETRY_COUNT && last_status != 0; ++retry_cnt) {
+    // if no additional parameters, display current info
+    if (ops_seq.empty()) {
+        show_and_check();
+        return finish(0);
+    }
 
-                if (retry_cnt == 0) {
-                    if (is_modification) 
-                        usleep(USLEEP_MODIFICATION_INTERVAL);  // usleep_range(200, 0x5dc)
-                } else {
-                    usleep(USLEEP_MODIFICATION_RETRY_INTERVAL);  
-                }
+    // consecutive modifications of all LEDs are sent as one batch
+    for (auto it = ops_seq.begin(); it != ops_seq.end(); ) {
+        if (!it->first) {
+            show_and_check();
+            ++it;
+            continue;
+        }
 
-                last_status = fn(led);
+        std::vector<ugreen_leds_t::led_change_t> changes;
+        auto batch_end = std::find_if(it, ops_seq.end(), [](const ops_pair &op) { return !op.first; });
+
+        for (const auto& led : leds) {
+            for (auto op = it; op != batch_end; ++op)
+                changes.push_back(op->second(led.second));
+        }
 
-                if (last_status == 0 && is_modification) {
-                    usleep(USLEEP_MODIFICATION_QUERY_RESULT_INTERVAL);  
-                    last_status = !leds_controller.is_last_modification_successful();
+        if (cmd.deadline_ms) {
+            leds_controller.begin();
+            for (const auto &change : changes)
+                leds_controller.queue(change);
+
+            auto result = leds_controller.commit(*cmd.deadline_ms, cmd.rollback);
+            if (result.rc != 0) {
+                std::string names;
+                for (auto id : result.diverged) {
+                    auto led = std::find_if(leds.begin(), leds.end(),
+                            [=](const led_type_pair &led) { return led.second == id; });
+                    names += " " + led->first;
                 }
-            }
 
-            if (last_status != 0) {
-                std::cerr << "failed to change status!" << std::endl;
-                return -1;
+                std::fprintf(err, "failed to change status%s%s!\n", result.is_rolled_back ? " (rolled back)" : "",
+                        names.empty() ? "" : (", diverged:" + names).c_str());
+                check_cache([&](ugreen_leds_t::led_type_t id) {
+                    return std::find(result.diverged.begin(), result.diverged.end(), id) == result.diverged.end();
+                });
+                return finish(-1);
             }
+        } else if (leds_controller.apply(changes) != 0) {
+            std::fprintf(err, "failed to change status!\n");
+            // which LED has failed is not known, so probe again next time
+            if (has_cache) invalidate_discovery_cache();
+            return finish(-1);
+        }
+
+        // all LEDs have taken the changes
+        check_cache([](ugreen_leds_t::led_type_t) { return true; });
+        it = batch_end;
+    }
+
+    return finish(0);
+}
+
+// Answer a command that only displays the status from the snapshot of
+// the daemon. Returns false if it has to be read from the MCU instead,
+// i.e., a LED found by the daemon has an unknown state.
+bool run_snapshot_command(const led_snapshot_t &snapshot, cli_command_t &cmd, FILE *out) {
+    auto leds = cmd.leds;
+
+    if (cmd.all_leds_pos) {
+        std::vector<led_type_pair> all_leds;
+        for (const auto &v : led_name_map) {
+            if (snapshot.leds[(uint8_t)v.second].flags & LED_SNAPSHOT_PRESENT)
+                all_leds.push_back(v);
+        }
+
+        if (all_leds.empty()) return false;
+        leds.insert(leds.begin() + *cmd.all_leds_pos, all_leds.begin(), all_leds.end());
+    }
+
+    for (const auto &led : leds) {
+        uint8_t flags = snapshot.leds[(uint8_t)led.second].flags;
+        if ((flags & LED_SNAPSHOT_PRESENT) && !(flags & LED_SNAPSHOT_KNOWN))
+            return false;
+    }
+
+    for (std::size_t i = 0; i < std::max<std::size_t>(cmd.ops_seq.size(), 1); ++i) {
+        for (const auto &led : leds) {
+            const auto &entry = snapshot.leds[(uint8_t)led.second];
+            auto data = entry.data;
+            data.is_available = entry.flags & LED_SNAPSHOT_KNOWN;
+            show_led_info(out, led.first, data);
+        }
+    }
+
+    if (cmd.show_stats) show_snapshot_stats(out, snapshot, leds);
+    return true;
+}
+
+// copy the cached states and the counters, and stamp the states that have changed
+void update_snapshot(const ugreen_leds_t &leds_controller, led_snapshot_t &snapshot) {
+    using namespace std::chrono;
+    int64_t now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+
+    const auto &bus = leds_controller.bus_stats();
+    snapshot.bus_transactions = bus.transactions;
+    snapshot.bus_errors = bus.errors;
+    snapshot.bus_latency_p50_us = bus.latency_percentile_us(50);
+    snapshot.bus_latency_p99_us = bus.latency_percentile_us(99);
+    snapshot.ack_latency_us = leds_controller.ack_latency_us();
+    snapshot.ack_floor_us = leds_controller.ack_floor_us();
+
+    for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+        auto &entry = snapshot.leds[id];
+        const auto &data = leds_controller.cached_status((ugreen_leds_t::led_type_t)id);
+        const auto &stats = leds_controller.stats((ugreen_leds_t::led_type_t)id);
+
+        // a state that is unknown for a while (e.g., after a missed ack) has not changed
+        if (data.is_available) {
+            const auto &last = entry.data;
+            if (!entry.last_change_ms || last.op_mode != data.op_mode || last.brightness != data.brightness
+                    || last.color_r != data.color_r || last.color_g != data.color_g || last.color_b != data.color_b
+                    || last.t_on != data.t_on || last.t_off != data.t_off)
+                entry.last_change_ms = now_ms;
+
+            entry.data = data;
+            entry.flags |= LED_SNAPSHOT_KNOWN;
+        } else {
+            entry.flags &= ~LED_SNAPSHOT_KNOWN;
         }
+
+        entry.writes = stats.writes;
+        entry.retries = stats.retries;
+        entry.ack_failures = stats.ack_failures;
+        entry.checksum_failures = stats.checksum_failures;
     }
-    
+}
+
+int start_controller(ugreen_leds_t &leds_controller, bool is_adaptive) {
+    if (leds_controller.start() != 0) {
+        std::cerr << "Err: fail to open the I2C device." << std::endl;
+        std::cerr << "Please check that (1) you have the root permission; " << std::endl;
+        std::cerr << "              and (2) the i2c-dev module is loaded. " << std::endl;
+        return -1;
+    }
+
+    // states read while probing LEDs let redundant modifications be skipped
+    leds_controller.enable_cache();
+
+    if (is_adaptive)
+        leds_controller.set_timing_mode(ugreen_leds_t::timing_mode_t::adaptive);
 
     return 0;
 }
 
+// Commands that only change the brightness or the blink / breath mode are 
+// activity updates (e.g., from monitoring scripts). A newer activity update
+// of the same LEDs and options replaces a queued one. Everything else, 
+// in particular color and on / off changes used for alerts, comes first.
+void classify_request(daemon_request_t &request) {
+    static const std::set<std::string> alert_options = { 
+        "-on", "-off", "-color", "-status", "-stats" 
+    };
+
+    cli_command_t cmd;
+    std::string error;
+    if (!parse_command(std::deque<std::string>(request.args.begin(), request.args.end()), cmd, error) 
+            || cmd.ops_seq.empty())
+        return;
+
+    std::string merge_key;
+    for (const auto &arg : request.args) {
+        if (alert_options.count(arg)) return;
+
+        // numbers are the parameters, which do not matter for merging
+        if (std::isdigit((unsigned char)arg.front())) continue;
+
+        if (!merge_key.empty()) merge_key += ' ';
+        merge_key += arg;
+    }
+
+    request.priority = daemon_priority_t::activity;
+    request.merge_key = merge_key;
+}
+
+// Keep the I2C device and the state cache across commands. The timing
+// mode is fixed when the daemon starts, so -adaptive in requests is ignored.
+int run_daemon_mode(const std::deque<std::string> &args) {
+    bool is_adaptive = false;
+    int bus_rate = 0, bus_burst = DEFAULT_BUS_BURST;
+
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        std::string error;
+        if (args[i] == "-adaptive") {
+            is_adaptive = true;
+        } else if (args[i] == "-bus-rate" || args[i] == "-bus-burst") {
+            bool is_rate = args[i] == "-bus-rate";
+            if (i + 1 >= args.size()) {
+                std::cerr << "Err: " << args[i] << " requires 1 parameter" << std::endl;
+                show_help_and_exit();
+            }
+            if (!parse_integer(args[++i], is_rate ? bus_rate : bus_burst, error, is_rate ? 0 : 1)) {
+                std::cerr << "Err: " << error << std::endl;
+                show_help_and_exit();
+            }
+        } else {
+            std::cerr << "Err: unknown parameter " << args[i] << std::endl;
+            show_help_and_exit();
+        }
+    }
+
+    ugreen_leds_t leds_controller;
+    if (start_controller(leds_controller, is_adaptive) != 0)
+        return -1;
+
+    leds_controller.set_bus_rate_limit(bus_rate, bus_burst);
+
+    // status queries read the snapshot, so the states are read once at start
+    led_snapshot_writer_t snapshot_writer;
+    led_snapshot_t snapshot { };
+    if (snapshot_writer.open(LED_SNAPSHOT_PATH) != 0) {
+        std::perror(LED_SNAPSHOT_PATH);
+    } else {
+        auto status = leds_controller.get_status_all();
+        for (uint8_t id = 0; id < UGREEN_MAX_LED_NUMBER; ++id) {
+            if (status[id].is_available)
+                snapshot.leds[id].flags |= LED_SNAPSHOT_PRESENT;
+        }
+
+        update_snapshot(leds_controller, snapshot);
+        snapshot_writer.publish(snapshot);
+    }
+
+    daemon_handler_t handler;
+    handler.classify = classify_request;
+    // over the budget, requests wait in the queue, where activity updates are merged
+    handler.delay_us = [&] { return leds_controller.bus_delay_us(); };
+    handler.execute = [&](const daemon_request_t &request) {
+        daemon_response_t response;
+        cli_command_t cmd;
+        std::string error;
+
+        if (!parse_command(std::deque<std::string>(request.args.begin(), request.args.end()), cmd, error)) {
+            response.rc = -1;
+            response.err = "Err: " + error + "\n";
+            return response;
+        }
+
+        char *out_buf = nullptr, *err_buf = nullptr;
+        std::size_t out_size = 0, err_size = 0;
+        FILE *out = open_memstream(&out_buf, &out_size);
+        FILE *err = open_memstream(&err_buf, &err_size);
+
+        if (out && err) {
+            response.rc = run_command(leds_controller, cmd, out, err);
+
+            update_snapshot(leds_controller, snapshot);
+            snapshot_writer.publish(snapshot);
+        } else {
+            response.rc = -1;
+            response.err = "Err: out of memory\n";
+        }
+
+        if (out) std::fclose(out);
+        if (err) std::fclose(err);
+
+        if (out_buf) response.out.assign(out_buf, out_size);
+        if (err_buf) response.err.append(err_buf, err_size);
+        std::free(out_buf);
+        std::free(err_buf);
+
+        return response;
+    };
+
+    return run_daemon(UGREEN_DAEMON_SOCKET_PATH, handler);
+}
+
+static volatile std::sig_atomic_t is_animation_stopped = 0;
+
+static void stop_animation(int) {
+    is_animation_stopped = 1;
+}
+
+int run_animation_mode(std::deque<std::string> args) {
+    if (args.empty()) {
+        std::cerr << "Err: --animate requires an effect" << std::endl;
+        show_help_and_exit();
+    }
+
+    const std::string effect_name = args.front();
+    args.pop_front();
+
+    // the LED names, and the options of the effect
+    std::deque<std::string> names;
+    while (!args.empty() && args.front().front() != '-') {
+        names.push_back(args.front());
+        args.pop_front();
+    }
+
+    int value;
+    std::string error;
+    uint8_t color[3] = { 255, 255, 255 };
+    uint8_t brightness = 255;
+    uint32_t period_ms = 1000, tick_ms = ANIMATION_DEFAULT_TICK_MS, duration_ms = 0;
+    std::optional<uint32_t> phase_ms;
+    bool is_adaptive = false;
+
+    auto parse_next = [&](int low, int high) {
+        args.pop_front();
+        if (args.empty() || !parse_integer(args.front(), value, error, low, high)) {
+            std::cerr << "Err: " << (args.empty() ? "missing parameter" : error) << std::endl;
+            show_help_and_exit();
+        }
+        return value;
+    };
+
+    while (!args.empty()) {
+        const std::string option = args.front();
+        if (option == "-color") {
+            for (auto &c : color) c = parse_next(0x00, 0xff);
+        } else if (option == "-brightness") {
+            brightness = parse_next(0x00, 0xff);
+        } else if (option == "-period") {
+            period_ms = parse_next(2, 0xffff);
+        } else if (option == "-phase") {
+            phase_ms = parse_next(0, 0xffff);
+        } else if (option == "-tick") {
+            tick_ms = parse_next(1, 0xffff);
+        } else if (option == "-duration") {
+            duration_ms = parse_next(1, 86400) * 1000;
+        } else if (option == "-adaptive") {
+            is_adaptive = true;
+        } else {
+            std::cerr << "Err: unknown parameter " << option << std::endl;
+            show_help_and_exit();
+        }
+
+        args.pop_front();
+    }
+
+    ugreen_leds_t leds_controller;
+    if (start_controller(leds_controller, is_adaptive) != 0)
+        return -1;
+
+    std::vector<ugreen_leds_t::led_type_t> leds;
+    for (const auto &name : names) {
+        if (name == "all") {
+            std::vector<led_type_pair> all_leds;
+            if (!load_discovery_cache(all_leds))
+                probe_all_leds(leds_controller, all_leds);
+
+            for (const auto &led : all_leds)
+                leds.push_back(led.second);
+        } else {
+            ugreen_leds_t::led_type_t led_type;
+            if (!parse_led_type(name, led_type, error)) {
+                std::cerr << "Err: " << error << std::endl;
+                show_help_and_exit();
+            }
+            leds.push_back(led_type);
+        }
+    }
+
+    if (leds.empty()) {
+        std::cerr << "Err: no LED to animate" << std::endl;
+        return -1;
+    }
+
+    ugreen_animation_t::effect_t effect;
+    uint16_t t_half = period_ms / 2;
+    uint32_t phase = phase_ms ? *phase_ms : period_ms / leds.size();
+
+    if (effect_name == "sweep" || effect_name == "scrub") {
+        effect = ugreen_animation_t::sweep(leds, period_ms, effect_name == "scrub");
+    } else if (effect_name == "blink") {
+        effect = ugreen_animation_t::blink(leds, t_half, period_ms - t_half, phase);
+    } else if (effect_name == "breath") {
+        effect = ugreen_animation_t::breath(leds, t_half, period_ms - t_half, phase);
+    } else {
+        std::cerr << "Err: unknown effect " << effect_name << std::endl;
+        show_help_and_exit();
+    }
+
+    effect.color_r = color[0];
+    effect.color_g = color[1];
+    effect.color_b = color[2];
+    effect.brightness = brightness;
+
+    ugreen_animation_t animation(leds_controller);
+    animation.set_tick(tick_ms);
+    animation.add_effect(effect);
+
+    // without SA_RESTART, the sleep between frames is interrupted at once
+    struct sigaction action { };
+    action.sa_handler = stop_animation;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    int rc = animation.run(duration_ms, &is_animation_stopped);
+    if (rc != 0)
+        std::cerr << "failed to change status!" << std::endl;
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+
+    if (argc < 2) {
+        show_help();
+        return 0;
+    }
+
+    std::deque<std::string> args(argv + 1, argv + argc);
+
+    if (args.front() == "--daemon") {
+        args.pop_front();
+        return run_daemon_mode(args);
+    }
+
+    // frames are sent directly, since each of them is a batch of its own
+    if (args.front() == "--animate") {
+        args.pop_front();
+        return run_animation_mode(args);
+    }
+
+    cli_command_t cmd;
+    std::string error;
+    if (!parse_command(args, cmd, error)) {
+        std::cerr << "Err: " << error << std::endl;
+        show_help_and_exit();
+    }
+
+    // the status published by a running daemon costs no bus transfer at all
+    bool is_status_only = std::all_of(cmd.ops_seq.begin(), cmd.ops_seq.end(),
+            [](const ops_pair &op) { return !op.first; });
+
+    led_snapshot_t snapshot;
+    if (is_status_only && !cmd.read_hardware && read_led_snapshot(LED_SNAPSHOT_PATH, snapshot)
+            && run_snapshot_command(snapshot, cmd, stdout))
+        return 0;
+
+    // a running daemon saves the device lookup and the LED probing
+    daemon_response_t response;
+    if (send_daemon_request(UGREEN_DAEMON_SOCKET_PATH, 
+                std::vector<std::string>(args.begin(), args.end()), response)) {
+        std::fputs(response.out.c_str(), stdout);
+        std::fputs(response.err.c_str(), stderr);
+        return response.rc;
+    }
+
+    ugreen_leds_t leds_controller;
+    if (start_controller(leds_controller, cmd.is_adaptive) != 0)
+        return -1;
+
+    return run_command(leds_controller, cmd, stdout, stderr);
+}
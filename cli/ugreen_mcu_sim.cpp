@@ -0,0 +1,154 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "ugreen_mcu_sim.h"
+
+ugreen_mcu_sim_t::ugreen_mcu_sim_t(const config_t &config)
+    : _config(config), _rng(config.seed) {
+
+    _config.led_count = std::min<uint8_t>(_config.led_count, UGREEN_MCU_SIM_LED_NUMBER);
+
+    // what the kernel module leaves after probing: on, white, brightness 128
+    for (auto &led : _leds) {
+        led.valid = 1;
+        led.status = 1;
+        led.brightness = 128;
+        led.r = led.g = led.b = 255;
+    }
+}
+
+bool ugreen_mcu_sim_t::_begin_transfer() {
+    ++_counters.transfers;
+    if (_config.transfer_us) usleep(_config.transfer_us);
+
+    _process_pending();
+
+    if (_config.nack_rate > 0 && std::bernoulli_distribution(_config.nack_rate)(_rng)) {
+        ++_counters.nacks;
+        return false;
+    }
+
+    return true;
+}
+
+void ugreen_mcu_sim_t::_maybe_corrupt(uint8_t *data, uint32_t size) {
+    if (size == 0 || _config.corruption_rate <= 0
+            || !std::bernoulli_distribution(_config.corruption_rate)(_rng))
+        return;
+
+    ++_counters.corruptions;
+    uint32_t bit = std::uniform_int_distribution<uint32_t>(0, size * 8 - 1)(_rng);
+    data[bit / 8] ^= 1u << (bit % 8);
+}
+
+void ugreen_mcu_sim_t::_process_pending() {
+    auto now = clock::now();
+
+    while (!_pending.empty() && _pending.front().done_at <= now) {
+        const auto &command = _pending.front();
+        if (command.is_valid) {
+            _apply(command.frame);
+            ++_counters.commands_applied;
+        } else {
+            ++_counters.commands_rejected;
+        }
+
+        _last_command_ok = command.is_valid;
+        _pending.pop_front();
+    }
+}
+
+void ugreen_mcu_sim_t::_apply(const ugreen_led_command_frame &frame) {
+    auto &led = _leds[frame.bytes[0]];
+    const uint8_t *p = frame.bytes + 6;
+
+    switch (frame.bytes[5]) {
+        case UGREEN_LED_CMD_BRIGHTNESS:
+            led.brightness = p[0];
+            break;
+        case UGREEN_LED_CMD_COLOR:
+            led.r = p[0];
+            led.g = p[1];
+            led.b = p[2];
+            break;
+        case UGREEN_LED_CMD_ON_OFF:
+            led.status = p[0] ? 1 : 0;
+            break;
+        case UGREEN_LED_CMD_BLINK:
+        case UGREEN_LED_CMD_BREATH:
+            led.status = frame.bytes[5] == UGREEN_LED_CMD_BLINK ? 2 : 3;
+            led.t_cycle = (p[0] << 8) | p[1];
+            led.t_on = (p[2] << 8) | p[3];
+            break;
+    }
+}
+
+int ugreen_mcu_sim_t::write_i2c_block(uint8_t command, const uint8_t *data, uint32_t size) {
+    if (!_begin_transfer()) return -EREMOTEIO;
+
+    pending_command_t pending { };
+    std::copy_n(data, std::min<uint32_t>(size, UGREEN_LED_COMMAND_FRAME_SIZE), pending.frame.bytes);
+    _maybe_corrupt(pending.frame.bytes, UGREEN_LED_COMMAND_FRAME_SIZE);
+
+    // the frame is decoded again, with the register it was written to as its id
+    const auto &bytes = pending.frame.bytes;
+    auto expected = ugreen_led_encode_command(command, bytes[5], bytes[6], bytes[7], bytes[8], bytes[9]);
+    pending.is_valid = size == UGREEN_LED_COMMAND_FRAME_SIZE && command < _config.led_count
+        && bytes[5] >= UGREEN_LED_CMD_BRIGHTNESS && bytes[5] <= UGREEN_LED_CMD_BREATH
+        && std::equal(bytes, bytes + UGREEN_LED_COMMAND_FRAME_SIZE, expected.bytes);
+
+    uint32_t latency = _config.ack_latency_us
+        + std::uniform_int_distribution<uint32_t>(0, _config.ack_jitter_us)(_rng);
+    auto start = _pending.empty() ? clock::now() : std::max(clock::now(), _pending.back().done_at);
+    pending.picked_at = start + std::chrono::microseconds(std::min(_config.pickup_us, latency));
+    pending.done_at = start + std::chrono::microseconds(latency);
+
+    _pending.push_back(pending);
+    return 0;
+}
+
+int ugreen_mcu_sim_t::read_i2c_block(uint8_t command, uint8_t *data, uint32_t size) {
+    if (!_begin_transfer()) return -EREMOTEIO;
+
+    uint8_t frame[UGREEN_LED_STATUS_FRAME_SIZE] = { };
+    uint8_t id = command - UGREEN_LED_REG_STATUS(0);
+
+    if (command >= UGREEN_LED_REG_STATUS(0) && id < _config.led_count) {
+        const auto &led = _leds[id];
+        frame[0] = led.status;
+        frame[1] = led.brightness;
+        frame[2] = led.r;
+        frame[3] = led.g;
+        frame[4] = led.b;
+        frame[5] = led.t_cycle >> 8;
+        frame[6] = led.t_cycle & 0xff;
+        frame[7] = led.t_on >> 8;
+        frame[8] = led.t_on & 0xff;
+
+        uint16_t cksum = ugreen_led_checksum(frame, 9);
+        frame[9] = cksum >> 8;
+        frame[10] = cksum & 0xff;
+    }
+
+    uint32_t n = std::min<uint32_t>(size, UGREEN_LED_STATUS_FRAME_SIZE);
+    std::fill_n(data, size, 0);
+    std::copy_n(frame, n, data);
+    _maybe_corrupt(data, n);
+
+    return 0;
+}
+
+int ugreen_mcu_sim_t::read_byte(uint8_t command) {
+    if (!_begin_transfer()) return -EREMOTEIO;
+
+    if (command != UGREEN_LED_REG_LAST_COMMAND_STATUS)
+        return 0;
+
+    // busy until all queued commands are processed, once the first one is picked up
+    bool is_busy = !_pending.empty() && clock::now() >= _pending.front().picked_at;
+    uint8_t value = !is_busy && _last_command_ok ? 1 : 0;
+    _maybe_corrupt(&value, 1);
+    return value;
+}
@@ -0,0 +1,88 @@
+#ifndef __UGREEN_MCU_SIM_H__
+#define __UGREEN_MCU_SIM_H__
+
+#include <stdint.h>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <random>
+
+#include "i2c.h"
+#include "led-ugreen-protocol.h"
+
+#define UGREEN_MCU_SIM_LED_NUMBER   10
+
+// A simulated LED controller behind i2c_transport_t, for benchmarks and
+// fault injection. It speaks the protocol of led-ugreen-protocol.h:
+//
+//   - command frames are queued and processed in order, each taking the
+//     ack latency, and the ack register reads 0 from when the MCU picks up
+//     a frame until the queue is empty; before the pickup, it still holds
+//     the result of the previous command;
+//   - a frame with a wrong checksum or header, or for a LED that does
+//     not exist, is not applied and not acknowledged;
+//   - the LEDs that do not exist answer with the same invalid status frame;
+//   - every transfer takes the transfer time, and may be NACKed, or have
+//     one of its bits flipped on the bus (in either direction).
+class ugreen_mcu_sim_t : public i2c_transport_t {
+
+public:
+    struct config_t {
+        // ids 0 - (led_count - 1) exist, e.g., 4 for the power, netdev and 2 disk LEDs of DXP2800
+        uint8_t led_count = UGREEN_MCU_SIM_LED_NUMBER;
+        // the time of a transfer on the bus, e.g., ~1.3 ms for 14 bytes at 100 kHz
+        uint32_t transfer_us = 1300;
+        // the time to process a command, plus a uniform jitter in [0, ack_jitter_us]
+        uint32_t ack_latency_us = 1000;
+        uint32_t ack_jitter_us = 500;
+        // the time until the MCU picks up a written frame, and clears the ack register
+        uint32_t pickup_us = 200;
+        // the probabilities of a NACK and of a corrupted frame, per transfer
+        double nack_rate = 0;
+        double corruption_rate = 0;
+        uint32_t seed = 1;
+    };
+
+    struct counters_t {
+        uint64_t transfers = 0;
+        uint64_t nacks = 0;
+        uint64_t corruptions = 0;
+        uint64_t commands_applied = 0;
+        uint64_t commands_rejected = 0;
+    };
+
+    explicit ugreen_mcu_sim_t(const config_t &config);
+
+    int read_i2c_block(uint8_t command, uint8_t *data, uint32_t size) override;
+    int write_i2c_block(uint8_t command, const uint8_t *data, uint32_t size) override;
+    int read_byte(uint8_t command) override;
+
+    const counters_t &counters() const { return _counters; }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct pending_command_t {
+        clock::time_point picked_at, done_at;
+        bool is_valid;
+        ugreen_led_command_frame frame;
+    };
+
+    config_t _config;
+    counters_t _counters;
+    std::mt19937 _rng;
+
+    // the same fields as a status frame
+    std::array<ugreen_led_status, UGREEN_MCU_SIM_LED_NUMBER> _leds { };
+    std::deque<pending_command_t> _pending;
+    bool _last_command_ok = false;
+
+    // the bus time of a transfer, and whether it is NACKed
+    bool _begin_transfer();
+    void _maybe_corrupt(uint8_t *data, uint32_t size);
+    // apply the commands that have been processed by now
+    void _process_pending();
+    void _apply(const ugreen_led_command_frame &frame);
+};
+
+#endif
@@ -0,0 +1,986 @@
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ata.h"
+#include "zfs.h"
+#include "disk_mapping.h"
+#include "led_config.h"
+#include "led_output.h"
+#include "led_policy.h"
+
+#define SYSFS_BLOCK_PATH        "/sys/block/"
+#define DISK_STAT_BUFFER_SIZE   256
+#define DEFAULT_INTERVAL_MS     100
+#define UEVENT_BUFFER_SIZE      8192
+#define UEVENT_SOCKET_RCVBUF    (1 << 20)
+
+struct disk_activity_t {
+    std::string led_name;
+    std::string dev_name;
+    // The slot of the disk (for hotplug), either a component of the sysfs
+    // path of its device (e.g., ata3 or 2:0:0:0), or the sysfs path of the
+    // SCSI device of the block device (starting with /devices/). If it is
+    // empty, only a device with the same name is taken as the same disk.
+    std::string slot;
+    bool is_present = true;
+    // changed whenever a disk is added or removed
+    uint32_t generation = 0;
+
+    // SMART reports that the disk is failing
+    bool is_failed = false;
+    std::future<ata_smart_status_t> smart_result;
+    uint32_t smart_generation = 0;
+    timespec next_smart_check { 0, 0 };
+
+    // a vdev on the disk is not healthy
+    bool is_zpool_failed = false;
+
+    int stat_fd = -1;
+    int shot_fd = -1;
+
+    char last_stat[DISK_STAT_BUFFER_SIZE];
+    ssize_t last_stat_len = 0;
+};
+
+struct monitor_options_t {
+    // the disks are found by the mapping if none is given
+    bool has_mapping = false;
+    disk_mapping_method_t mapping = disk_mapping_method_t::ata;
+    std::vector<std::string> serials;
+
+    bool hotplug = false;
+    rgb_color_t online_color { 255, 255, 255 };
+    rgb_color_t offline_color { 255, 0, 0 };
+    uint8_t brightness = 255;
+
+    // SMART checks are disabled if it is 0
+    long smart_interval_ms = 0;
+    rgb_color_t smart_fail_color { 255, 0, 0 };
+
+    bool zfs = false;
+    rgb_color_t zfs_fail_color { 255, 0, 0 };
+
+    // the polling interval doubles up to it while no disk is active (0 to disable)
+    long idle_max_interval_ms = 0;
+
+    // the brightness between the minutes of the day [night_start, night_end)
+    // in local time, which may wrap around midnight
+    bool has_night_mode = false;
+    int night_start = 0, night_end = 0;
+    uint8_t night_brightness = 0;
+};
+
+struct zfs_health_t {
+    zfs_event_stream_t events;
+    std::map<std::string, zfs_vdev_state_t> vdev_states;
+    // the index of the disk of each vdev, or -1 if it is not mapped to a LED
+    std::map<std::string, int> vdev_disks;
+    uint32_t vdev_disks_generation = 0;
+};
+
+// changed whenever a disk is added or removed, which invalidates the cached vdev mapping
+static uint32_t disks_generation = 0;
+
+// the colors asked for by the events, written at flush()
+static led_policy_t policy;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+static int open_disk_stat(disk_activity_t &disk) {
+    if (!disk.is_present) return -1;
+
+    const auto path = SYSFS_BLOCK_PATH + disk.dev_name + "/stat";
+    disk.stat_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    return disk.stat_fd;
+}
+
+// returns the length of the stat content, or 0 if the device is gone
+static ssize_t read_disk_stat(disk_activity_t &disk, char *buf) {
+    if (disk.stat_fd < 0 && open_disk_stat(disk) < 0)
+        return 0;
+
+    ssize_t len = pread(disk.stat_fd, buf, DISK_STAT_BUFFER_SIZE, 0);
+    if (len < 0) {
+        // the device has been removed; reopen it at the next tick
+        close(disk.stat_fd);
+        disk.stat_fd = -1;
+        return 0;
+    }
+
+    return len;
+}
+
+static void fire_oneshot(disk_activity_t &disk) {
+    if (disk.shot_fd < 0) {
+        const auto path = SYSFS_LEDS_PATH + disk.led_name + "/shot";
+        disk.shot_fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (disk.shot_fd < 0) return;
+    }
+
+    if (pwrite(disk.shot_fd, "1", 1, 0) < 0) {
+        // the trigger may have been changed, reopen it next time
+        close(disk.shot_fd);
+        disk.shot_fd = -1;
+    }
+}
+
+// set up the trigger again if the slot was empty, the same as ugreen-diskiomon
+static void setup_disk_trigger(const disk_activity_t &disk) {
+    if (!is_sysfs_led(disk.led_name)) return;
+
+    write_led_attr(disk.led_name, "trigger", "oneshot");
+    write_led_attr(disk.led_name, "invert", "1");
+    write_led_attr(disk.led_name, "delay_on", "100");
+    write_led_attr(disk.led_name, "delay_off", "100");
+
+    // the slot may have been turned off by the script
+    policy.invalidate(disk.led_name);
+}
+
+// the sysfs path of the SCSI device of a block device, i.e., the part of
+// DEVPATH before /block/, e.g., /devices/pci0000:00/0000:00:17.0/ata3/host2/target2:0:0/2:0:0:0
+static std::string device_path_of(const std::string &dev_path) {
+    auto pos = dev_path.rfind("/block/");
+    return pos == std::string::npos ? std::string() : dev_path.substr(0, pos);
+}
+
+// returns an empty string if the block device does not exist
+static std::string resolve_device_path(const std::string &dev_name) {
+    char buf[4096];
+    const auto link = SYSFS_BLOCK_PATH + dev_name;
+    ssize_t len = readlink(link.c_str(), buf, sizeof(buf) - 1);
+    if (len < 0) return "";
+    buf[len] = '\0';
+
+    // the link is relative, e.g., ../devices/.../block/sda
+    std::string path = buf;
+    auto pos = path.find("/devices/");
+    return pos == std::string::npos ? std::string() : device_path_of(path.substr(pos));
+}
+
+static bool is_same_disk(const disk_activity_t &disk, const std::string &dev_name,
+        const std::string &device_path) {
+    if (device_path.empty())
+        return false;
+
+    if (disk.slot.empty())
+        return dev_name == disk.dev_name;
+
+    if (disk.slot.front() == '/')
+        return device_path == disk.slot;
+
+    return (device_path + "/").find("/" + disk.slot + "/") != std::string::npos;
+}
+
+static void disk_added(disk_activity_t &disk, const std::string &dev_name,
+        const monitor_options_t &options) {
+    disk.dev_name = dev_name;
+    disk.is_present = true;
+    disk.is_failed = false;
+    disk.is_zpool_failed = false;
+    disk.next_smart_check = { 0, 0 };
+    ++disk.generation;
+    ++disks_generation;
+    disk.last_stat_len = read_disk_stat(disk, disk.last_stat);
+
+    std::cout << "Disk /dev/" << dev_name << " is online at " << disk.led_name << std::endl;
+    setup_disk_trigger(disk);
+    policy.clear(disk.led_name, led_priority_t::unavailable);
+    policy.clear(disk.led_name, led_priority_t::smart_failure);
+    policy.clear(disk.led_name, led_priority_t::zpool_failure);
+    policy.set(disk.led_name, led_priority_t::activity, options.online_color);
+}
+
+static void disk_removed(disk_activity_t &disk, const monitor_options_t &options) {
+    if (disk.stat_fd >= 0) close(disk.stat_fd);
+    disk.stat_fd = -1;
+    disk.last_stat_len = 0;
+    disk.is_present = false;
+    ++disk.generation;
+    ++disks_generation;
+
+    std::cout << "Disk /dev/" << disk.dev_name << " went offline at " << disk.led_name << std::endl;
+    // the failures were of the disk that is gone
+    disk.is_failed = false;
+    disk.is_zpool_failed = false;
+    policy.clear(disk.led_name, led_priority_t::smart_failure);
+    policy.clear(disk.led_name, led_priority_t::zpool_failure);
+    policy.set(disk.led_name, led_priority_t::unavailable, options.offline_color);
+}
+
+// Bring the mapping up to date with /sys/block, at start and after losing
+// uevents: disks that are gone go offline, and new disks in the slots online.
+static void sync_disks(std::vector<disk_activity_t> &disks, const monitor_options_t &options) {
+    for (auto &disk : disks) {
+        if (disk.is_present && !is_same_disk(disk, disk.dev_name, resolve_device_path(disk.dev_name)))
+            disk_removed(disk, options);
+    }
+
+    DIR *dir = opendir(SYSFS_BLOCK_PATH);
+    if (!dir) return;
+
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+
+        const std::string dev_name = entry->d_name;
+        const auto device_path = resolve_device_path(dev_name);
+        if (device_path.empty()) continue;
+
+        for (auto &disk : disks) {
+            if (!disk.is_present && is_same_disk(disk, dev_name, device_path)) {
+                disk_added(disk, dev_name, options);
+                break;
+            }
+        }
+    }
+
+    closedir(dir);
+}
+
+static int open_uevent_socket() {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return -1;
+
+    // a burst of events (e.g., a port reset) should not overflow the socket
+    int rcvbuf = UEVENT_SOCKET_RCVBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // the multicast group 1 carries the kernel events (udev re-broadcasts on 2)
+    sockaddr_nl addr { };
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// A kernel uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings, all NUL-terminated.
+static void handle_uevent(const char *buf, std::size_t len,
+        std::vector<disk_activity_t> &disks, const monitor_options_t &options) {
+    std::string action, dev_path, subsystem, dev_type, dev_name;
+
+    for (std::size_t pos = std::strlen(buf) + 1; pos < len; ) {
+        const char *field = buf + pos;
+        std::size_t field_len = strnlen(field, len - pos);
+
+        if (!std::strncmp(field, "ACTION=", 7)) action = field + 7;
+        else if (!std::strncmp(field, "DEVPATH=", 8)) dev_path = field + 8;
+        else if (!std::strncmp(field, "SUBSYSTEM=", 10)) subsystem = field + 10;
+        else if (!std::strncmp(field, "DEVTYPE=", 8)) dev_type = field + 8;
+        else if (!std::strncmp(field, "DEVNAME=", 8)) dev_name = field + 8;
+
+        pos += field_len + 1;
+    }
+
+    // partitions come and go with their disks
+    if (subsystem != "block" || dev_type != "disk" || dev_name.empty())
+        return;
+
+    if (action == "add" || action == "remove")
+        invalidate_disk_slots_cache();
+
+    if (action == "add") {
+        const auto device_path = device_path_of(dev_path);
+
+        for (auto &disk : disks) {
+            if (!disk.is_present && is_same_disk(disk, dev_name, device_path)) {
+                disk_added(disk, dev_name, options);
+                break;
+            }
+        }
+    } else if (action == "remove") {
+        for (auto &disk : disks) {
+            if (disk.is_present && disk.dev_name == dev_name) {
+                disk_removed(disk, options);
+                break;
+            }
+        }
+    }
+}
+
+static void receive_uevents(int fd, std::vector<disk_activity_t> &disks,
+        const monitor_options_t &options) {
+    char buf[UEVENT_BUFFER_SIZE];
+
+    for (;;) {
+        sockaddr_nl sender { };
+        iovec iov { buf, sizeof(buf) - 1 };
+        msghdr msg { };
+        msg.msg_name = &sender;
+        msg.msg_namelen = sizeof(sender);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t len = recvmsg(fd, &msg, 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            // some events are lost, so look at the devices again
+            if (errno == ENOBUFS) {
+                invalidate_disk_slots_cache();
+                sync_disks(disks, options);
+                continue;
+            }
+            return;
+        }
+
+        // only trust the kernel
+        if (sender.nl_pid != 0 || len == 0) continue;
+
+        buf[len] = '\0';
+        handle_uevent(buf, len, disks, options);
+    }
+}
+
+// the whole disk below a block device, e.g., sda for sda1, or for dm-0 on top of sda1
+static std::string disk_below(const std::string &name, int depth = 0) {
+    const std::string path = "/sys/class/block/" + name;
+
+    // device mapper (e.g., LUKS): follow the first device below, as ugreen-diskiomon did
+    if (depth < 8) {
+        std::string slave;
+        if (DIR *dir = opendir((path + "/slaves").c_str())) {
+            while (dirent *entry = readdir(dir)) {
+                if (entry->d_name[0] != '.') {
+                    slave = entry->d_name;
+                    break;
+                }
+            }
+            closedir(dir);
+        }
+
+        if (!slave.empty()) return disk_below(slave, depth + 1);
+    }
+
+    // a partition is a subdirectory of its disk in sysfs
+    char buf[PATH_MAX];
+    if (access((path + "/partition").c_str(), F_OK) == 0 && realpath((path + "/..").c_str(), buf)) {
+        const char *slash = std::strrchr(buf, '/');
+        return slash ? slash + 1 : buf;
+    }
+
+    return name;
+}
+
+static int find_vdev_disk(zfs_health_t &zfs, const std::string &vdev_path,
+        const std::vector<disk_activity_t> &disks) {
+    if (zfs.vdev_disks_generation != disks_generation) {
+        zfs.vdev_disks.clear();
+        zfs.vdev_disks_generation = disks_generation;
+    }
+
+    auto it = zfs.vdev_disks.find(vdev_path);
+    if (it != zfs.vdev_disks.end()) return it->second;
+
+    int index = -1;
+    char buf[PATH_MAX];
+    if (realpath(vdev_path.c_str(), buf)) {
+        const char *slash = std::strrchr(buf, '/');
+        const auto dev_name = disk_below(slash ? slash + 1 : buf);
+
+        for (std::size_t i = 0; i < disks.size(); ++i) {
+            if (disks[i].is_present && disks[i].dev_name == dev_name)
+                index = i;
+        }
+    }
+
+    zfs.vdev_disks[vdev_path] = index;
+    return index;
+}
+
+// LEDs are only changed when the health of a disk, i.e., of all vdevs on it, changes
+static void update_vdev_state(zfs_health_t &zfs, const zfs_vdev_event_t &event,
+        std::vector<disk_activity_t> &disks, const monitor_options_t &options) {
+    auto &state = zfs.vdev_states[event.path];
+    if (state == event.state) return;
+    state = event.state;
+
+    int index = find_vdev_disk(zfs, event.path, disks);
+    if (index < 0) return;
+
+    bool is_failed = false;
+    for (const auto &vdev : zfs.vdev_states) {
+        if (vdev.second != zfs_vdev_state_t::healthy && vdev.second != zfs_vdev_state_t::unknown
+                && find_vdev_disk(zfs, vdev.first, disks) == index)
+            is_failed = true;
+    }
+
+    auto &disk = disks[index];
+    if (disk.is_zpool_failed == is_failed) return;
+    disk.is_zpool_failed = is_failed;
+
+    if (is_failed) {
+        std::cout << "Disk failure detected on /dev/" << disk.dev_name << " (zpool device " << event.path << ")" << std::endl;
+        policy.set(disk.led_name, led_priority_t::zpool_failure, options.zfs_fail_color);
+    } else {
+        std::cout << "Zpool devices on /dev/" << disk.dev_name << " are online again" << std::endl;
+        policy.clear(disk.led_name, led_priority_t::zpool_failure);
+    }
+}
+
+static void receive_zfs_events(zfs_health_t &zfs, std::vector<disk_activity_t> &disks,
+        const monitor_options_t &options) {
+    std::vector<zfs_vdev_event_t> events;
+    if (!zfs.events.read_events(events))
+        std::cerr << "Err: zpool events has exited, the zpool health is not monitored anymore" << std::endl;
+
+    for (const auto &event : events)
+        update_vdev_state(zfs, event, disks, options);
+}
+
+static void timespec_add_ms(timespec &ts, long ms) {
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+}
+
+static timespec timespec_until(const timespec &deadline) {
+    timespec now, left;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    left.tv_sec = deadline.tv_sec - now.tv_sec;
+    left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (left.tv_nsec < 0) {
+        left.tv_sec -= 1;
+        left.tv_nsec += 1000000000L;
+    }
+
+    if (left.tv_sec < 0) left = { 0, 0 };
+    return left;
+}
+
+// the inputs handled between the ticks, which are unused if negative or null
+struct event_sources_t {
+    int uevent_fd = -1;
+    zfs_health_t *zfs = nullptr;
+};
+
+// Without event sources, wait for the next tick. Otherwise, handle the events
+// until the next tick, or sleep until an event if no disk is present.
+static bool wait_next_tick(const timespec &next_tick, const event_sources_t &sources,
+        std::vector<disk_activity_t> &disks, const monitor_options_t &options) {
+    if (sources.uevent_fd < 0 && !sources.zfs) {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, nullptr) == EINTR) {
+            if (stop_requested) return false;
+        }
+        return true;
+    }
+
+    for (;;) {
+        bool has_disks = std::any_of(disks.begin(), disks.end(), [](const disk_activity_t &disk) {
+            return disk.is_present;
+        });
+
+        pollfd fds[] = {
+            { sources.uevent_fd, POLLIN, 0 },
+            { sources.zfs ? sources.zfs->events.fd() : -1, POLLIN, 0 },
+        };
+        timespec timeout = timespec_until(next_tick);
+        int rc = ppoll(fds, 2, has_disks ? &timeout : nullptr, nullptr);
+
+        if (stop_requested) return false;
+        if (rc < 0 && errno != EINTR) return false;
+        if (rc == 0) return true;
+
+        if (rc > 0 && fds[0].revents) receive_uevents(sources.uevent_fd, disks, options);
+        if (rc > 0 && fds[1].revents) receive_zfs_events(*sources.zfs, disks, options);
+        policy.flush();
+
+        if (!has_disks) return true;
+    }
+}
+
+// runs in a thread of its own, so that a slow disk does not hold up the others
+static ata_smart_status_t check_smart_health(std::string dev_name) {
+    ata_device_t ata;
+    if (ata.start(("/dev/" + dev_name).c_str()) != 0)
+        return ata_smart_status_t::unknown;
+
+    // asking a disk in standby for its SMART status would spin it up
+    if (ata.check_power_mode() == ata_power_mode_t::standby)
+        return ata_smart_status_t::unknown;
+
+    return ata.smart_return_status();
+}
+
+// Collect the finished SMART checks, and start those that are due, all
+// disks at the same time. Disks that are gone or failing are not checked.
+static void check_smart(std::vector<disk_activity_t> &disks, const monitor_options_t &options) {
+    if (options.smart_interval_ms <= 0) return;
+
+    for (auto &disk : disks) {
+        if (disk.smart_result.valid()) {
+            if (disk.smart_result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                continue;
+
+            auto status = disk.smart_result.get();
+
+            // the result of a disk that has been replaced meanwhile is dropped
+            if (status == ata_smart_status_t::failing && disk.smart_generation == disk.generation) {
+                disk.is_failed = true;
+                std::cout << "Disk failure detected on /dev/" << disk.dev_name << std::endl;
+                policy.set(disk.led_name, led_priority_t::smart_failure, options.smart_fail_color);
+            }
+        }
+
+        if (!disk.is_present || disk.is_failed) continue;
+
+        timespec left = timespec_until(disk.next_smart_check);
+        if (left.tv_sec != 0 || left.tv_nsec != 0) continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &disk.next_smart_check);
+        timespec_add_ms(disk.next_smart_check, options.smart_interval_ms);
+
+        disk.smart_generation = disk.generation;
+        disk.smart_result = std::async(std::launch::async, check_smart_health, disk.dev_name);
+    }
+}
+
+static bool is_night(const monitor_options_t &options) {
+    time_t now = time(nullptr);
+    tm local;
+    if (!localtime_r(&now, &local)) return false;
+
+    int minute = local.tm_hour * 60 + local.tm_min;
+    if (options.night_start <= options.night_end)
+        return minute >= options.night_start && minute < options.night_end;
+    return minute >= options.night_start || minute < options.night_end;
+}
+
+// change the brightness of all disk LEDs when the night begins or ends,
+// which the next flush writes as one batch
+static void update_night_mode(const std::vector<disk_activity_t> &disks, const monitor_options_t &options,
+        bool &night) {
+    if (!options.has_night_mode || is_night(options) == night) return;
+    night = !night;
+
+    std::cout << (night ? "Dimming" : "Restoring") << " the disk LEDs for the night mode" << std::endl;
+    for (const auto &disk : disks)
+        policy.set_brightness(disk.led_name, night ? options.night_brightness : options.brightness);
+}
+
+static void monitor_disk_activities(std::vector<disk_activity_t> &disks, long interval_ms,
+        const event_sources_t &sources, const monitor_options_t &options) {
+    char buf[DISK_STAT_BUFFER_SIZE];
+    bool night = false;
+
+    for (auto &disk : disks)
+        disk.last_stat_len = read_disk_stat(disk, disk.last_stat);
+    update_night_mode(disks, options, night);
+    policy.flush();
+
+    // The block layer does not notify changes of the stat files, so idle
+    // disks are polled less and less often, and the first activity brings
+    // the interval back. Uevents and zpool events still wake up at once.
+    long tick_ms = interval_ms;
+
+    timespec next_tick;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+
+    while (!stop_requested) {
+        timespec_add_ms(next_tick, tick_ms);
+        if (!wait_next_tick(next_tick, sources, disks, options))
+            return;
+
+        // do not catch up with the ticks missed while sleeping without disks
+        timespec late = next_tick;
+        timespec_add_ms(late, tick_ms);
+        if (timespec_until(late).tv_sec == 0 && timespec_until(late).tv_nsec == 0)
+            clock_gettime(CLOCK_MONOTONIC, &next_tick);
+
+        bool is_active = false;
+        for (auto &disk : disks) {
+            if (!disk.is_present) continue;
+
+            ssize_t len = read_disk_stat(disk, buf);
+
+            if (len != disk.last_stat_len || std::memcmp(buf, disk.last_stat, len) != 0) {
+                fire_oneshot(disk);
+                std::memcpy(disk.last_stat, buf, len);
+                disk.last_stat_len = len;
+                is_active = true;
+            }
+        }
+
+        if (is_active || options.idle_max_interval_ms <= interval_ms)
+            tick_ms = interval_ms;
+        else
+            tick_ms = std::min(tick_ms * 2, options.idle_max_interval_ms);
+
+        check_smart(disks, options);
+        update_night_mode(disks, options, night);
+        policy.flush();
+    }
+}
+
+void show_help() {
+    std::cerr
+        << "Usage: ugreen_monitor [-config FILE] [-interval SECONDS] [-hotplug [-online-color R G B]\n"
+           "                      [-offline-color R G B]] [-smart SECONDS [-smart-fail-color R G B]]\n"
+           "                      [-zfs [-zfs-fail-color R G B]]\n"
+           "                      [-brightness BRIGHTNESS] [-idle-backoff SECONDS]\n"
+           "                      [-night HH:MM-HH:MM BRIGHTNESS] LED:[BLOCK_DEV][@SLOT]...\n"
+           "       ugreen_monitor [OPTIONS] -mapping (ata|hctl|serial) [-serial \"SN...\"]\n"
+           "                      [-print-mapping]\n\n"
+           "       LED:BLOCK_DEV:  a disk LED and the block device mapped to it,\n"
+           "                    e.g. disk1:sda. The LED blinks once (through the\n"
+           "                    oneshot trigger) whenever the counters in\n"
+           "                    /sys/block/BLOCK_DEV/stat change.\n"
+           "       @SLOT:       a component of the sysfs path of the disks in\n"
+           "                    the slot, e.g. disk1:sda@ata3, or disk2:@ata4 for\n"
+           "                    an empty slot (for -hotplug).\n"
+           "       -config:     take the options from ugreen-leds.conf (e.g.,\n"
+           "                    " UGREEN_LEDS_CONF_PATH "), as ugreen-diskiomon does,\n"
+           "                    with -hotplug. The options after it override it.\n"
+           "       -mapping:    find the disks of the LEDs as ugreen-diskiomon does with\n"
+           "                    MAPPING_METHOD, by the ata ports or the hctl of the\n"
+           "                    slots of the product (in DMI), or by the serials of\n"
+           "                    -serial in the order of the LEDs. The result is cached\n"
+           "                    in " DISK_MAPPING_CACHE_PATH " until a disk is added or removed.\n"
+           "       -print-mapping: print the LEDs, their disks and slots (- for none),\n"
+           "                    and exit.\n"
+           "       -interval:   the polling interval in seconds (default: 0.1).\n"
+           "       -hotplug:    listen to the kernel uevents of block devices, and\n"
+           "                    show the online color (default: 255 255 255) for\n"
+           "                    disks added to the slots, and the offline color\n"
+           "                    (default: 255 0 0) for disks removed.\n"
+           "                    Without @SLOT, the slot of a disk is where its\n"
+           "                    block device is when the monitor starts.\n"
+           "       -smart:      check the SMART health of the disks every SECONDS\n"
+           "                    seconds (skipping disks in standby), and show\n"
+           "                    the fail color (default: 255 0 0) for failing disks.\n"
+           "       -zfs:        follow the zpool events, and show the fail color\n"
+           "                    (default: 255 0 0) while a vdev on a disk is not\n"
+           "                    online.\n"
+           "       -brightness: the brightness of the colors above (default: 255).\n"
+           "       -idle-backoff: while no disk is active, double the interval at\n"
+           "                    every tick up to SECONDS, and go back to the interval\n"
+           "                    at the first activity.\n"
+           "       -night:      use BRIGHTNESS between the given hours (local time,\n"
+           "                    e.g., 22:00-07:00), changing all disk LEDs at once.\n"
+           "       A failure (zpool over SMART) is shown over the offline color, which\n"
+           "       is shown over the online color.\n"
+        << std::endl;
+}
+
+void show_help_and_exit() {
+    show_help();
+    std::exit(-1);
+}
+
+static long parse_seconds_ms(int argc, char *argv[], int &i) {
+    if (i + 1 >= argc) {
+        std::cerr << "Err: " << argv[i] << " requires 1 parameter" << std::endl;
+        show_help_and_exit();
+    }
+
+    char *end;
+    double seconds = std::strtod(argv[++i], &end);
+    if (*end != '\0' || !(seconds > 0)) {
+        std::cerr << "Err: " << argv[i] << " is not a positive number." << std::endl;
+        show_help_and_exit();
+    }
+
+    return std::max(1L, std::lround(seconds * 1000));
+}
+
+static uint8_t parse_byte(const char *str) {
+    char *end;
+    errno = 0;
+    long value = std::strtol(str, &end, 10);
+
+    if (*str == '\0' || *end != '\0' || errno == ERANGE || value < 0 || value > 255) {
+        std::cerr << "Err: " << str << " is not in [0, 255]" << std::endl;
+        show_help_and_exit();
+    }
+
+    return value;
+}
+
+// HH:MM-HH:MM, as the minutes of the day
+static bool parse_night_hours(const std::string &str, int &start, int &end) {
+    int h1, m1, h2, m2, len = 0;
+    if (std::sscanf(str.c_str(), "%d:%d-%d:%d%n", &h1, &m1, &h2, &m2, &len) != 4 || len != (int)str.size())
+        return false;
+
+    if (h1 < 0 || h1 > 23 || h2 < 0 || h2 > 23 || m1 < 0 || m1 > 59 || m2 < 0 || m2 > 59)
+        return false;
+
+    start = h1 * 60 + m1;
+    end = h2 * 60 + m2;
+    return start != end;
+}
+
+static rgb_color_t parse_color(int argc, char *argv[], int &i) {
+    if (i + 3 >= argc) {
+        std::cerr << "Err: " << argv[i] << " requires 3 parameters" << std::endl;
+        show_help_and_exit();
+    }
+
+    rgb_color_t color;
+    color.r = parse_byte(argv[++i]);
+    color.g = parse_byte(argv[++i]);
+    color.b = parse_byte(argv[++i]);
+    return color;
+}
+
+// the keys used by ugreen-diskiomon, with the same defaults
+static void load_config(const char *path, long &interval_ms, monitor_options_t &options) {
+    led_config_t config;
+    if (!config.load(path)) {
+        std::perror(path);
+        std::exit(-1);
+    }
+
+    interval_ms = config.get_seconds_ms("LED_REFRESH_INTERVAL", interval_ms);
+    options.hotplug = true;
+    options.brightness = config.get_integer("BRIGHTNESS_DISK_LEDS", 0, 255, options.brightness);
+    options.online_color = config.get_color("COLOR_DISK_HEALTH", options.online_color);
+    options.offline_color = config.get_color("COLOR_DISK_UNAVAIL", options.offline_color);
+
+    options.smart_interval_ms = config.get_bool("CHECK_SMART", true) ?
+        config.get_seconds_ms("CHECK_SMART_INTERVAL", 360000) : 0;
+    options.smart_fail_color = config.get_color("COLOR_SMART_FAIL", options.smart_fail_color);
+
+    options.zfs = config.get_bool("CHECK_ZPOOL", false);
+    options.zfs_fail_color = config.get_color("COLOR_ZPOOL_FAIL", options.zfs_fail_color);
+
+    if (config.has("IDLE_MAX_INTERVAL"))
+        options.idle_max_interval_ms = config.get_seconds_ms("IDLE_MAX_INTERVAL", 0);
+
+    if (config.has("NIGHT_MODE_HOURS")) {
+        const auto hours = config.get("NIGHT_MODE_HOURS", "");
+        if (parse_night_hours(hours, options.night_start, options.night_end)) {
+            options.has_night_mode = true;
+            options.night_brightness = config.get_integer("BRIGHTNESS_NIGHT_MODE", 0, 255, 32);
+        } else {
+            std::cerr << "Err: NIGHT_MODE_HOURS=\"" << hours << "\" is invalid, the night mode is disabled" << std::endl;
+        }
+    }
+
+    options.has_mapping = true;
+    if (!parse_mapping_method(config.get("MAPPING_METHOD", "ata"), options.mapping)) {
+        std::cerr << "Err: unsupported mapping method " << config.get("MAPPING_METHOD", "") << std::endl;
+        std::exit(-1);
+    }
+
+    std::istringstream iss(config.get("DISK_SERIAL", ""));
+    options.serials.clear();
+    for (std::string serial; iss >> serial; )
+        options.serials.push_back(serial);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        show_help();
+        return 0;
+    }
+
+    long interval_ms = DEFAULT_INTERVAL_MS;
+    monitor_options_t options;
+    std::vector<disk_activity_t> disks;
+    bool print_mapping = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-config") {
+            if (++i >= argc) {
+                std::cerr << "Err: -config requires 1 parameter" << std::endl;
+                show_help_and_exit();
+            }
+
+            load_config(argv[i], interval_ms, options);
+        } else if (arg == "-mapping") {
+            if (++i >= argc || !parse_mapping_method(argv[i], options.mapping)) {
+                std::cerr << "Err: -mapping requires one of ata, hctl and serial" << std::endl;
+                show_help_and_exit();
+            }
+
+            options.has_mapping = true;
+        } else if (arg == "-serial") {
+            if (++i >= argc) {
+                std::cerr << "Err: -serial requires 1 parameter" << std::endl;
+                show_help_and_exit();
+            }
+
+            std::istringstream iss(argv[i]);
+            options.serials.clear();
+            for (std::string serial; iss >> serial; )
+                options.serials.push_back(serial);
+        } else if (arg == "-print-mapping") {
+            print_mapping = true;
+        } else if (arg == "-interval") {
+            interval_ms = parse_seconds_ms(argc, argv, i);
+        } else if (arg == "-smart") {
+            options.smart_interval_ms = parse_seconds_ms(argc, argv, i);
+        } else if (arg == "-smart-fail-color") {
+            options.smart_fail_color = parse_color(argc, argv, i);
+        } else if (arg == "-zfs") {
+            options.zfs = true;
+        } else if (arg == "-zfs-fail-color") {
+            options.zfs_fail_color = parse_color(argc, argv, i);
+        } else if (arg == "-hotplug") {
+            options.hotplug = true;
+        } else if (arg == "-online-color") {
+            options.online_color = parse_color(argc, argv, i);
+        } else if (arg == "-offline-color") {
+            options.offline_color = parse_color(argc, argv, i);
+        } else if (arg == "-brightness") {
+            if (++i >= argc) {
+                std::cerr << "Err: -brightness requires 1 parameter" << std::endl;
+                show_help_and_exit();
+            }
+
+            options.brightness = parse_byte(argv[i]);
+        } else if (arg == "-idle-backoff") {
+            options.idle_max_interval_ms = parse_seconds_ms(argc, argv, i);
+        } else if (arg == "-night") {
+            if (i + 2 >= argc || !parse_night_hours(argv[i + 1], options.night_start, options.night_end)) {
+                std::cerr << "Err: -night requires HH:MM-HH:MM and a brightness" << std::endl;
+                show_help_and_exit();
+            }
+
+            options.has_night_mode = true;
+            options.night_brightness = parse_byte(argv[i + 2]);
+            i += 2;
+        } else {
+            auto pos = arg.find(':');
+            auto slot_pos = arg.find('@', pos);
+            if (slot_pos == std::string::npos) slot_pos = arg.size();
+
+            if (pos == std::string::npos || pos == 0 || (pos + 1 == slot_pos && slot_pos + 1 >= arg.size())) {
+                std::cerr << "Err: unknown parameter " << arg << std::endl;
+                show_help_and_exit();
+            }
+
+            disk_activity_t disk;
+            disk.led_name = arg.substr(0, pos);
+            disk.dev_name = arg.substr(pos + 1, slot_pos - pos - 1);
+            if (slot_pos < arg.size()) disk.slot = arg.substr(slot_pos + 1);
+            disk.is_present = !disk.dev_name.empty();
+            disks.push_back(std::move(disk));
+        }
+    }
+
+    if (print_mapping && !options.has_mapping) {
+        std::cerr << "Err: -print-mapping requires -mapping" << std::endl;
+        show_help_and_exit();
+    }
+
+    if (disks.empty() && options.has_mapping) {
+        for (const auto &slot : resolve_disk_slots(options.mapping, options.serials)) {
+            if (print_mapping) {
+                std::cout << slot.led_name << " " << (slot.dev_name.empty() ? "-" : slot.dev_name)
+                    << " " << (slot.slot.empty() ? "-" : slot.slot) << std::endl;
+                continue;
+            }
+
+            // a slot without a disk is only followed if it is known where the disks go
+            if (slot.dev_name.empty() && slot.slot.empty()) continue;
+
+            disk_activity_t disk;
+            disk.led_name = slot.led_name;
+            disk.dev_name = slot.dev_name;
+            disk.slot = slot.slot;
+            disk.is_present = !slot.dev_name.empty();
+            disks.push_back(std::move(disk));
+        }
+
+        if (print_mapping) return 0;
+    }
+
+    if (disks.empty()) {
+        std::cerr << "Err: no disk to monitor" << std::endl;
+        show_help_and_exit();
+    }
+
+    struct sigaction sa { };
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    // the disks present are taken as healthy until an event tells otherwise
+    for (const auto &disk : disks) {
+        policy.set_brightness(disk.led_name, options.brightness);
+        if (disk.is_present)
+            policy.set(disk.led_name, led_priority_t::activity, options.online_color);
+    }
+
+    event_sources_t sources;
+    if (options.hotplug) {
+        // subscribe before looking at the devices, so that no change is missed
+        int uevent_fd = sources.uevent_fd = open_uevent_socket();
+        if (uevent_fd < 0) {
+            std::perror("uevent socket");
+            return -1;
+        }
+
+        // remember where the given devices are
+        for (auto &disk : disks) {
+            if (disk.slot.empty() && !disk.dev_name.empty())
+                disk.slot = resolve_device_path(disk.dev_name);
+        }
+
+        sync_disks(disks, options);
+    }
+
+    zfs_health_t zfs;
+    if (options.zfs) {
+        if (zfs.events.start() != 0) {
+            std::cerr << "Err: fail to run zpool events" << std::endl;
+            return -1;
+        }
+
+        // the events only tell the changes
+        for (const auto &state : zfs_event_stream_t::current_states())
+            update_vdev_state(zfs, state, disks, options);
+
+        sources.zfs = &zfs;
+    }
+
+    monitor_disk_activities(disks, interval_ms, sources, options);
+
+    for (auto &disk : disks) {
+        if (disk.stat_fd >= 0) close(disk.stat_fd);
+        if (disk.shot_fd >= 0) close(disk.shot_fd);
+    }
+
+    if (sources.uevent_fd >= 0) close(sources.uevent_fd);
+
+    return 0;
+}
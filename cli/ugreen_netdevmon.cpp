@@ -0,0 +1,788 @@
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "led_config.h"
+#include "led_output.h"
+#include "led_policy.h"
+
+#define SYSFS_NET_PATH              "/sys/class/net/"
+#define PROC_NET_DEV_PATH           "/proc/net/dev"
+#define PROC_NET_DEV_BUFFER_SIZE    65536
+#define DEFAULT_TRAFFIC_INTERVAL_MS 500
+#define NETLINK_BUFFER_SIZE         16384
+#define DEFAULT_PROBE_INTERVAL_MS   60000
+// the same as `ping -W 1`
+#define PROBE_TIMEOUT_MS            1000
+
+struct speed_color_t {
+    int speed;
+    rgb_color_t color;
+};
+
+// the LED blinks in this way if the utilization is at least the given percent
+struct traffic_band_t {
+    double percent;
+    uint16_t t_on, t_off;
+};
+
+struct netdev_options_t {
+    std::string led_name = "netdev";
+    std::vector<std::string> netdev_names;
+    rgb_color_t normal_color { 255, 255, 255 };
+    uint8_t brightness = 255;
+
+    // the link speed is checked if it is not empty
+    std::vector<speed_color_t> speed_colors;
+
+    bool check_gateway = false;
+    rgb_color_t unreachable_color { 255, 0, 0 };
+    long probe_interval_ms = DEFAULT_PROBE_INTERVAL_MS;
+
+    // Show the combined traffic of all interfaces by blinking the LED itself,
+    // instead of the netdev trigger that follows only one interface.
+    bool aggregate = false;
+    long traffic_interval_ms = DEFAULT_TRAFFIC_INTERVAL_MS;
+    // in the ascending order of percents, and the LED stays on without traffic
+    std::vector<traffic_band_t> bands = {
+        { 0, 500, 500 }, { 10, 200, 200 }, { 50, 100, 100 }
+    };
+};
+
+struct netdev_state_t {
+    // of each interface in Mb/s, or -1 if unknown (e.g., the link is down)
+    std::vector<int> speeds;
+    // the default gateway in network order, or 0 if there is none
+    in_addr_t gateway = 0;
+    bool is_gateway_reachable = true;
+};
+
+struct traffic_t {
+    int fd = -1;
+    // the total rx + tx bytes of the interfaces at the last sample
+    uint64_t bytes = 0;
+    bool has_sample = false;
+    timespec last_sample { 0, 0 };
+    timespec next_tick { 0, 0 };
+
+    // the index of the band shown, or -1 for no traffic
+    int band = -1;
+    // the blinking needs to be set again (e.g., the color has been set)
+    bool is_band_applied = false;
+};
+
+struct icmp_probe_t {
+    int fd = -1;
+    // raw sockets need root, datagram ones need net.ipv4.ping_group_range
+    bool is_raw = false;
+    uint16_t id = 0, seq = 0;
+
+    bool is_waiting = false;
+    // of the reply when waiting, or of the next probe otherwise
+    timespec deadline { 0, 0 };
+};
+
+// the LED is only written when the color shown changes
+static led_policy_t policy;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+static void timespec_add_ms(timespec &ts, long ms) {
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+}
+
+static timespec timespec_after_ms(long ms) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    timespec_add_ms(ts, ms);
+    return ts;
+}
+
+// the milliseconds left until the deadline (rounded up), or 0 if it is passed
+static int ms_until(const timespec &deadline) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long ns = (deadline.tv_sec - now.tv_sec) * 1000000000LL + (deadline.tv_nsec - now.tv_nsec);
+    if (ns <= 0) return 0;
+    return (int)std::min<long long>((ns + 999999) / 1000000, INT_MAX);
+}
+
+static std::string format_address(in_addr_t addr) {
+    char buf[INET_ADDRSTRLEN];
+    in_addr in { addr };
+    return inet_ntop(AF_INET, &in, buf, sizeof(buf)) ? buf : "?";
+}
+
+// the speed in /sys/class/net/NETDEV/speed, which is readable only if the link is up
+static int read_link_speed(const std::string &netdev_name) {
+    const auto path = SYSFS_NET_PATH + netdev_name + "/speed";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    char buf[32];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return -1;
+
+    buf[len] = '\0';
+    return std::atoi(buf);
+}
+
+static int open_rtnetlink(uint32_t groups, int flags) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | flags, NETLINK_ROUTE);
+    if (fd < 0) return -1;
+
+    sockaddr_nl addr { };
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// the IPv4 default route with the lowest metric, as in the main routing table
+static in_addr_t query_default_gateway() {
+    int fd = open_rtnetlink(0, 0);
+    if (fd < 0) return 0;
+
+    struct {
+        nlmsghdr header;
+        rtmsg route;
+    } request { };
+
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETROUTE;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = 1;
+    request.route.rtm_family = AF_INET;
+
+    if (send(fd, &request, sizeof(request), 0) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    in_addr_t gateway = 0;
+    uint32_t best_metric = UINT32_MAX;
+    char buf[NETLINK_BUFFER_SIZE];
+
+    for (bool is_done = false; !is_done; ) {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+
+        for (auto *msg = (nlmsghdr *)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+            if (msg->nlmsg_type == NLMSG_DONE || msg->nlmsg_type == NLMSG_ERROR) {
+                is_done = true;
+                break;
+            }
+            if (msg->nlmsg_type != RTM_NEWROUTE) continue;
+
+            auto *route = (rtmsg *)NLMSG_DATA(msg);
+            if (route->rtm_dst_len != 0 || route->rtm_type != RTN_UNICAST)
+                continue;
+
+            uint32_t table = route->rtm_table, metric = 0;
+            in_addr_t route_gateway = 0;
+
+            int attr_len = RTM_PAYLOAD(msg);
+            for (auto *attr = RTM_RTA(route); RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+                if (attr->rta_type == RTA_TABLE)
+                    table = *(uint32_t *)RTA_DATA(attr);
+                else if (attr->rta_type == RTA_PRIORITY)
+                    metric = *(uint32_t *)RTA_DATA(attr);
+                else if (attr->rta_type == RTA_GATEWAY)
+                    std::memcpy(&route_gateway, RTA_DATA(attr), sizeof(route_gateway));
+            }
+
+            if (table == RT_TABLE_MAIN && route_gateway != 0 && metric < best_metric) {
+                gateway = route_gateway;
+                best_metric = metric;
+            }
+        }
+    }
+
+    close(fd);
+    return gateway;
+}
+
+static int open_icmp_socket(icmp_probe_t &probe) {
+    probe.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    probe.is_raw = false;
+
+    if (probe.fd < 0) {
+        probe.fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+        probe.is_raw = true;
+    }
+
+    // the identifier of datagram sockets is replaced by the kernel
+    probe.id = getpid() & 0xffff;
+    return probe.fd;
+}
+
+static uint16_t icmp_checksum(const void *data, std::size_t len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t sum = 0;
+
+    for (std::size_t i = 0; i + 1 < len; i += 2)
+        sum += (bytes[i] << 8) | bytes[i + 1];
+    if (len & 1)
+        sum += bytes[len - 1] << 8;
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons(~sum & 0xffff);
+}
+
+static void send_probe(icmp_probe_t &probe, in_addr_t gateway) {
+    icmphdr request { };
+    request.type = ICMP_ECHO;
+    request.un.echo.id = htons(probe.id);
+    request.un.echo.sequence = htons(++probe.seq);
+    request.checksum = icmp_checksum(&request, sizeof(request));
+
+    sockaddr_in addr { };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = gateway;
+
+    // a failed send is taken as a lost reply
+    sendto(probe.fd, &request, sizeof(request), 0, (sockaddr *)&addr, sizeof(addr));
+
+    probe.is_waiting = true;
+    probe.deadline = timespec_after_ms(PROBE_TIMEOUT_MS);
+}
+
+// returns true if the reply of the probe being waited for has arrived
+static bool receive_replies(icmp_probe_t &probe, in_addr_t gateway) {
+    bool is_replied = false;
+    uint8_t buf[1024];
+
+    for (;;) {
+        sockaddr_in addr { };
+        socklen_t addr_len = sizeof(addr);
+        ssize_t len = recvfrom(probe.fd, buf, sizeof(buf), 0, (sockaddr *)&addr, &addr_len);
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0) break;
+
+        const uint8_t *payload = buf;
+        if (probe.is_raw) {
+            // raw sockets receive the IP header, and the replies of other processes
+            std::size_t header_len = (buf[0] & 0x0f) * 4;
+            if ((std::size_t)len < header_len + sizeof(icmphdr)) continue;
+            payload += header_len;
+            len -= header_len;
+        }
+        if ((std::size_t)len < sizeof(icmphdr)) continue;
+
+        icmphdr reply;
+        std::memcpy(&reply, payload, sizeof(reply));
+
+        if (reply.type != ICMP_ECHOREPLY || addr.sin_addr.s_addr != gateway)
+            continue;
+        if (probe.is_raw && ntohs(reply.un.echo.id) != probe.id)
+            continue;
+
+        if (probe.is_waiting && ntohs(reply.un.echo.sequence) == probe.seq)
+            is_replied = true;
+    }
+
+    return is_replied;
+}
+
+// The conditions of the LED, of which the highest is shown (see led_policy.h).
+// Setting the color turns the LED on without the kernel module, which stops
+// the blinking of the traffic.
+static void update_led(const netdev_state_t &state, traffic_t &traffic, const netdev_options_t &options) {
+    policy.set(options.led_name, led_priority_t::activity, options.normal_color);
+
+    // the fastest link, e.g., 10000 for a bond of two 10GbE interfaces
+    int speed = *std::max_element(state.speeds.begin(), state.speeds.end());
+    auto speed_color = std::find_if(options.speed_colors.begin(), options.speed_colors.end(),
+            [=](const speed_color_t &v) { return v.speed == speed; });
+    if (speed_color != options.speed_colors.end())
+        policy.set(options.led_name, led_priority_t::link_speed, speed_color->color);
+    else
+        policy.clear(options.led_name, led_priority_t::link_speed);
+
+    if (options.check_gateway && !state.is_gateway_reachable)
+        policy.set(options.led_name, led_priority_t::unavailable, options.unreachable_color);
+    else
+        policy.clear(options.led_name, led_priority_t::unavailable);
+
+    if (policy.flush() > 0)
+        traffic.is_band_applied = false;
+}
+
+static void update_speeds(netdev_state_t &state, const netdev_options_t &options) {
+    for (std::size_t i = 0; i < options.netdev_names.size(); ++i) {
+        const auto &name = options.netdev_names[i];
+        int speed = read_link_speed(name);
+        if (speed == state.speeds[i]) continue;
+
+        state.speeds[i] = speed;
+        if (speed > 0)
+            std::cout << "Link speed of " << name << ": " << speed << " Mb/s" << std::endl;
+        else
+            std::cout << "Link of " << name << " is down" << std::endl;
+    }
+}
+
+// the sum of rx and tx bytes of the interfaces, by one read of /proc/net/dev
+static bool read_traffic_bytes(traffic_t &traffic, const netdev_options_t &options, uint64_t &bytes) {
+    static char buf[PROC_NET_DEV_BUFFER_SIZE];
+
+    ssize_t len = pread(traffic.fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) return false;
+    buf[len] = '\0';
+
+    bytes = 0;
+    // lines are "NAME: RX_BYTES RX_PACKETS ... (8 rx fields) TX_BYTES ...", after 2 header lines
+    for (char *line = buf, *next; line && *line; line = next) {
+        next = std::strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        char *colon = std::strchr(line, ':');
+        if (!colon) continue;
+        *colon = '\0';
+
+        char *name = line + std::strspn(line, " ");
+        if (std::find(options.netdev_names.begin(), options.netdev_names.end(), name) == options.netdev_names.end())
+            continue;
+
+        unsigned long long fields[9];
+        if (std::sscanf(colon + 1, "%llu %llu %llu %llu %llu %llu %llu %llu %llu",
+                    &fields[0], &fields[1], &fields[2], &fields[3], &fields[4],
+                    &fields[5], &fields[6], &fields[7], &fields[8]) == 9)
+            bytes += fields[0] + fields[8];
+    }
+
+    return true;
+}
+
+// Sample the traffic, and blink faster for a higher utilization of the
+// links. The LED is only changed when the band of the utilization changes.
+static void sample_traffic(traffic_t &traffic, const netdev_state_t &state,
+        const netdev_options_t &options) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    traffic.next_tick = now;
+    timespec_add_ms(traffic.next_tick, options.traffic_interval_ms);
+
+    uint64_t bytes;
+    if (!read_traffic_bytes(traffic, options, bytes)) return;
+
+    double seconds = (now.tv_sec - traffic.last_sample.tv_sec) + (now.tv_nsec - traffic.last_sample.tv_nsec) * 1e-9;
+    bool has_sample = traffic.has_sample;
+    uint64_t delta = bytes >= traffic.bytes ? bytes - traffic.bytes : 0;
+
+    traffic.bytes = bytes;
+    traffic.last_sample = now;
+    traffic.has_sample = true;
+    if (!has_sample || seconds <= 0) return;
+
+    // links that are down do not count, and the utilization is 0 if no speed is known
+    double capacity_mbps = 0;
+    for (int speed : state.speeds) {
+        if (speed > 0) capacity_mbps += speed;
+    }
+
+    double throughput_mbps = delta * 8 / seconds / 1e6;
+    double percent = capacity_mbps > 0 ? throughput_mbps / capacity_mbps * 100 : 0;
+
+    int band = -1;
+    if (delta > 0) {
+        for (std::size_t i = 0; i < options.bands.size(); ++i) {
+            if (percent >= options.bands[i].percent) band = i;
+        }
+    }
+
+    if (band == traffic.band && traffic.is_band_applied) return;
+    traffic.band = band;
+    traffic.is_band_applied = true;
+
+    if (band < 0)
+        set_led_blink(options.led_name, 0, 0);
+    else
+        set_led_blink(options.led_name, options.bands[band].t_on, options.bands[band].t_off);
+}
+
+// a new gateway is probed at once
+static void update_gateway(netdev_state_t &state, icmp_probe_t &probe) {
+    in_addr_t gateway = query_default_gateway();
+    if (gateway == state.gateway) return;
+
+    state.gateway = gateway;
+    std::cout << "Default gateway: " << (gateway ? format_address(gateway) : "none") << std::endl;
+
+    probe.is_waiting = false;
+    clock_gettime(CLOCK_MONOTONIC, &probe.deadline);
+}
+
+static void receive_rtnetlink(int fd, netdev_state_t &state, icmp_probe_t &probe,
+        const netdev_options_t &options) {
+    char buf[NETLINK_BUFFER_SIZE];
+    bool is_link_changed = false, is_route_changed = false;
+
+    for (;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            // some events are lost, so look at everything again
+            if (errno == ENOBUFS) {
+                is_link_changed = is_route_changed = true;
+                continue;
+            }
+            break;
+        }
+
+        for (auto *msg = (nlmsghdr *)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+            if (msg->nlmsg_type == RTM_NEWLINK || msg->nlmsg_type == RTM_DELLINK) {
+                auto *link = (ifinfomsg *)NLMSG_DATA(msg);
+                int attr_len = IFLA_PAYLOAD(msg);
+
+                for (auto *attr = IFLA_RTA(link); RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+                    if (attr->rta_type == IFLA_IFNAME && std::find(options.netdev_names.begin(), 
+                                options.netdev_names.end(), (const char *)RTA_DATA(attr)) != options.netdev_names.end())
+                        is_link_changed = true;
+                }
+            } else if (msg->nlmsg_type == RTM_NEWROUTE || msg->nlmsg_type == RTM_DELROUTE) {
+                auto *route = (rtmsg *)NLMSG_DATA(msg);
+                if (route->rtm_family == AF_INET && route->rtm_dst_len == 0)
+                    is_route_changed = true;
+            }
+        }
+    }
+
+    if (is_link_changed)
+        update_speeds(state, options);
+    if (is_route_changed && options.check_gateway)
+        update_gateway(state, probe);
+}
+
+// send the next probe, or take the gateway as unreachable if the probe timed out
+static void handle_probe_deadline(icmp_probe_t &probe, netdev_state_t &state,
+        const netdev_options_t &options) {
+    if (!probe.is_waiting && state.gateway != 0) {
+        send_probe(probe, state.gateway);
+        return;
+    }
+
+    // the probe timed out, or there is no gateway at all
+    if (state.is_gateway_reachable)
+        std::cout << "Gateway " << (state.gateway ? format_address(state.gateway) : "(none)")
+            << " is unreachable" << std::endl;
+
+    state.is_gateway_reachable = false;
+    probe.is_waiting = false;
+    probe.deadline = timespec_after_ms(options.probe_interval_ms);
+}
+
+// Wait for link / route events, the replies of the gateway, which is probed
+// every probe interval (at most one probe is in flight), and the ticks of
+// sampling the traffic when aggregating.
+static void monitor_netdev(int rtnl_fd, icmp_probe_t &probe, traffic_t &traffic,
+        netdev_state_t &state, const netdev_options_t &options) {
+    while (!stop_requested) {
+        update_led(state, traffic, options);
+
+        int timeout = -1;
+        if (options.check_gateway)
+            timeout = ms_until(probe.deadline);
+        if (options.aggregate) {
+            int tick_timeout = ms_until(traffic.next_tick);
+            timeout = timeout < 0 ? tick_timeout : std::min(timeout, tick_timeout);
+        }
+
+        pollfd fds[] = {
+            { rtnl_fd, POLLIN, 0 },
+            { probe.fd, POLLIN, 0 },
+        };
+
+        int rc = timeout == 0 ? 0 : poll(fds, 2, timeout);
+        if (rc < 0 && errno != EINTR) {
+            std::perror("poll");
+            return;
+        }
+
+        if (rc > 0 && fds[0].revents)
+            receive_rtnetlink(rtnl_fd, state, probe, options);
+
+        if (rc > 0 && fds[1].revents && receive_replies(probe, state.gateway)) {
+            probe.is_waiting = false;
+            probe.deadline = timespec_after_ms(options.probe_interval_ms);
+
+            if (!state.is_gateway_reachable)
+                std::cout << "Gateway " << format_address(state.gateway) << " is reachable" << std::endl;
+            state.is_gateway_reachable = true;
+        }
+
+        if (options.aggregate && ms_until(traffic.next_tick) == 0)
+            sample_traffic(traffic, state, options);
+
+        if (options.check_gateway && ms_until(probe.deadline) == 0)
+            handle_probe_deadline(probe, state, options);
+    }
+}
+
+void show_help() {
+    std::cerr
+        << "Usage: ugreen_netdevmon [-config FILE] [-led LED] [-color R G B] [-brightness BRIGHTNESS]\n"
+           "                        [-link-speed SPEED R G B]... [-gateway [-probe-interval SECONDS]\n"
+           "                        [-unreachable-color R G B]] [-aggregate [-interval SECONDS]\n"
+           "                        [-band PERCENT T_ON T_OFF]...] NETDEV...\n\n"
+           "       NETDEV:      the network interfaces that the LED shows.\n"
+           "       -config:     take the options from ugreen-leds.conf (e.g.,\n"
+           "                    " UGREEN_LEDS_CONF_PATH "), as ugreen-netdevmon\n"
+           "                    does. The options after it override it.\n"
+           "       -led:        the LED (default: netdev).\n"
+           "       -color:      the color of the LED (default: 255 255 255).\n"
+           "       -link-speed: the color when the link speed is SPEED Mb/s,\n"
+           "                    updated upon the link events of rtnetlink (the\n"
+           "                    fastest one for multiple interfaces).\n"
+           "       -gateway:    ping the default gateway every probe interval\n"
+           "                    (default: 60 seconds), and whenever it changes,\n"
+           "                    and show the unreachable color (default: 255 0 0)\n"
+           "                    if it does not reply within 1 second.\n"
+           "       -aggregate:  show the combined traffic of the interfaces (the\n"
+           "                    default for multiple ones) from /proc/net/dev,\n"
+           "                    sampled every interval (default: 0.5 seconds).\n"
+           "                    The LED blinks T_ON / T_OFF milliseconds if the\n"
+           "                    utilization of the links is at least PERCENT\n"
+           "                    (default: -band 0 500 500 -band 10 200 200\n"
+           "                    -band 50 100 100), and stays on without traffic.\n"
+           "                    The trigger of the LED must be none.\n"
+           "       The unreachable color is shown over the link speed colors. The LED\n"
+           "       is only changed if its color changes, and otherwise the\n"
+           "       trigger (set up by ugreen-netdevmon) is kept.\n"
+        << std::endl;
+}
+
+void show_help_and_exit() {
+    show_help();
+    std::exit(-1);
+}
+
+static int parse_integer(const char *str, int low, int high) {
+    char *end;
+    errno = 0;
+    long value = std::strtol(str, &end, 10);
+
+    if (*str == '\0' || *end != '\0' || errno == ERANGE || value < low || value > high) {
+        std::cerr << "Err: " << str << " is not in [" << low << ", " << high << "]" << std::endl;
+        show_help_and_exit();
+    }
+
+    return value;
+}
+
+static void expect_parameters(int argc, char *argv[], int i, int count) {
+    if (i + count >= argc) {
+        std::cerr << "Err: " << argv[i] << " requires " << count << " parameter(s)" << std::endl;
+        show_help_and_exit();
+    }
+}
+
+static long parse_seconds_ms(const char *str) {
+    char *end;
+    double seconds = std::strtod(str, &end);
+    if (*end != '\0' || !(seconds > 0)) {
+        std::cerr << "Err: " << str << " is not a positive number." << std::endl;
+        show_help_and_exit();
+    }
+
+    return std::max(1L, std::lround(seconds * 1000));
+}
+
+static rgb_color_t parse_color(char *argv[], int &i) {
+    rgb_color_t color;
+    color.r = parse_integer(argv[++i], 0, 255);
+    color.g = parse_integer(argv[++i], 0, 255);
+    color.b = parse_integer(argv[++i], 0, 255);
+    return color;
+}
+
+// the keys used by ugreen-netdevmon, with the same defaults
+static void load_config(const char *path, netdev_options_t &options) {
+    led_config_t config;
+    if (!config.load(path)) {
+        std::perror(path);
+        std::exit(-1);
+    }
+
+    options.normal_color = config.get_color("COLOR_NETDEV_NORMAL", options.normal_color);
+    options.brightness = config.get_integer("BRIGHTNESS_NETDEV_LED", 0, 255, options.brightness);
+
+    if (config.get_bool("CHECK_LINK_SPEED", false)) {
+        options.speed_colors.clear();
+        for (int speed : { 100, 1000, 2500, 10000 }) {
+            const auto key = "COLOR_NETDEV_LINK_" + std::to_string(speed);
+            options.speed_colors.push_back({ speed, config.get_color(key, options.normal_color) });
+        }
+    }
+
+    options.check_gateway = config.get_bool("CHECK_GATEWAY_CONNECTIVITY", false);
+    options.probe_interval_ms = config.get_seconds_ms("CHECK_NETDEV_INTERVAL", options.probe_interval_ms);
+    options.unreachable_color = config.get_color("COLOR_NETDEV_GATEWAY_UNREACHABLE", options.unreachable_color);
+
+    std::istringstream iss(config.get("NETDEV_AGGREGATE_INTERFACES", ""));
+    for (std::string name; iss >> name; )
+        options.netdev_names.push_back(name);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        show_help();
+        return 0;
+    }
+
+    netdev_options_t options;
+    bool has_bands = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-config") {
+            expect_parameters(argc, argv, i, 1);
+            load_config(argv[++i], options);
+        } else if (arg == "-led") {
+            expect_parameters(argc, argv, i, 1);
+            options.led_name = argv[++i];
+        } else if (arg == "-color") {
+            expect_parameters(argc, argv, i, 3);
+            options.normal_color = parse_color(argv, i);
+        } else if (arg == "-brightness") {
+            expect_parameters(argc, argv, i, 1);
+            options.brightness = parse_integer(argv[++i], 0, 255);
+        } else if (arg == "-link-speed") {
+            expect_parameters(argc, argv, i, 4);
+            speed_color_t speed_color;
+            speed_color.speed = parse_integer(argv[++i], 1, INT_MAX);
+            speed_color.color = parse_color(argv, i);
+            options.speed_colors.push_back(speed_color);
+        } else if (arg == "-gateway") {
+            options.check_gateway = true;
+        } else if (arg == "-probe-interval") {
+            expect_parameters(argc, argv, i, 1);
+            options.probe_interval_ms = parse_seconds_ms(argv[++i]);
+        } else if (arg == "-unreachable-color") {
+            expect_parameters(argc, argv, i, 3);
+            options.unreachable_color = parse_color(argv, i);
+        } else if (arg == "-aggregate") {
+            options.aggregate = true;
+        } else if (arg == "-interval") {
+            expect_parameters(argc, argv, i, 1);
+            options.traffic_interval_ms = parse_seconds_ms(argv[++i]);
+        } else if (arg == "-band") {
+            expect_parameters(argc, argv, i, 3);
+            // the bands given replace the default ones
+            if (!has_bands) options.bands.clear();
+            has_bands = true;
+
+            traffic_band_t band;
+            band.percent = parse_integer(argv[++i], 0, 100);
+            band.t_on = parse_integer(argv[++i], 1, 0xffff);
+            band.t_off = parse_integer(argv[++i], 0, 0xffff);
+            options.bands.push_back(band);
+        } else if (arg[0] != '-') {
+            options.netdev_names.push_back(arg);
+        } else {
+            std::cerr << "Err: unknown parameter " << arg << std::endl;
+            show_help_and_exit();
+        }
+    }
+
+    if (options.netdev_names.empty()) {
+        std::cerr << "Err: no network interface to monitor" << std::endl;
+        show_help_and_exit();
+    }
+
+    // a single trigger cannot follow multiple interfaces
+    if (options.netdev_names.size() > 1)
+        options.aggregate = true;
+
+    std::sort(options.bands.begin(), options.bands.end(), [](const traffic_band_t &a, const traffic_band_t &b) {
+        return a.percent < b.percent;
+    });
+
+    struct sigaction sa { };
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    // subscribe before reading the states, so that no change is missed
+    int rtnl_fd = open_rtnetlink(RTMGRP_LINK | RTMGRP_IPV4_ROUTE, SOCK_NONBLOCK);
+    if (rtnl_fd < 0) {
+        std::perror("rtnetlink socket");
+        return -1;
+    }
+
+    icmp_probe_t probe;
+    if (options.check_gateway && open_icmp_socket(probe) < 0) {
+        std::perror("icmp socket");
+        close(rtnl_fd);
+        return -1;
+    }
+
+    traffic_t traffic;
+    if (options.aggregate) {
+        traffic.fd = open(PROC_NET_DEV_PATH, O_RDONLY | O_CLOEXEC);
+        if (traffic.fd < 0) {
+            std::perror(PROC_NET_DEV_PATH);
+            close(rtnl_fd);
+            return -1;
+        }
+    }
+
+    policy.set_brightness(options.led_name, options.brightness);
+
+    netdev_state_t state;
+    state.speeds.assign(options.netdev_names.size(), -1);
+    update_speeds(state, options);
+    if (options.check_gateway)
+        update_gateway(state, probe);
+
+    monitor_netdev(rtnl_fd, probe, traffic, state, options);
+
+    close(rtnl_fd);
+    if (probe.fd >= 0) close(probe.fd);
+    if (traffic.fd >= 0) close(traffic.fd);
+
+    return 0;
+}
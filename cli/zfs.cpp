@@ -0,0 +1,171 @@
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "zfs.h"
+
+extern char **environ;
+
+zfs_event_stream_t::~zfs_event_stream_t() {
+    stop();
+}
+
+int zfs_event_stream_t::start() {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0)
+        return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+
+    // -H: no header, -v: the payloads, -f: follow the new events
+    char *const argv[] = {
+        (char *)"zpool", (char *)"events", (char *)"-H", (char *)"-v", (char *)"-f", nullptr
+    };
+
+    int rc = posix_spawnp(&_pid, "zpool", &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fds[1]);
+
+    if (rc != 0) {
+        _pid = -1;
+        close(pipe_fds[0]);
+        return -1;
+    }
+
+    _fd = pipe_fds[0];
+    fcntl(_fd, F_SETFL, O_NONBLOCK);
+
+    return 0;
+}
+
+void zfs_event_stream_t::stop() {
+    if (_fd >= 0) close(_fd);
+    _fd = -1;
+
+    if (_pid > 0) {
+        kill(_pid, SIGTERM);
+        while (waitpid(_pid, nullptr, 0) < 0 && errno == EINTR) { }
+    }
+    _pid = -1;
+}
+
+static zfs_vdev_state_t parse_state_name(const std::string &name) {
+    if (name == "ONLINE") return zfs_vdev_state_t::healthy;
+    if (name == "DEGRADED") return zfs_vdev_state_t::degraded;
+    if (name == "FAULTED") return zfs_vdev_state_t::faulted;
+    if (name == "UNAVAIL") return zfs_vdev_state_t::cant_open;
+    if (name == "REMOVED") return zfs_vdev_state_t::removed;
+    if (name == "OFFLINE") return zfs_vdev_state_t::offline;
+    return zfs_vdev_state_t::unknown;
+}
+
+void zfs_event_stream_t::_finish_event(std::vector<zfs_vdev_event_t> &events) {
+    if (!_vdev_path.empty()) {
+        if (_class == "resource.fs.zfs.statechange")
+            events.push_back({ _vdev_path, _vdev_state });
+        else if (_class == "resource.fs.zfs.removed")
+            events.push_back({ _vdev_path, zfs_vdev_state_t::removed });
+    }
+
+    _class.clear();
+    _vdev_path.clear();
+    _vdev_state = zfs_vdev_state_t::unknown;
+}
+
+// An event is a line "TIME CLASS", followed by indented lines "NAME = VALUE",
+// where the strings are quoted, and the states are "0x5" or "\"FAULTED\" (0x5)".
+// It ends with an empty line, so that it is handled without waiting for the next.
+void zfs_event_stream_t::_parse_line(const std::string &line, std::vector<zfs_vdev_event_t> &events) {
+    if (line.empty()) {
+        _finish_event(events);
+        return;
+    }
+
+    if (line[0] != ' ' && line[0] != '\t') {
+        _finish_event(events);
+        auto pos = line.find_last_of(" \t");
+        _class = pos == std::string::npos ? line : line.substr(pos + 1);
+        return;
+    }
+
+    auto eq = line.find(" = ");
+    if (eq == std::string::npos) return;
+
+    auto begin = line.find_first_not_of(" \t");
+    const auto name = line.substr(begin, eq - begin);
+    const auto value = line.substr(eq + 3);
+
+    if (name == "vdev_path") {
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+            _vdev_path = value.substr(1, value.size() - 2);
+    } else if (name == "vdev_state") {
+        auto pos = value.rfind("0x");
+        if (pos != std::string::npos) {
+            unsigned long state = std::strtoul(value.c_str() + pos, nullptr, 16);
+            if (state <= (unsigned long)zfs_vdev_state_t::healthy)
+                _vdev_state = (zfs_vdev_state_t)state;
+        }
+    }
+}
+
+bool zfs_event_stream_t::read_events(std::vector<zfs_vdev_event_t> &events) {
+    if (_fd < 0) return false;
+
+    char buf[4096];
+    bool has_ended = false;
+    for (;;) {
+        ssize_t len = read(_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        if (len <= 0) {
+            has_ended = true;
+            break;
+        }
+
+        _buffer.append(buf, len);
+    }
+
+    std::size_t begin = 0;
+    for (auto end = _buffer.find('\n'); end != std::string::npos; end = _buffer.find('\n', begin)) {
+        _parse_line(_buffer.substr(begin, end - begin), events);
+        begin = end + 1;
+    }
+    _buffer.erase(0, begin);
+
+    if (has_ended) {
+        _finish_event(events);
+        stop();
+    }
+
+    return !has_ended;
+}
+
+std::vector<zfs_vdev_event_t> zfs_event_stream_t::current_states() {
+    std::vector<zfs_vdev_event_t> states;
+
+    // -P: the full paths of the vdevs, the same as those in the events
+    FILE *fp = popen("zpool status -P 2>/dev/null", "r");
+    if (!fp) return states;
+
+    char line[1024];
+    while (std::fgets(line, sizeof(line), fp)) {
+        std::istringstream iss(line);
+        std::string path, state;
+        if (iss >> path >> state && path.compare(0, 5, "/dev/") == 0)
+            states.push_back({ path, parse_state_name(state) });
+    }
+
+    pclose(fp);
+    return states;
+}
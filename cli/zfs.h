@@ -0,0 +1,55 @@
+#ifndef __UGREEN_ZFS_H__
+#define __UGREEN_ZFS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// vdev_state_t of OpenZFS
+enum class zfs_vdev_state_t : uint8_t {
+    unknown = 0, closed, offline, removed, cant_open, faulted, degraded, healthy
+};
+
+struct zfs_vdev_event_t {
+    // as in the pool configuration, e.g., /dev/disk/by-id/ata-XXX-part1
+    std::string path;
+    zfs_vdev_state_t state;
+};
+
+// The state changes of vdevs, read from a single long-running
+// `zpool events -f`, instead of running `zpool status` periodically.
+// The events already in the kernel buffer are replayed first.
+class zfs_event_stream_t {
+
+private:
+    pid_t _pid = -1;
+    int _fd = -1;
+    std::string _buffer;
+
+    // the event being parsed
+    std::string _class, _vdev_path;
+    zfs_vdev_state_t _vdev_state = zfs_vdev_state_t::unknown;
+
+    void _parse_line(const std::string &line, std::vector<zfs_vdev_event_t> &events);
+    void _finish_event(std::vector<zfs_vdev_event_t> &events);
+
+public:
+    ~zfs_event_stream_t();
+
+    // returns negative if `zpool` cannot be run
+    int start();
+    void stop();
+
+    // non-blocking, to be polled for input
+    int fd() const { return _fd; }
+
+    // Read the available output, and append the vdev state changes in it.
+    // Returns false once the stream has ended (e.g., ZFS is not loaded).
+    bool read_events(std::vector<zfs_vdev_event_t> &events);
+
+    // the states of all vdevs in `zpool status -P`, taken once at start
+    static std::vector<zfs_vdev_event_t> current_states();
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __UGREEN_LED_IOCTL_H
+#define __UGREEN_LED_IOCTL_H
+
+// The character device of the kernel module, shared by the kernel module (C)
+// and the command-line tools (C++). It changes several LEDs in one call,
+// instead of a write per sysfs attribute per LED, each parsed by sscanf.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+#endif
+
+#define UGREEN_LED_DEVICE_PATH      "/dev/led-ugreen"
+
+// the most states in a batch, i.e., one per LED
+#define UGREEN_LED_IOCTL_MAX_STATES ( 10 )
+
+// the fields of a state that are applied, with the semantics of the
+// corresponding sysfs attributes (color, brightness and blink_type)
+#define UGREEN_LED_IOCTL_COLOR      ( 1 << 0 )
+#define UGREEN_LED_IOCTL_BRIGHTNESS ( 1 << 1 )
+#define UGREEN_LED_IOCTL_MODE       ( 1 << 2 )
+#define UGREEN_LED_IOCTL_ALL_FIELDS ( UGREEN_LED_IOCTL_COLOR | UGREEN_LED_IOCTL_BRIGHTNESS | UGREEN_LED_IOCTL_MODE )
+
+struct ugreen_led_ioctl_state {
+    uint8_t led_id;             // 0 - power, 1 - netdev, 2 - disk1, ...
+    uint8_t fields;             // UGREEN_LED_IOCTL_*
+    uint8_t status;             // 0 - off, 1 - on, 2 - blink, 3 - breath
+    uint8_t brightness;
+    uint8_t r, g, b;
+    uint8_t reserved;           // must be 0
+    uint16_t delay_on, delay_off; // in milliseconds, for blink and breath
+    // written back: 0 if the MCU has acknowledged the state, -ENODEV if
+    // the LED does not exist, -EINVAL if the state is invalid, or -EIO
+    int32_t result;
+};
+
+struct ugreen_led_ioctl_batch {
+    uint32_t count;
+    uint32_t reserved;          // must be 0
+    uint64_t states;            // a pointer to count struct ugreen_led_ioctl_state
+};
+
+// Apply the states in order, as one pass of the hardware writer, and wait
+// until they are written to the MCU. Fails only if the batch itself is
+// invalid; the result of each LED is in its state.
+#define UGREEN_LED_IOC_SET_STATES   _IOWR('U', 0x01, struct ugreen_led_ioctl_batch)
+
+#endif // __UGREEN_LED_IOCTL_H
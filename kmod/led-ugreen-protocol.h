@@ -0,0 +1,186 @@
+#ifndef __UGREEN_LED_PROTOCOL_H
+#define __UGREEN_LED_PROTOCOL_H
+
+// The protocol of the LED controller (address 0x3a on the SMBus I801 adapter),
+// shared by the kernel module (C) and the command-line tool (C++). In C++,
+// the encoders and decoders are constexpr and checked by the static_asserts
+// at the end of this file.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#ifdef __cplusplus
+#define UGREEN_LED_PROTOCOL_FN      constexpr inline
+#else
+#define UGREEN_LED_PROTOCOL_FN      static inline
+#endif
+
+// commands at the byte 0x05 of a command frame
+#define UGREEN_LED_CMD_BRIGHTNESS   ( 0x01 )
+#define UGREEN_LED_CMD_COLOR        ( 0x02 )
+#define UGREEN_LED_CMD_ON_OFF       ( 0x03 )
+#define UGREEN_LED_CMD_BLINK        ( 0x04 )
+#define UGREEN_LED_CMD_BREATH       ( 0x05 )
+
+// command frames are written to the register LED_ID
+#define UGREEN_LED_REG_COMMAND(id)          ( (id) )
+// the byte register telling whether the last command succeeded
+#define UGREEN_LED_REG_LAST_COMMAND_STATUS  ( 0x80 )
+// the register of the status frame of a LED
+#define UGREEN_LED_REG_STATUS(id)           ( 0x81 + (id) )
+
+#define UGREEN_LED_COMMAND_FRAME_SIZE   ( 12 )
+#define UGREEN_LED_STATUS_FRAME_SIZE    ( 11 )
+
+struct ugreen_led_command_frame {
+    uint8_t bytes[UGREEN_LED_COMMAND_FRAME_SIZE];
+};
+
+struct ugreen_led_status_frame {
+    uint8_t bytes[UGREEN_LED_STATUS_FRAME_SIZE];
+};
+
+// the decoded status frame of a LED
+struct ugreen_led_status {
+    uint8_t valid;          // whether the checksum matches
+    uint8_t status;         // 0 - off, 1 - on, 2 - blink, 3 - breath
+    uint8_t brightness;
+    uint8_t r, g, b;
+    uint16_t t_on, t_cycle; // in milliseconds
+};
+
+// the 16-bit sum of the bytes as unsigned integers
+UGREEN_LED_PROTOCOL_FN uint16_t ugreen_led_checksum(const uint8_t *bytes, int size) {
+    uint16_t sum = 0;
+    for (int i = 0; i < size; ++i)
+        sum += bytes[i];
+    return sum;
+}
+
+// LED_ID, a0 01 00 00, the command, 4 parameters, and the checksum of bytes 0x01 - 0x09
+UGREEN_LED_PROTOCOL_FN struct ugreen_led_command_frame ugreen_led_encode_command(
+        uint8_t led_id, uint8_t command,
+        uint8_t param1, uint8_t param2, uint8_t param3, uint8_t param4) {
+
+    struct ugreen_led_command_frame frame = { {
+        led_id,
+        0xa0, 0x01, 0x00, 0x00,
+        command,
+        param1, param2, param3, param4,
+        0, 0
+    } };
+
+    uint16_t cksum = ugreen_led_checksum(frame.bytes + 1, 9);
+    frame.bytes[10] = (uint8_t)(cksum >> 8);
+    frame.bytes[11] = (uint8_t)(cksum & 0xff);
+
+    return frame;
+}
+
+UGREEN_LED_PROTOCOL_FN struct ugreen_led_command_frame ugreen_led_encode_brightness(uint8_t led_id, uint8_t brightness) {
+    return ugreen_led_encode_command(led_id, UGREEN_LED_CMD_BRIGHTNESS, brightness, 0, 0, 0);
+}
+
+UGREEN_LED_PROTOCOL_FN struct ugreen_led_command_frame ugreen_led_encode_color(uint8_t led_id, uint8_t r, uint8_t g, uint8_t b) {
+    return ugreen_led_encode_command(led_id, UGREEN_LED_CMD_COLOR, r, g, b, 0);
+}
+
+UGREEN_LED_PROTOCOL_FN struct ugreen_led_command_frame ugreen_led_encode_on_off(uint8_t led_id, uint8_t on) {
+    return ugreen_led_encode_command(led_id, UGREEN_LED_CMD_ON_OFF, on ? 1 : 0, 0, 0, 0);
+}
+
+// the LED is on for t_on milliseconds in every cycle of t_cycle milliseconds (both big-endian)
+UGREEN_LED_PROTOCOL_FN struct ugreen_led_command_frame ugreen_led_encode_blink_or_breath(
+        uint8_t led_id, uint8_t is_blink, uint16_t t_on, uint16_t t_cycle) {
+    return ugreen_led_encode_command(led_id,
+            is_blink ? UGREEN_LED_CMD_BLINK : UGREEN_LED_CMD_BREATH,
+            (uint8_t)(t_cycle >> 8), (uint8_t)(t_cycle & 0xff),
+            (uint8_t)(t_on >> 8), (uint8_t)(t_on & 0xff));
+}
+
+// the result of reading UGREEN_LED_REG_LAST_COMMAND_STATUS (negative on transfer errors)
+UGREEN_LED_PROTOCOL_FN int ugreen_led_decode_last_command_status(int32_t value) {
+    return value == 1;
+}
+
+// status, brightness, r, g, b, t_cycle, t_on (both big-endian), and the checksum of bytes 0x00 - 0x08
+UGREEN_LED_PROTOCOL_FN struct ugreen_led_status ugreen_led_decode_status(struct ugreen_led_status_frame frame) {
+
+    struct ugreen_led_status status = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    const uint8_t *buf = frame.bytes;
+
+    uint16_t sum = ugreen_led_checksum(buf, 9);
+    if (sum == 0 || sum != (uint16_t)((buf[9] << 8) | buf[10]))
+        return status;
+
+    status.valid = 1;
+    status.status = buf[0];
+    status.brightness = buf[1];
+    status.r = buf[2];
+    status.g = buf[3];
+    status.b = buf[4];
+    status.t_cycle = (uint16_t)((buf[5] << 8) | buf[6]);
+    status.t_on = (uint16_t)((buf[7] << 8) | buf[8]);
+
+    return status;
+}
+
+#ifdef __cplusplus
+
+// test vectors, taken from the frames in README.md
+namespace ugreen_led_protocol_test {
+
+    constexpr bool frame_equals(const ugreen_led_command_frame &frame, const ugreen_led_command_frame &expected) {
+        for (int i = 0; i < UGREEN_LED_COMMAND_FRAME_SIZE; ++i) {
+            if (frame.bytes[i] != expected.bytes[i]) return false;
+        }
+        return true;
+    }
+
+    static_assert(frame_equals(ugreen_led_encode_on_off(0x00, 1),
+                { { 0x00, 0xa0, 0x01, 0x00, 0x00, 0x03, 0x01, 0x00, 0x00, 0x00, 0x00, 0xa5 } }),
+            "on/off frame of the power LED");
+    static_assert(frame_equals(ugreen_led_encode_on_off(0x00, 0),
+                { { 0x00, 0xa0, 0x01, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa4 } }),
+            "on/off frame of the power LED");
+    static_assert(frame_equals(ugreen_led_encode_brightness(0x02, 0xff),
+                { { 0x02, 0xa0, 0x01, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00, 0x01, 0xa1 } }),
+            "brightness frame");
+    static_assert(frame_equals(ugreen_led_encode_color(0x01, 0xff, 0x00, 0xff),
+                { { 0x01, 0xa0, 0x01, 0x00, 0x00, 0x02, 0xff, 0x00, 0xff, 0x00, 0x02, 0xa1 } }),
+            "color frame");
+    static_assert(frame_equals(ugreen_led_encode_blink_or_breath(0x00, 1, 400, 1000),
+                { { 0x00, 0xa0, 0x01, 0x00, 0x00, 0x04, 0x03, 0xe8, 0x01, 0x90, 0x02, 0x21 } }),
+            "blink frame");
+    static_assert(ugreen_led_encode_blink_or_breath(0x00, 0, 400, 1000).bytes[5] == UGREEN_LED_CMD_BREATH,
+            "breath frame");
+
+    // purple, blinking once per second, lit for 40% of the time, with a brightness of 180
+    constexpr ugreen_led_status_frame power_status = {
+        { 0x02, 0xb4, 0xff, 0x00, 0xff, 0x03, 0xe8, 0x01, 0x90, 0x04, 0x30 }
+    };
+
+    static_assert(ugreen_led_decode_status(power_status).valid, "status checksum");
+    static_assert(ugreen_led_decode_status(power_status).status == 2, "status mode");
+    static_assert(ugreen_led_decode_status(power_status).brightness == 0xb4, "status brightness");
+    static_assert(ugreen_led_decode_status(power_status).r == 0xff
+            && ugreen_led_decode_status(power_status).g == 0x00
+            && ugreen_led_decode_status(power_status).b == 0xff, "status color");
+    static_assert(ugreen_led_decode_status(power_status).t_cycle == 1000, "status cycle");
+    static_assert(ugreen_led_decode_status(power_status).t_on == 400, "status on time");
+
+    static_assert(!ugreen_led_decode_status({ { 0x02, 0xb4, 0xff, 0x00, 0xff, 0x03, 0xe8, 0x01, 0x90, 0x04, 0x31 } }).valid,
+            "corrupted status");
+    static_assert(!ugreen_led_decode_status({ { 0 } }).valid, "empty status");
+
+    static_assert(ugreen_led_decode_last_command_status(1), "acked");
+    static_assert(!ugreen_led_decode_last_command_status(0)
+            && !ugreen_led_decode_last_command_status(-5), "not acked");
+}
+
+#endif // __cplusplus
+
+#endif // __UGREEN_LED_PROTOCOL_H
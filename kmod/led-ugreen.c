@@ -13,10 +13,13 @@
 #include <linux/uaccess.h>
 #include <linux/fs.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 #include <linux/leds.h>
 #include <linux/proc_fs.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
+#include <linux/slab.h>
 #include "led-ugreen.h"
 
 #ifdef pr_fmt
@@ -24,12 +27,87 @@
 #endif
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+static bool adaptive_timing = false;
+module_param(adaptive_timing, bool, 0644);
+MODULE_PARM_DESC(adaptive_timing, 
+        "Poll the MCU until it acknowledges each command, instead of fixed settle sleeps (default: false)");
+
+static bool activity_offload = false;
+module_param(activity_offload, bool, 0644);
+MODULE_PARM_DESC(activity_offload, 
+        "Use the blink mode of the MCU while the oneshot trigger keeps firing, "
+        "instead of toggling the LED over I2C at every blink (default: false)");
+
+static unsigned int bus_rate = 0;
+module_param(bus_rate, uint, 0644);
+MODULE_PARM_DESC(bus_rate, 
+        "The most SMBus transfers per second to the MCU, so that the other devices on the adapter "
+        "are not delayed by bursts of activity (default: 0, unlimited). "
+        "Pending updates of a LED are merged while waiting");
+
+static unsigned int bus_burst = UGREEN_LED_BUS_BURST_DEFAULT;
+module_param(bus_burst, uint, 0644);
+MODULE_PARM_DESC(bus_burst, 
+        "The most SMBus transfers sent at once under bus_rate (default: 16)");
+
+static bool keep_state = false;
+module_param(keep_state, bool, 0444);
+MODULE_PARM_DESC(keep_state, 
+        "Keep the states of the LEDs found when probing (e.g., after reloading the module), "
+        "instead of turning them white at brightness 128 (default: false)");
+
 static struct ugreen_led_state *lcdev_to_ugreen_led_state(struct led_classdev *led_cdev) {
     return container_of(led_cdev, struct ugreen_led_state, cdev);
 }
 
+// account one SMBus transfer of a LED, which took the time since start
+static void ugreen_led_stats_add_transfer(struct ugreen_led_state *led, ktime_t start, s32 rc) {
+
+    s64 elapsed = ktime_us_delta(ktime_get(), start);
+    int bucket = min_t(int, fls64(max_t(s64, elapsed, 0)), UGREEN_LED_LATENCY_BUCKETS - 1);
+
+    spin_lock(&led->stats_lock);
+    ++led->stats.transactions;
+    if (rc < 0) ++led->stats.errors;
+    ++led->stats.latency[bucket];
+    spin_unlock(&led->stats_lock);
+}
+
+#define ugreen_led_stats_inc(led, field) do { \
+    spin_lock(&(led)->stats_lock); \
+    ++(led)->stats.field; \
+    spin_unlock(&(led)->stats_lock); \
+} while (0)
+
+// Pace the transfers as a token bucket of bus_burst transfers, refilled at 
+// bus_rate transfers per second (scheduled by the theoretical arrival time). 
+// Only the hardware writer sends transfers, and while it waits, the updates 
+// requested for the LEDs keep being merged into their desired states.
+static void ugreen_led_bus_throttle(struct ugreen_led_array *priv) {
+
+    unsigned int rate = READ_ONCE(bus_rate);
+    unsigned int burst = max(READ_ONCE(bus_burst), 1u);
+
+    if (rate == 0)
+        return;
+
+    s64 interval = NSEC_PER_SEC / rate;
+    ktime_t now = ktime_get();
+    ktime_t tat = ktime_after(priv->bus_tat, now) ? priv->bus_tat : now;
+
+    // a transfer may be sent up to burst - 1 intervals ahead of its time
+    s64 wait_us = div_s64(ktime_to_ns(ktime_sub(tat, now)) - (burst - 1) * interval, NSEC_PER_USEC);
+
+    if (wait_us >= 20 * USEC_PER_MSEC)
+        msleep(div_s64(wait_us, USEC_PER_MSEC));
+    else if (wait_us > 0)
+        usleep_range(wait_us, wait_us + wait_us / 4);
+
+    priv->bus_tat = ktime_add_ns(tat, interval);
+}
+
 static int ugreen_led_change_state(
-    struct i2c_client *client, 
+    struct ugreen_led_array *priv, 
     u8 led_id, 
     u8 command,
     u8 param1,
@@ -37,21 +115,18 @@ static int ugreen_led_change_state(
     u8 param3,
     u8 param4
 ) {
-    // compute the checksum
-    u16 cksum = 0xa1 + (u16)command + param1 + param2 + param3 + param4;
-
-    // construct the write buffer
-    u8 buf[12] = { 
-        led_id, 
-        0xa0, 0x01, 0x00, 0x00, 
-        command, 
-        param1, param2, param3, param4,
-        (u8)((cksum >> 8) & 0xff),
-        (u8)(cksum & 0xff)
-    };
+    // construct the write buffer with its checksum
+    struct ugreen_led_command_frame frame = ugreen_led_encode_command(
+            led_id, command, param1, param2, param3, param4);
 
     // write the buffer to the I2C device by sending block data 
-    s32 rc = i2c_smbus_write_i2c_block_data(client, led_id, 12, buf);
+    ugreen_led_bus_throttle(priv);
+    mutex_lock(&priv->bus_lock);
+    ktime_t start = ktime_get();
+    s32 rc = i2c_smbus_write_i2c_block_data(priv->client, UGREEN_LED_REG_COMMAND(led_id), 
+            UGREEN_LED_COMMAND_FRAME_SIZE, frame.bytes);
+    ugreen_led_stats_add_transfer(priv->state + led_id, start, rc);
+    mutex_unlock(&priv->bus_lock);
 
     // check the return code
     if (rc < 0) {
@@ -64,20 +139,27 @@ static int ugreen_led_change_state(
     return 0;
 }
 
-// get the state of the DX4600 LEDs 
+// get the state of the DX4600 LEDs, where the received frame is kept in 
+// the frame buffer, and -EBADMSG is returned if its checksum mismatches
 static int ugreen_led_get_state(
-        struct i2c_client *client, 
+        struct ugreen_led_array *priv, 
         u8 led_id, 
-        struct ugreen_led_state *state
+        struct ugreen_led_hw_state *state,
+        struct ugreen_led_status_frame *frame
 ) {
-    if (!state) {
+    if (!state || !frame) {
         pr_err("%s: invalid state buffer", __func__);
         return -1;
     }
 
     // read the state of the LED from the I2C device
-    u8 buf[11];
-    s32 rc = i2c_smbus_read_i2c_block_data(client, 0x81 + led_id, 11, (u8 *)buf);
+    ugreen_led_bus_throttle(priv);
+    mutex_lock(&priv->bus_lock);
+    ktime_t start = ktime_get();
+    s32 rc = i2c_smbus_read_i2c_block_data(priv->client, UGREEN_LED_REG_STATUS(led_id), 
+            UGREEN_LED_STATUS_FRAME_SIZE, frame->bytes);
+    ugreen_led_stats_add_transfer(priv->state + led_id, start, rc);
+    mutex_unlock(&priv->bus_lock);
 
     // check the return code
     if (rc < 0) {
@@ -86,35 +168,34 @@ static int ugreen_led_get_state(
         return rc;
     }
 
-    // compute the checksum of received data
-    u16 sum = 0;
-    for (int i = 0; i < 9; ++i) {
-        sum += buf[i];
+    // check the checksum, and parse the state of the LED
+    struct ugreen_led_status status = ugreen_led_decode_status(*frame);
+    if (!status.valid) {
+        ugreen_led_stats_inc(priv->state + led_id, checksum_failures);
+        return -EBADMSG;
     }
 
-    // check the checksum
-    if (sum == 0 || (sum != (((u16)buf[9] << 8) | buf[10]))) {
-        return -1;
-    }
-
-    // parse the state of the LED
-    state->status = buf[0];
-    state->brightness = buf[1];
-    state->r = buf[2];
-    state->g = buf[3];
-    state->b = buf[4];
-    u16 t_hight = (((int)buf[5]) << 8) | buf[6];
-    u16 t_low = (((int)buf[7]) << 8) | buf[8];
-    state->t_on = t_low;
-    state->t_cycle = t_hight;
+    state->status = status.status;
+    state->brightness = status.brightness;
+    state->r = status.r;
+    state->g = status.g;
+    state->b = status.b;
+    state->t_on = status.t_on;
+    state->t_cycle = status.t_cycle;
 
     return 0;
 }
 
-static bool ugreen_led_get_last_command_status(struct i2c_client *client) {
+// the ack of the last command, which is accounted to the LED it was sent to
+static bool ugreen_led_get_last_command_status(struct ugreen_led_array *priv, u8 led_id) {
 
     // read the status byte from the I2C device
-    s32 rc = i2c_smbus_read_byte_data(client, 0x80);
+    ugreen_led_bus_throttle(priv);
+    mutex_lock(&priv->bus_lock);
+    ktime_t start = ktime_get();
+    s32 rc = i2c_smbus_read_byte_data(priv->client, UGREEN_LED_REG_LAST_COMMAND_STATUS);
+    ugreen_led_stats_add_transfer(priv->state + led_id, start, rc);
+    mutex_unlock(&priv->bus_lock);
 
     // check the return code
     if (rc < 0) {
@@ -122,11 +203,62 @@ static bool ugreen_led_get_last_command_status(struct i2c_client *client) {
         return false;
     }
 
-    return rc == 1;
+    return ugreen_led_decode_last_command_status(rc);
+}
+
+// Acks at the first poll only bound the latency from above, so it is probed
+// lower, but not below a floor tied to the latencies measured after busy
+// polls: the register still holds the 1 of the previous command until the
+// MCU has picked up the new frame.
+static unsigned int ugreen_led_ack_floor_us(struct ugreen_led_array *priv) {
+    return max(READ_ONCE(priv->ack_measured_us) * 3 / 4, UGREEN_LED_ACK_MIN_POLL_US);
+}
+
+// wait until the MCU acknowledges the last command
+static bool ugreen_led_wait_for_ack(struct ugreen_led_array *priv, u8 led_id) {
+
+    if (!adaptive_timing) {
+        usleep_range(1500, 2500);
+        return ugreen_led_get_last_command_status(priv, led_id);
+    }
+
+    // poll from the learned latency on, with an exponential backoff
+    ktime_t start = ktime_get();
+    unsigned int delay = max(priv->ack_latency_us, ugreen_led_ack_floor_us(priv));
+
+    for (int i = 0; ; ++i) {
+
+        usleep_range(delay, delay + delay / 4);
+
+        s64 elapsed = ktime_us_delta(ktime_get(), start);
+
+        if (ugreen_led_get_last_command_status(priv, led_id)) {
+            unsigned int latency = priv->ack_latency_us;
+
+            if (i == 0) {
+                // the ack may have arrived earlier, so probe a bit earlier next time
+                latency -= latency / 8;
+            } else {
+                // the MCU was seen busy, so this is an actual measurement
+                WRITE_ONCE(priv->ack_measured_us, (priv->ack_measured_us * 3 + (unsigned int)elapsed) / 4);
+                latency = (latency * 3 + (unsigned int)elapsed) / 4;
+            }
+
+            WRITE_ONCE(priv->ack_latency_us, clamp(latency,
+                    ugreen_led_ack_floor_us(priv), UGREEN_LED_ACK_TIMEOUT_US));
+            return true;
+        }
+
+        if (elapsed >= UGREEN_LED_ACK_TIMEOUT_US) 
+            return false;
+
+        delay = min_t(unsigned int, UGREEN_LED_ACK_MIN_POLL_US << min(i, 6), 
+                UGREEN_LED_ACK_TIMEOUT_US - elapsed);
+    }
 }
 
 static int ugreen_led_change_state_robust(
-    struct i2c_client *client, 
+    struct ugreen_led_array *priv, 
     u8 led_id, 
     u8 command,
     u8 param1,
@@ -138,146 +270,309 @@ static int ugreen_led_change_state_robust(
     for (int i = 0; i < UGREEN_LED_CHANGE_STATE_RETRY_COUNT; ++i) {
 
         if (i == 0) usleep_range(500, 1500);
+        else if (adaptive_timing) usleep_range(3000 << (i - 1), 3000 << i);
         else msleep(30);
 
-        if (i > 0) pr_debug("retrying %d", i);
+        if (i > 0) {
+            pr_debug("retrying %d", i);
+            ugreen_led_stats_inc(priv->state + led_id, retries);
+        }
 
-        rc = ugreen_led_change_state(client, led_id, command, param1, param2, param3, param4);
+        rc = ugreen_led_change_state(priv, led_id, command, param1, param2, param3, param4);
         if (rc == 0) {
-            usleep_range(1500, 2500);
-            if (ugreen_led_get_last_command_status(client)) {
+            if (ugreen_led_wait_for_ack(priv, led_id))
                 return 0;
-            }
+            ugreen_led_stats_inc(priv->state + led_id, ack_failures);
         }
     }
 
     return -1;
 }
 
-static int ugreen_led_get_state_robust(
-        struct i2c_client *client, 
-        u8 led_id, 
-        struct ugreen_led_state *state
-) {
-    int rc = 0;
-    for (int i = 0; i < UGREEN_LED_CHANGE_STATE_RETRY_COUNT; ++i) {
+// Read the states of all LEDs back to back, and then retry only the failed 
+// ones, sharing one retry delay per round. A LED answering twice with the 
+// same corrupted frame does not exist, and is marked as invalid.
+// The states are published as the hardware states, so the caller must 
+// be the hardware writer.
+static void ugreen_led_get_state_all(struct ugreen_led_array *priv) {
 
-        if (i == 0) usleep_range(500, 1500);
-        else msleep(30);
+    struct ugreen_led_hw_state states[UGREEN_MAX_LED_NUMBER];
+    struct ugreen_led_status_frame frames[UGREEN_MAX_LED_NUMBER];
+    bool pending[UGREEN_MAX_LED_NUMBER], corrupted[UGREEN_MAX_LED_NUMBER] = { };
 
-        rc = ugreen_led_get_state(client, led_id, state);
-        if (rc == 0) return 0;
+    for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
+        states[i].status = UGREEN_LED_STATE_INVALID;
+        pending[i] = true;
     }
 
-    state->status = UGREEN_LED_STATE_INVALID;
+    for (int round = 0; round < UGREEN_LED_CHANGE_STATE_RETRY_COUNT; ++round) {
 
-    return -1;
-}
+        bool any_pending = false;
+        if (round > 0) msleep(30);
 
-static void ugreen_led_turn_on_or_off_unlock(struct ugreen_led_array *priv, u8 led_id, bool on) {
+        for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
 
-    if (priv->state[led_id].status == (on ? UGREEN_LED_STATE_ON : UGREEN_LED_STATE_OFF)) {
-        return;
-    }
+            if (!pending[i]) continue;
 
-    int rc = ugreen_led_change_state_robust(priv->client, led_id, 0x03, on ? 1 : 0, 0, 0, 0);
-    if (rc == 0) {
-        priv->state[led_id].status = on ? UGREEN_LED_STATE_ON : UGREEN_LED_STATE_OFF;
-    } else {
-        pr_err("failed to turn %d %s", led_id, on ? "on" : "off");
-    }
-}
+            if (round > 0) ugreen_led_stats_inc(priv->state + i, retries);
+            usleep_range(500, 1500);
 
-static void ugreen_led_set_brightness_unlock(struct ugreen_led_array *priv, u8 led_id, enum led_brightness brightness) {
+            struct ugreen_led_status_frame frame;
+            int rc = ugreen_led_get_state(priv, i, &states[i], &frame);
 
-    struct ugreen_led_state *state = priv->state + led_id;
-
-    if (brightness == 0) {
-        ugreen_led_turn_on_or_off_unlock(priv, led_id, false);
-    } else {
-        if (state->brightness != brightness) {
-            int rc = ugreen_led_change_state_robust(priv->client, led_id, 0x01, brightness, 0, 0, 0);
             if (rc == 0) {
-                state->brightness = brightness;
+                pending[i] = false;
+                continue;
+            }
+
+            states[i].status = UGREEN_LED_STATE_INVALID;
+
+            if (rc == -EBADMSG) {
+                if (corrupted[i] && !memcmp(&frame, &frames[i], sizeof(frame))) {
+                    pending[i] = false;
+                    continue;
+                }
+
+                frames[i] = frame;
+                corrupted[i] = true;
             } else {
-                pr_err("failed to set brightness of %d to %d", led_id, brightness);
+                corrupted[i] = false;
             }
+
+            any_pending = true;
         }
 
-        if (state->status == UGREEN_LED_STATE_OFF)
-            ugreen_led_turn_on_or_off_unlock(priv, led_id, true);
+        if (!any_pending) break;
+    }
+
+    for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
+        struct ugreen_led_state *led = priv->state + i;
+        write_seqlock(&led->hw_lock);
+        led->hw = states[i];
+        write_sequnlock(&led->hw_lock);
     }
 }
 
-static void ugreen_led_set_color_unlock(struct ugreen_led_array *priv, u8 led_id, u8 r, u8 g, u8 b) {
+static void ugreen_led_read_hw_state(struct ugreen_led_state *led, struct ugreen_led_hw_state *hw) {
 
-    struct ugreen_led_state *state = priv->state + led_id;
+    unsigned int seq;
 
-    if (!r && !g && !b) {
-        return ugreen_led_turn_on_or_off_unlock(priv, led_id, false);
+    do {
+        seq = read_seqbegin(&led->hw_lock);
+        *hw = led->hw;
+    } while (read_seqretry(&led->hw_lock, seq));
+}
+
+static void ugreen_led_read_desired_state(struct ugreen_led_state *led, struct ugreen_led_hw_state *desired) {
+
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&led->desired_lock);
+        *desired = led->desired;
+    } while (read_seqretry(&led->desired_lock, seq));
+}
+
+// Change the LED to the target state, only sending the commands for changed fields.
+// Hardware writers must be serialized (by the ordered workqueue), 
+// so that the ack read after each command belongs to that command.
+static int ugreen_led_set_state_unlock(struct ugreen_led_array *priv, u8 led_id, const struct ugreen_led_hw_state *target) {
+
+    int rc, ret = 0;
+    struct ugreen_led_state *led = priv->state + led_id;
+    struct ugreen_led_hw_state hw = led->hw, *state = &hw;
+
+    if (state->r != target->r || state->g != target->g || state->b != target->b) {
+        rc = ugreen_led_change_state_robust(priv, led_id, UGREEN_LED_CMD_COLOR, target->r, target->g, target->b, 0);
+        if (rc == 0) {
+            state->r = target->r;
+            state->g = target->g;
+            state->b = target->b;
+        } else {
+            pr_err("failed to set color of %d to 0x%02x%02x%02x", led_id, target->r, target->g, target->b);
+            ret = rc;
+        }
     }
 
-    if (state->r != r || state->g != g || state->b != b) {
-        int rc = ugreen_led_change_state_robust(priv->client, led_id, 0x02, r, g, b, 0);
+    if (state->brightness != target->brightness) {
+        rc = ugreen_led_change_state_robust(priv, led_id, UGREEN_LED_CMD_BRIGHTNESS, target->brightness, 0, 0, 0);
         if (rc == 0) {
-            state->r = r;
-            state->g = g;
-            state->b = b;
+            state->brightness = target->brightness;
         } else {
-            pr_err("failed to set color of %d to 0x%02x%02x%02x", led_id, r, g, b);
+            pr_err("failed to set brightness of %d to %d", led_id, target->brightness);
+            ret = rc;
         }
     }
+
+    if (target->status == UGREEN_LED_STATE_ON || target->status == UGREEN_LED_STATE_OFF) {
+        if (state->status != target->status) {
+            bool on = target->status == UGREEN_LED_STATE_ON;
+            rc = ugreen_led_change_state_robust(priv, led_id, UGREEN_LED_CMD_ON_OFF, on ? 1 : 0, 0, 0, 0);
+            if (rc == 0) {
+                state->status = target->status;
+            } else {
+                pr_err("failed to turn %d %s", led_id, on ? "on" : "off");
+                ret = rc;
+            }
+        }
+    } else if (target->status == UGREEN_LED_STATE_BLINK || target->status == UGREEN_LED_STATE_BREATH) {
+        if (state->status != target->status || state->t_on != target->t_on || state->t_cycle != target->t_cycle) {
+            bool is_blink = target->status == UGREEN_LED_STATE_BLINK;
+            rc = ugreen_led_change_state_robust(priv, led_id, is_blink ? UGREEN_LED_CMD_BLINK : UGREEN_LED_CMD_BREATH, 
+                (u8)(target->t_cycle >> 8), (u8)(target->t_cycle & 0xff), 
+                (u8)(target->t_on >> 8), (u8)(target->t_on & 0xff)
+            );
+
+            if (rc == 0) {
+                state->t_on = target->t_on;
+                state->t_cycle = target->t_cycle;
+                state->status = target->status;
+            } else {
+                pr_err("failed to set %s of %d to %d %d", is_blink ? "blink" : "breath", 
+                        led_id, target->t_on, target->t_cycle);
+                ret = rc;
+            }
+        }
+    }
+
+    write_seqlock(&led->hw_lock);
+    led->hw = hw;
+    write_sequnlock(&led->hw_lock);
+
+    return ret;
 }
 
-static void ugreen_led_set_blink_or_breath_unlock(struct ugreen_led_array *priv, u8 led_id, u16 t_on, u16 t_cycle, bool is_blink) {
+// helpers modifying a target state, with the semantics of the corresponding sysfs attributes
+
+static void ugreen_led_target_on_or_off(struct ugreen_led_hw_state *target, bool on) {
+
+    target->status = on ? UGREEN_LED_STATE_ON : UGREEN_LED_STATE_OFF;
+}
+
+static void ugreen_led_target_brightness(struct ugreen_led_hw_state *target, enum led_brightness brightness) {
+
+    if (brightness == 0) {
+        target->status = UGREEN_LED_STATE_OFF;
+    } else {
+        target->brightness = brightness;
+        if (target->status == UGREEN_LED_STATE_OFF)
+            target->status = UGREEN_LED_STATE_ON;
+    }
+}
 
-    int rc;
-    struct ugreen_led_state *state = priv->state + led_id;
-    u8 led_status = is_blink ? UGREEN_LED_STATE_BLINK : UGREEN_LED_STATE_BREATH;
+static void ugreen_led_target_color(struct ugreen_led_hw_state *target, u8 r, u8 g, u8 b) {
 
-    if (state->t_on == t_on && state->t_cycle == t_cycle && state->status == led_status) {
-        rc = 0;
+    if (!r && !g && !b) {
+        target->status = UGREEN_LED_STATE_OFF;
     } else {
-        rc = ugreen_led_change_state_robust(priv->client, led_id, is_blink ? 0x04 : 0x05, 
-            (u8)(t_cycle >> 8), (u8)(t_cycle & 0xff), 
-            (u8)(t_on >> 8), (u8)(t_on & 0xff)
-        );
+        target->r = r;
+        target->g = g;
+        target->b = b;
+    }
+}
 
-        if (rc == 0) {
-            state->t_on = t_on;
-            state->t_cycle = t_cycle;
-            state->status = led_status;
-        } else {
-            pr_err("failed to set %s of %d to %d %d", is_blink ? "blink" : "breath", led_id, t_on, t_cycle);
+static void ugreen_led_target_blink_or_breath(struct ugreen_led_hw_state *target, u16 t_on, u16 t_cycle, bool is_blink) {
+
+    target->status = is_blink ? UGREEN_LED_STATE_BLINK : UGREEN_LED_STATE_BREATH;
+    target->t_on = t_on;
+    target->t_cycle = t_cycle;
+}
+
+// flush the latest desired state of a LED to the MCU; intermediate states are dropped
+// the next LED to flush: alerts first, then activity updates in round robin, 
+// so that a busy disk does not starve the others
+static int ugreen_led_next_pending(struct ugreen_led_array *priv) {
+
+    int id = find_first_bit(&priv->pending_alert, UGREEN_MAX_LED_NUMBER);
+    if (id < UGREEN_MAX_LED_NUMBER) {
+        clear_bit(id, &priv->pending_alert);
+        // the flush also covers the activity updates of this LED
+        clear_bit(id, &priv->pending_activity);
+        return id;
+    }
+
+    for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
+        id = (priv->next_activity + i) % UGREEN_MAX_LED_NUMBER;
+        if (test_and_clear_bit(id, &priv->pending_activity)) {
+            priv->next_activity = id + 1;
+            return id;
         }
     }
+
+    return -1;
 }
 
-static int ugreen_led_set_brightness_blocking(struct led_classdev *cdev, enum led_brightness brightness) {
+static void ugreen_led_dispatch_work(struct work_struct *work) {
+
+    struct ugreen_led_array *priv = container_of(work, struct ugreen_led_array, dispatch_work);
+    struct ugreen_led_hw_state target;
+    int id;
+
+    // Pending bits are cleared before the desired state is read, so later 
+    // updates are never lost. Alerts raised while a LED is being flushed 
+    // are picked before the remaining activity updates.
+    while ((id = ugreen_led_next_pending(priv)) >= 0) {
+        ugreen_led_read_desired_state(priv->state + id, &target);
+        ugreen_led_set_state_unlock(priv, id, &target);
+    }
+}
+
+// Alerts (color, on / off and blink type from sysfs) go before the activity 
+// updates of LED triggers. Pending updates of a LED are merged, since only 
+// its latest desired state is written.
+static void ugreen_led_schedule_flush(struct ugreen_led_state *state, bool is_alert) {
 
-    struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
     struct ugreen_led_array *priv = state->priv;
-    int led_id = state->led_id;
 
-    pr_debug("set brightness of %d to %d\n", led_id, brightness);
+    set_bit(state->led_id, is_alert ? &priv->pending_alert : &priv->pending_activity);
 
-    mutex_lock(&priv->mutex);
-    ugreen_led_set_brightness_unlock(priv, led_id, brightness);
-    mutex_unlock(&priv->mutex);
+    // if the work is already pending, it will pick up the new desired state
+    queue_work(priv->wq, &priv->dispatch_work);
+}
 
-    return 0;
+static bool ugreen_led_is_triggered(struct led_classdev *cdev) {
+#ifdef CONFIG_LEDS_TRIGGERS
+    return READ_ONCE(cdev->trigger) != NULL;
+#else
+    return false;
+#endif
+}
+
+// LED_BLINK_ONESHOT is only cleared by the next led_blink_set(), so it is 
+// still set after a oneshot has ended, or the trigger has been removed
+static bool ugreen_led_is_oneshot_running(struct led_classdev *cdev) {
+#ifdef CONFIG_LEDS_TRIGGERS
+    bool running;
+
+    if (!test_bit(LED_BLINK_ONESHOT, &cdev->work_flags) || !test_bit(LED_BLINK_SW, &cdev->work_flags))
+        return false;
+
+    // called from the blink timer as well, so it cannot wait for the lock;
+    // the trigger is being changed if it is held for writing
+    if (!down_read_trylock(&cdev->trigger_lock))
+        return false;
+    running = cdev->trigger && !strcmp(cdev->trigger->name, "oneshot");
+    up_read(&cdev->trigger_lock);
+
+    return running;
+#else
+    return false;
+#endif
 }
 
 static enum led_brightness ugreen_led_get_brightness(struct led_classdev *cdev) {
 
     struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
+    struct ugreen_led_hw_state desired;
 
     pr_debug("get brightness of %d\n", state->led_id);
 
-    if (!state->r && !state->g && !state->b)
+    ugreen_led_read_desired_state(state, &desired);
+
+    if (!desired.r && !desired.g && !desired.b)
         return LED_OFF;
 
-    return state->status == UGREEN_LED_STATE_OFF ? LED_OFF : state->brightness;
+    return desired.status == UGREEN_LED_STATE_OFF ? LED_OFF : desired.brightness;
 }
 
 static void truncate_blink_delay_time(unsigned long *delay_on, unsigned long *delay_off) {
@@ -289,25 +584,91 @@ static void truncate_blink_delay_time(unsigned long *delay_on, unsigned long *de
     else if (*delay_off > 0x7fff) *delay_off = 0x7fff;
 }
 
+// the oneshot trigger has stopped firing, so return the LED to a solid state
+static void ugreen_led_activity_idle_work(struct work_struct *work) {
+
+    struct ugreen_led_state *state = container_of(to_delayed_work(work), struct ugreen_led_state, idle_work);
+    unsigned long flags;
+
+    write_seqlock_irqsave(&state->desired_lock, flags);
+    if (state->offloading) {
+        state->offloading = false;
+        state->desired.status = UGREEN_LED_STATE_ON;
+        ugreen_led_target_brightness(&state->desired, state->activity_brightness);
+    }
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
+
+    ugreen_led_schedule_flush(state, false);
+}
+
+// Let the MCU blink by itself while the oneshot trigger keeps toggling the 
+// LED, so that the bus traffic scales with activity transitions, not blinks.
+static void ugreen_led_offload_activity(struct ugreen_led_state *state, enum led_brightness brightness) {
+
+    struct led_classdev *cdev = &state->cdev;
+    unsigned long delay_on = cdev->blink_delay_on, delay_off = cdev->blink_delay_off;
+    unsigned long flags;
+    bool started = false;
+
+    truncate_blink_delay_time(&delay_on, &delay_off);
+
+    write_seqlock_irqsave(&state->desired_lock, flags);
+    state->activity_brightness = brightness;
+    if (!state->offloading) {
+        state->offloading = true;
+        ugreen_led_target_blink_or_breath(&state->desired, delay_on, delay_on + delay_off, true);
+        started = true;
+    }
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
+
+    if (started) 
+        ugreen_led_schedule_flush(state, false);
+
+    // the trigger toggles at least once per cycle while it is active
+    mod_delayed_work(state->priv->wq, &state->idle_work, 
+            msecs_to_jiffies(2 * (delay_on + delay_off)));
+}
+
+static void ugreen_led_set_brightness(struct led_classdev *cdev, enum led_brightness brightness) {
+
+    struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
+    unsigned long flags;
+
+    pr_debug("set brightness of %d to %d\n", state->led_id, brightness);
+
+    if (activity_offload && ugreen_led_is_oneshot_running(cdev)) {
+        ugreen_led_offload_activity(state, brightness);
+        return;
+    }
+
+    write_seqlock_irqsave(&state->desired_lock, flags);
+    if (state->offloading) {
+        state->offloading = false;
+        state->desired.status = UGREEN_LED_STATE_ON;
+    }
+    ugreen_led_target_brightness(&state->desired, brightness);
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
+
+    // brightness toggles of triggers are activity, the rest is set by users
+    ugreen_led_schedule_flush(state, !ugreen_led_is_triggered(cdev));
+}
+
 static int ugreen_led_set_blink(struct led_classdev *cdev, unsigned long *delay_on, unsigned long *delay_off) {
 
     struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
-    struct ugreen_led_array *priv = state->priv;
-    int led_id = state->led_id;
+    unsigned long flags;
 
     truncate_blink_delay_time(delay_on, delay_off);
 
-    pr_debug("set blink of %d to %lu %lu\n", led_id, *delay_on, *delay_off);
+    pr_debug("set blink of %d to %lu %lu\n", state->led_id, *delay_on, *delay_off);
 
-    mutex_lock(&priv->mutex);
+    write_seqlock_irqsave(&state->desired_lock, flags);
+    ugreen_led_target_blink_or_breath(&state->desired, *delay_on, *delay_on + *delay_off, true);
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
 
-    ugreen_led_set_blink_or_breath_unlock(priv, led_id, *delay_on, *delay_on + *delay_off, true);
-    *delay_on = state->t_on;
-    *delay_off = state->t_cycle - state->t_on;
+    ugreen_led_schedule_flush(state, false);
 
-    mutex_unlock(&priv->mutex);
-
-    return state->status == UGREEN_LED_STATE_BLINK ? 0 : -EINVAL;
+    return 0;
 }
 
 static ssize_t color_store(struct device *dev, 
@@ -317,8 +678,7 @@ static ssize_t color_store(struct device *dev,
 
     struct led_classdev *cdev = dev_get_drvdata(dev);
     struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
-    struct ugreen_led_array *priv = state->priv;
-    int led_id = state->led_id;
+    unsigned long flags;
     u8 r, g, b;
 
     int nrchars;
@@ -331,11 +691,13 @@ static ssize_t color_store(struct device *dev,
         return -EINVAL;
     }
 
-    pr_debug("set color of %d to 0x%02x%02x%02x\n", led_id, r, g, b);
+    pr_debug("set color of %d to 0x%02x%02x%02x\n", state->led_id, r, g, b);
 
-    mutex_lock(&priv->mutex);
-    ugreen_led_set_color_unlock(priv, led_id, r, g, b);
-    mutex_unlock(&priv->mutex);
+    write_seqlock_irqsave(&state->desired_lock, flags);
+    ugreen_led_target_color(&state->desired, r, g, b);
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
+
+    ugreen_led_schedule_flush(state, true);
 
     return size;
 }
@@ -344,7 +706,10 @@ static ssize_t color_show(struct device *dev, struct device_attribute *attr, cha
 
     struct led_classdev *cdev = dev_get_drvdata(dev);
     struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
-    return sprintf(buf, "%d %d %d\n", state->r, state->g, state->b);
+    struct ugreen_led_hw_state desired;
+
+    ugreen_led_read_desired_state(state, &desired);
+    return sprintf(buf, "%d %d %d\n", desired.r, desired.g, desired.b);
 }
 
 static DEVICE_ATTR_RW(color);
@@ -359,6 +724,7 @@ static ssize_t blink_type_store(struct device *dev,
 
     u8 blink_type;
     unsigned long delay_on, delay_off;
+    unsigned long flags;
     int nrchars;
 
     if (sscanf(buf, "blink %lu %lu%n", &delay_on, &delay_off, &nrchars) == 2) {
@@ -374,18 +740,22 @@ static ssize_t blink_type_store(struct device *dev,
         return -EINVAL;
     }
 
-    mutex_lock(&state->priv->mutex);
+    if (blink_type != UGREEN_LED_STATE_ON)
+        truncate_blink_delay_time(&delay_on, &delay_off);
+
+    write_seqlock_irqsave(&state->desired_lock, flags);
 
     if (blink_type == UGREEN_LED_STATE_ON) {
-        ugreen_led_turn_on_or_off_unlock(state->priv, state->led_id, true);
+        ugreen_led_target_on_or_off(&state->desired, true);
     } else {
-        truncate_blink_delay_time(&delay_on, &delay_off);
-        ugreen_led_set_blink_or_breath_unlock(state->priv, state->led_id, 
+        ugreen_led_target_blink_or_breath(&state->desired, 
                 (u16)delay_on, (u16)(delay_on + delay_off),
                 blink_type == UGREEN_LED_STATE_BLINK ? true : false);
     }
 
-    mutex_unlock(&state->priv->mutex);
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
+
+    ugreen_led_schedule_flush(state, true);
 
     return size;
 }
@@ -394,14 +764,14 @@ static ssize_t blink_type_show(struct device *dev, struct device_attribute *attr
 
     struct led_classdev *cdev = dev_get_drvdata(dev);
     struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
+    struct ugreen_led_hw_state desired;
 
     ssize_t size = 0;
 
-    mutex_lock(&state->priv->mutex);
-    u8 status = state->status;
-    int delay_on = state->t_on;
-    int delay_off = state->t_cycle - state->t_on;
-    mutex_unlock(&state->priv->mutex);
+    ugreen_led_read_desired_state(state, &desired);
+    u8 status = desired.status;
+    int delay_on = desired.t_on;
+    int delay_off = desired.t_cycle - desired.t_on;
 
     if (status == UGREEN_LED_STATE_BLINK) {
         size += sprintf(buf, "none [blink] breath\n");
@@ -425,73 +795,282 @@ static DEVICE_ATTR_RW(blink_type);
 static ssize_t status_show(struct device *dev, struct device_attribute *attr, char *buf) {
 
     struct led_classdev *cdev = dev_get_drvdata(dev);
-    struct ugreen_led_state state = *lcdev_to_ugreen_led_state(cdev);
+    struct ugreen_led_hw_state hw;
+
+    ugreen_led_read_hw_state(lcdev_to_ugreen_led_state(cdev), &hw);
 
-    mutex_lock(&state.priv->mutex);
-    int status = state.status;
+    int status = hw.status;
     if (status >= ARRAY_SIZE(ugreen_led_state_name)) {
         status = UGREEN_LED_STATE_INVALID;
     }
-    ssize_t size = sprintf(buf, "%s %d %d %d %d %d %d\n", 
-            ugreen_led_state_name[state.status], (int)state.brightness, 
-            (int)state.r, (int)state.g, (int)state.b,
-            (int)state.t_on, (int)(state.t_cycle - state.t_on));
-    mutex_unlock(&state.priv->mutex);
 
-    return size;
+    return sprintf(buf, "%s %d %d %d %d %d %d\n", 
+            ugreen_led_state_name[status], (int)hw.brightness, 
+            (int)hw.r, (int)hw.g, (int)hw.b,
+            (int)hw.t_on, (int)(hw.t_cycle - hw.t_on));
 }
 
 static DEVICE_ATTR_RO(status);
 
+// an upper bound of the given percentile of transfer latencies, in microseconds
+static unsigned int ugreen_led_latency_percentile(const struct ugreen_led_stats *stats, unsigned int percentile) {
+
+    u64 count = 0;
+
+    if (stats->transactions == 0) 
+        return 0;
+
+    for (int i = 0; i < UGREEN_LED_LATENCY_BUCKETS; ++i) {
+        count += stats->latency[i];
+        if (count * 100 >= stats->transactions * percentile)
+            return 1u << i;
+    }
+
+    return 1u << (UGREEN_LED_LATENCY_BUCKETS - 1);
+}
+
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf) {
+
+    struct led_classdev *cdev = dev_get_drvdata(dev);
+    struct ugreen_led_state *state = lcdev_to_ugreen_led_state(cdev);
+    struct ugreen_led_stats stats;
+
+    spin_lock(&state->stats_lock);
+    stats = state->stats;
+    spin_unlock(&state->stats_lock);
+
+    int size = sprintf(buf, "transactions: %llu\nerrors: %llu\nretries: %llu\n"
+            "ack_failures: %llu\nchecksum_failures: %llu\n"
+            "latency_p50_us: %u\nlatency_p99_us: %u\n"
+            "ack_latency_us: %u\nack_floor_us: %u\nlatency_histogram_us:",
+            stats.transactions, stats.errors, stats.retries, 
+            stats.ack_failures, stats.checksum_failures,
+            ugreen_led_latency_percentile(&stats, 50),
+            ugreen_led_latency_percentile(&stats, 99),
+            READ_ONCE(state->priv->ack_latency_us), ugreen_led_ack_floor_us(state->priv));
+
+    // the bucket i holds transfers shorter than 2^i us (the last one holds the rest)
+    for (int i = 0; i < UGREEN_LED_LATENCY_BUCKETS; ++i) {
+        size += sprintf(buf + size, " %llu", stats.latency[i]);
+    }
+
+    size += sprintf(buf + size, "\n");
+
+    return size;
+}
+
+static DEVICE_ATTR_RO(stats);
+
 static struct attribute *ugreen_led_attrs[] = {
 	&dev_attr_color.attr,
 	&dev_attr_status.attr,
 	&dev_attr_blink_type.attr,
+	&dev_attr_stats.attr,
 	NULL,
 };
 
 ATTRIBUTE_GROUPS(ugreen_led);
 
-static int ugreen_led_probe(struct i2c_client *client) {
+// a batch of UGREEN_LED_IOC_SET_STATES, written to the MCU by one work item
+struct ugreen_led_batch {
+    struct work_struct work;
+    struct ugreen_led_array *priv;
+    u32 count;
+    struct ugreen_led_ioctl_state states[UGREEN_LED_IOCTL_MAX_STATES];
+};
 
-    pr_info ("i2c probed");
+static void ugreen_led_batch_work(struct work_struct *work) {
 
-    struct ugreen_led_array *priv;
-    
-    priv = devm_kzalloc(&client->dev, sizeof(struct ugreen_led_array), GFP_KERNEL);
-    if (!priv) {
-        return -ENOMEM;
+    struct ugreen_led_batch *batch = container_of(work, struct ugreen_led_batch, work);
+    struct ugreen_led_hw_state target;
+
+    // The ordered workqueue keeps the dispatch work and other batches out, 
+    // so the batch is written in one pass of the hardware writer.
+    for (u32 i = 0; i < batch->count; ++i) {
+
+        struct ugreen_led_ioctl_state *s = batch->states + i;
+        if (s->result != 0) continue;
+
+        ugreen_led_read_desired_state(batch->priv->state + s->led_id, &target);
+        if (ugreen_led_set_state_unlock(batch->priv, s->led_id, &target) != 0)
+            s->result = -EIO;
     }
+}
 
-    priv->client = client;
+// check a state of a batch, and make it the desired state of its LED
+static int ugreen_led_batch_set_desired(struct ugreen_led_array *priv, const struct ugreen_led_ioctl_state *s) {
 
-    mutex_init(&priv->mutex);
+    unsigned long delay_on = s->delay_on, delay_off = s->delay_off;
+    unsigned long flags;
 
-    // probe and initialize leds
-    for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
+    if (s->led_id >= UGREEN_MAX_LED_NUMBER || priv->state[s->led_id].hw.status == UGREEN_LED_STATE_INVALID)
+        return -ENODEV;
 
-        priv->state[i].priv = priv;
-        priv->state[i].led_id = i;
+    if ((s->fields & ~UGREEN_LED_IOCTL_ALL_FIELDS) || s->reserved)
+        return -EINVAL;
 
-        ugreen_led_get_state_robust(client, i, priv->state + i);
+    if ((s->fields & UGREEN_LED_IOCTL_MODE) && s->status > UGREEN_LED_STATE_BREATH)
+        return -EINVAL;
 
-        struct ugreen_led_state *state = priv->state + i;
-        if (state->status != UGREEN_LED_STATE_INVALID) {
+    struct ugreen_led_state *state = priv->state + s->led_id;
+    bool is_blinking = s->status == UGREEN_LED_STATE_BLINK || s->status == UGREEN_LED_STATE_BREATH;
 
-            pr_info("probed led id %d, status %d, rgb 0x%02x%02x%02x, "
-                    "brightness %d, t_on %d, t_cycle %d\n", i, 
-                    state->status, state->r, state->g, state->b,
-                    state->brightness, state->t_on, state->t_cycle);
+    if (is_blinking)
+        truncate_blink_delay_time(&delay_on, &delay_off);
 
-            ugreen_led_set_brightness_unlock(priv, i, 128);
-            ugreen_led_set_color_unlock(priv, i, 0xff, 0xff, 0xff);
+    write_seqlock_irqsave(&state->desired_lock, flags);
 
+    if (s->fields & UGREEN_LED_IOCTL_COLOR)
+        ugreen_led_target_color(&state->desired, s->r, s->g, s->b);
+
+    if (s->fields & UGREEN_LED_IOCTL_MODE) {
+        if (is_blinking) {
+            ugreen_led_target_blink_or_breath(&state->desired, 
+                    (u16)delay_on, (u16)(delay_on + delay_off), 
+                    s->status == UGREEN_LED_STATE_BLINK);
+        } else {
+            ugreen_led_target_on_or_off(&state->desired, s->status == UGREEN_LED_STATE_ON);
         }
     }
 
-    i2c_set_clientdata(client, priv);
+    write_sequnlock_irqrestore(&state->desired_lock, flags);
+
+    // through the LED core like the brightness attribute, so that a blinking 
+    // trigger keeps the new brightness (0 turns the LED off after the mode)
+    if (s->fields & UGREEN_LED_IOCTL_BRIGHTNESS)
+        led_set_brightness(&state->cdev, s->brightness);
+
+    return 0;
+}
+
+static void ugreen_led_array_release(struct kref *refcount) {
+
+    struct ugreen_led_array *priv = container_of(refcount, struct ugreen_led_array, refcount);
+
+    mutex_destroy(&priv->bus_lock);
+    kfree(priv);
+}
+
+// misc_open() holds the misc lock while calling this, so the array cannot 
+// be removed meanwhile, and misc_deregister() waits for it
+static int ugreen_led_open(struct inode *inode, struct file *file) {
+
+    // misc_open() has set the private data to the misc device
+    struct miscdevice *misc = file->private_data;
+    struct ugreen_led_array *priv = container_of(misc, struct ugreen_led_array, misc);
+
+    kref_get(&priv->refcount);
+    file->private_data = priv;
+
+    return 0;
+}
+
+static int ugreen_led_release(struct inode *inode, struct file *file) {
+
+    struct ugreen_led_array *priv = file->private_data;
+
+    kref_put(&priv->refcount, ugreen_led_array_release);
+
+    return 0;
+}
+
+static long ugreen_led_set_states(struct ugreen_led_array *priv, unsigned long arg) {
+
+    struct ugreen_led_ioctl_batch req;
+    struct ugreen_led_batch batch;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+
+    if (req.reserved)
+        return -EINVAL;
+
+    if (req.count > UGREEN_LED_IOCTL_MAX_STATES)
+        return -E2BIG;
+
+    void __user *states = u64_to_user_ptr(req.states);
+    size_t size = req.count * sizeof(struct ugreen_led_ioctl_state);
+
+    if (copy_from_user(batch.states, states, size))
+        return -EFAULT;
+
+    batch.priv = priv;
+    batch.count = req.count;
+
+    for (u32 i = 0; i < batch.count; ++i) {
+        batch.states[i].result = ugreen_led_batch_set_desired(priv, batch.states + i);
+    }
+
+    INIT_WORK_ONSTACK(&batch.work, ugreen_led_batch_work);
+    queue_work(priv->wq, &batch.work);
+    flush_work(&batch.work);
+    destroy_work_on_stack(&batch.work);
+
+    if (copy_to_user(states, batch.states, size))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long ugreen_led_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 
-    mutex_lock(&priv->mutex);
+    struct ugreen_led_array *priv = file->private_data;
+    long rc;
+
+    if (cmd != UGREEN_LED_IOC_SET_STATES)
+        return -ENOTTY;
+
+    // the LEDs and the workqueue are only there until the client is removed
+    down_read(&priv->remove_lock);
+    rc = priv->removed ? -ENODEV : ugreen_led_set_states(priv, arg);
+    up_read(&priv->remove_lock);
+
+    return rc;
+}
+
+static const struct file_operations ugreen_led_fops = {
+    .owner          = THIS_MODULE,
+    .open           = ugreen_led_open,
+    .release        = ugreen_led_release,
+    .unlocked_ioctl = ugreen_led_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+    .compat_ioctl   = compat_ptr_ioctl,
+#endif
+};
+
+// Discover the LEDs and register the found ones, as the first work of the 
+// ordered workqueue, so that the missing LEDs of smaller models do not hold 
+// the probe with their retries. The initial states are written afterwards 
+// by the dispatch work, like any other update.
+static void ugreen_led_probe_work(struct work_struct *work) {
+
+    struct ugreen_led_array *priv = container_of(work, struct ugreen_led_array, probe_work);
+    struct i2c_client *client = priv->client;
+
+    // read all LEDs in one pass, so that missing ones share the retry delays
+    ugreen_led_get_state_all(priv);
+
+    for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
+
+        struct ugreen_led_state *state = priv->state + i;
+        state->desired = state->hw;
+
+        if (state->hw.status != UGREEN_LED_STATE_INVALID) {
+
+            pr_info("probed led id %d, status %d, rgb 0x%02x%02x%02x, "
+                    "brightness %d, t_on %d, t_cycle %d\n", i, 
+                    state->hw.status, state->hw.r, state->hw.g, state->hw.b,
+                    state->hw.brightness, state->hw.t_on, state->hw.t_cycle);
+
+            // brightness 128 and white, in one diffed update (nothing is sent 
+            // for the fields that already hold them)
+            if (!keep_state) {
+                ugreen_led_target_brightness(&state->desired, 128);
+                ugreen_led_target_color(&state->desired, 0xff, 0xff, 0xff);
+                set_bit(i, &priv->pending_alert);
+            }
+        }
+    }
 
     // register leds class devices
     const char *led_name[] = {
@@ -501,7 +1080,7 @@ static int ugreen_led_probe(struct i2c_client *client) {
     for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
 
         struct ugreen_led_state *state = priv->state + i;
-        if (state->status == UGREEN_LED_STATE_INVALID)
+        if (state->hw.status == UGREEN_LED_STATE_INVALID)
             continue;
 
         // register the brightness control
@@ -511,7 +1090,7 @@ static int ugreen_led_probe(struct i2c_client *client) {
 
         state->cdev.brightness = state->cdev.brightness;
         state->cdev.max_brightness = 0xff;
-        state->cdev.brightness_set_blocking = ugreen_led_set_brightness_blocking;
+        state->cdev.brightness_set = ugreen_led_set_brightness;
         state->cdev.brightness_get = ugreen_led_get_brightness;
         state->cdev.groups = ugreen_led_groups;
         state->cdev.blink_set = ugreen_led_set_blink;
@@ -525,7 +1104,68 @@ static int ugreen_led_probe(struct i2c_client *client) {
         led_classdev_register(&client->dev, &state->cdev);
     }
 
-    mutex_unlock(&priv->mutex);
+    // registered last, so that its presence tells that the LEDs are ready
+    // (they are still usable through sysfs if it cannot be registered)
+    priv->misc.minor = MISC_DYNAMIC_MINOR;
+    priv->misc.name = UGREEN_LED_SLAVE_NAME;
+    priv->misc.fops = &ugreen_led_fops;
+    priv->misc.mode = 0600;
+
+    if (misc_register(&priv->misc) == 0)
+        priv->misc_registered = true;
+    else
+        pr_err("failed to register %s", UGREEN_LED_DEVICE_PATH);
+
+    // the initial states, and whatever the default triggers have asked for
+    queue_work(priv->wq, &priv->dispatch_work);
+}
+
+static int ugreen_led_probe(struct i2c_client *client) {
+
+    pr_info ("i2c probed");
+
+    struct ugreen_led_array *priv;
+    
+    // not devm, since open files of the device may outlive the client
+    priv = kzalloc(sizeof(struct ugreen_led_array), GFP_KERNEL);
+    if (!priv) {
+        return -ENOMEM;
+    }
+
+    kref_init(&priv->refcount);
+    init_rwsem(&priv->remove_lock);
+
+    priv->client = client;
+    priv->ack_latency_us = UGREEN_LED_ACK_INITIAL_US;
+    priv->ack_measured_us = UGREEN_LED_ACK_INITIAL_US;
+
+    mutex_init(&priv->bus_lock);
+
+    // hardware updates requested by LED triggers and sysfs are flushed here
+    INIT_WORK(&priv->dispatch_work, ugreen_led_dispatch_work);
+    INIT_WORK(&priv->probe_work, ugreen_led_probe_work);
+    priv->wq = alloc_ordered_workqueue("%s", 0, UGREEN_LED_SLAVE_NAME);
+    if (!priv->wq) {
+        kref_put(&priv->refcount, ugreen_led_array_release);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
+
+        priv->state[i].priv = priv;
+        priv->state[i].led_id = i;
+
+        struct ugreen_led_state *state = priv->state + i;
+        seqlock_init(&state->hw_lock);
+        seqlock_init(&state->desired_lock);
+        spin_lock_init(&state->stats_lock);
+        INIT_DELAYED_WORK(&state->idle_work, ugreen_led_activity_idle_work);
+    }
+
+    i2c_set_clientdata(client, priv);
+
+    // probe and initialize leds asynchronously
+    queue_work(priv->wq, &priv->probe_work);
 
     return 0;
 }
@@ -539,16 +1179,36 @@ ugreen_led_remove(struct i2c_client *client) {
 
     struct ugreen_led_array *priv = i2c_get_clientdata(client);
 
+    // the LEDs are registered (or known to be missing) after this
+    flush_work(&priv->probe_work);
+
+    // opening the device fails from now on (open files keep the module and
+    // the array, but not the LEDs)
+    if (priv->misc_registered)
+        misc_deregister(&priv->misc);
+
+    // wait for the running ioctls, and fail those of the files still open
+    down_write(&priv->remove_lock);
+    priv->removed = true;
+    up_write(&priv->remove_lock);
+
     for (int i = 0; i < UGREEN_MAX_LED_NUMBER; ++i) {
 
         struct ugreen_led_state *state = priv->state + i;
-        if (state->status == UGREEN_LED_STATE_INVALID)
+        if (state->hw.status == UGREEN_LED_STATE_INVALID)
             continue;
 
         led_classdev_unregister(&state->cdev);
+        cancel_delayed_work_sync(&state->idle_work);
     }
 
-    mutex_destroy(&priv->mutex);
+    // unregistering turns the LEDs off, which must still reach the MCU
+    flush_work(&priv->dispatch_work);
+
+    destroy_workqueue(priv->wq);
+
+    // freed here, or when the last open file of the device is released
+    kref_put(&priv->refcount, ugreen_led_array_release);
 
     pr_info ("i2c removed");
 
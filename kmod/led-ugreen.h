@@ -2,8 +2,17 @@
 #define __UGREEN_LED_H
 
 #include <linux/types.h>
+#include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/leds.h>
+#include <linux/miscdevice.h>
+
+#include "led-ugreen-protocol.h"
+#include "led-ugreen-ioctl.h"
 
 
 #define MODULE_NAME             ( "led-ugreen" )
@@ -14,6 +23,17 @@
 #define UGREEN_MAX_LED_NUMBER           ( 10 )
 #define UGREEN_LED_CHANGE_STATE_RETRY_COUNT   ( 5 )
 
+// adaptive timing of waiting for the ack of a command
+#define UGREEN_LED_ACK_INITIAL_US       ( 500u )
+#define UGREEN_LED_ACK_MIN_POLL_US      ( 100u )
+#define UGREEN_LED_ACK_TIMEOUT_US       ( 8000u )
+
+// the default burst of bus_rate, in transfers
+#define UGREEN_LED_BUS_BURST_DEFAULT    ( 16 )
+
+// SMBus transfer latencies are counted in power-of-two microsecond buckets
+#define UGREEN_LED_LATENCY_BUCKETS      ( 16 )
+
 #define UGREEN_LED_STATE_OFF        ( 0 )
 #define UGREEN_LED_STATE_ON         ( 1 )
 #define UGREEN_LED_STATE_BLINK      ( 2 )
@@ -24,11 +44,41 @@ static const char *ugreen_led_state_name[] = { "off", "on", "blink", "breath", "
 
 struct ugreen_led_array;
 
-struct ugreen_led_state {
+// the state stored in the MCU
+struct ugreen_led_hw_state {
     u8 status;
     u8 r, g, b;
     u8 brightness;
     u16 t_on, t_cycle;
+};
+
+// counters of the SMBus transfers sent for a LED
+struct ugreen_led_stats {
+    u64 transactions;
+    u64 errors;
+    u64 retries;
+    u64 ack_failures;
+    u64 checksum_failures;
+    u64 latency[UGREEN_LED_LATENCY_BUCKETS];
+};
+
+struct ugreen_led_state {
+    // the cached state of the MCU, only written by the hardware writer
+    struct ugreen_led_hw_state hw;
+    seqlock_t hw_lock;
+
+    // the latest state requested by triggers or sysfs, which is written 
+    // to the MCU asynchronously by the dispatch work of the LED array
+    struct ugreen_led_hw_state desired;
+    seqlock_t desired_lock;
+
+    // blinking by the MCU for the oneshot trigger (protected by desired_lock)
+    bool offloading;
+    enum led_brightness activity_brightness;
+    struct delayed_work idle_work;
+
+    struct ugreen_led_stats stats;
+    spinlock_t stats_lock;
 
     u8 led_id;
     struct led_classdev cdev;
@@ -37,8 +87,38 @@ struct ugreen_led_state {
 
 struct ugreen_led_array {
     struct i2c_client *client;
-    struct mutex mutex;
+    // held only around single SMBus transfers, never across settle sleeps
+    struct mutex bus_lock;
+    struct workqueue_struct *wq;
     struct ugreen_led_state state[UGREEN_MAX_LED_NUMBER];
+
+    // bitmaps of LEDs whose desired states are waiting to be written
+    unsigned long pending_alert, pending_activity;
+    // where the round robin of activity updates continues (dispatch work only)
+    unsigned int next_activity;
+    struct work_struct dispatch_work;
+
+    // the discovery and registration of the LEDs, off the probe of the client
+    struct work_struct probe_work;
+
+    // learned ack latency in the adaptive timing mode, where polls start,
+    // and the average of the latencies measured after busy polls
+    unsigned int ack_latency_us;
+    unsigned int ack_measured_us;
+
+    // when the next transfer is due under bus_rate (hardware writer only)
+    ktime_t bus_tat;
+
+    // UGREEN_LED_DEVICE_PATH, for batches of states
+    struct miscdevice misc;
+    bool misc_registered;
+
+    // The array outlives the client while files of the device are open.
+    // removed is set under remove_lock (held for reading by ioctls) before 
+    // the LEDs and the workqueue go away, and fails later ioctls.
+    struct kref refcount;
+    struct rw_semaphore remove_lock;
+    bool removed;
 };
 
 